@@ -0,0 +1,262 @@
+/**
+ * @file bench.cpp
+ * @brief Benchmark harness: runs the workloads in-process and reports JSON lines
+ *
+ * Every workload is a Scheme program with its expected output. Most are the
+ * .scm/.out pairs in bench/; "quoted" (one large quoted literal) and
+ * "defines" (thousands of top-level defines) are generated here. Each run
+ * reads and evaluates the whole program in a fresh Interpreter, exactly like
+ * the command-line interpreter runs a file, and checks the output.
+ *
+ * Per workload one line is printed:
+ *
+ *   {"workload":"fib","engine":"tree","runs":5,"best_ms":..,"median_ms":..,
+ *    "allocations":..,"peak_rss_kb":..,"ok":true}
+ *
+ * allocations is the number of managed objects one run allocates. Each
+ * workload runs in a child process of its own, so peak_rss_kb is the peak
+ * of that workload alone; with --no-fork everything runs in this process
+ * and it is the peak so far.
+ *
+ * With --baseline FILE, an earlier output of this program, a line also gets
+ * baseline_ms and ratio (best_ms over the baseline's), and "regression":true
+ * when the ratio exceeds --threshold (1.10 by default).
+ *
+ * The exit status is 1 if a workload printed the wrong output, crashed or
+ * regressed.
+ */
+
+#include "interpreter.hpp"
+#include "gc.hpp"
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#ifndef BENCH_DIR
+#define BENCH_DIR "bench"
+#endif
+
+namespace {
+
+struct Workload {
+    std::string name;
+    std::string source;
+    std::string expected;
+};
+
+struct Result {
+    std::vector<double> millis;
+    size_t allocations = 0;
+    bool ok = true;
+};
+
+// bench/下的程序, 按报告顺序
+const char *const FILE_WORKLOADS[] = {
+    "fib", "tak", "ackermann", "nqueens", "lists", "mutation", "rational", "closures",
+};
+
+const int QUOTED_ITEMS = 20000;
+const int DEFINES = 5000;
+
+bool readFile(const std::string &path, std::string &text) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) return false;
+    text.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    return true;
+}
+
+// (define data '((0 a "item" (0 . #t)) (1 a "item" (1 . #t)) ...)), 然后数元素
+Workload quotedWorkload() {
+    std::ostringstream src;
+    src << "(define data '(";
+    for (int i = 0; i < QUOTED_ITEMS; ++i) src << "(" << i << " a \"item\" (" << i << " . #t))\n";
+    src << "))\n"
+        << "(define (len l acc) (if (null? l) acc (len (cdr l) (+ acc 1))))\n"
+        << "(len data 0)\n"
+        << "(car (car (cdr data)))\n";
+    std::ostringstream expected;
+    expected << QUOTED_ITEMS << "\n" << 1 << "\n";
+    return Workload{"quoted", src.str(), expected.str()};
+}
+
+// v0 ... vN-1 和调用它们的 f0 ... fN-1, 最后一个表达式用到首尾两个
+Workload definesWorkload() {
+    std::ostringstream src;
+    for (int i = 0; i < DEFINES; ++i) {
+        src << "(define v" << i << " " << i << ")\n"
+            << "(define (f" << i << " x) (+ x v" << i << "))\n";
+    }
+    src << "(+ (f0 1) (f" << DEFINES - 1 << " 1))\n";
+    std::ostringstream expected;
+    expected << 1 + DEFINES << "\n";
+    return Workload{"defines", src.str(), expected.str()};
+}
+
+double maxRssKb() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return double(usage.ru_maxrss);   // Linux上单位是KB
+}
+
+Result runWorkload(const Workload &w, int runs, bool vm) {
+    typedef std::chrono::steady_clock Clock;
+    Result r;
+    for (int i = 0; i < runs; ++i) {
+        std::ostringstream sink;
+        Clock::time_point start, end;
+        {
+            Interpreter interpreter(sink, vm);
+            size_t allocated = gcTotalAllocated;
+            start = Clock::now();
+            interpreter.eval(w.source);
+            end = Clock::now();
+            r.allocations = gcTotalAllocated - allocated;
+        } // 析构时回收环境里的环, 下一次运行从空堆开始
+        r.millis.push_back(std::chrono::duration<double, std::milli>(end - start).count());
+        if (sink.str() != w.expected) r.ok = false;
+    }
+    return r;
+}
+
+std::string jsonLine(const Workload &w, bool vm, const Result &r, double rssKb,
+                     const std::map<std::string, double> &baseline, double threshold, bool &regressed) {
+    std::vector<double> sorted = r.millis;
+    std::sort(sorted.begin(), sorted.end());
+    double best = sorted.front(), median = sorted[sorted.size() / 2];
+    std::ostringstream os;
+    os.setf(std::ios::fixed);
+    os.precision(3);
+    os << "{\"workload\":\"" << w.name << "\",\"engine\":\"" << (vm ? "vm" : "tree") << "\""
+       << ",\"runs\":" << r.millis.size() << ",\"best_ms\":" << best << ",\"median_ms\":" << median
+       << ",\"allocations\":" << r.allocations << ",\"peak_rss_kb\":" << long(rssKb)
+       << ",\"ok\":" << (r.ok ? "true" : "false");
+    auto it = baseline.find(w.name);
+    if (it != baseline.end() && it->second > 0) {
+        double ratio = best / it->second;
+        regressed = ratio > threshold;
+        os << ",\"baseline_ms\":" << it->second << ",\"ratio\":" << ratio
+           << ",\"regression\":" << (regressed ? "true" : "false");
+    }
+    os << "}";
+    return os.str();
+}
+
+// 只认本程序自己写出的行: 取同一engine下每个workload的best_ms
+bool readBaseline(const std::string &path, bool vm, std::map<std::string, double> &baseline) {
+    std::ifstream in(path);
+    if (!in) return false;
+    std::string engine = std::string("\"engine\":\"") + (vm ? "vm" : "tree") + "\"";
+    std::string line;
+    while (std::getline(in, line)) {
+        size_t name = line.find("\"workload\":\"");
+        size_t best = line.find("\"best_ms\":");
+        if (name == std::string::npos || best == std::string::npos) continue;
+        if (line.find(engine) == std::string::npos) continue;
+        name += std::strlen("\"workload\":\"");
+        baseline[line.substr(name, line.find('"', name) - name)] =
+            std::atof(line.c_str() + best + std::strlen("\"best_ms\":"));
+    }
+    return true;
+}
+
+int usage(const char *argv0) {
+    std::cerr << "usage: " << argv0 << " [--vm] [--runs N] [--no-fork] [--dir DIR]"
+              << " [--baseline FILE] [--threshold RATIO] [WORKLOAD...]\n";
+    return 1;
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+    bool vm = false, fork_each = true;
+    int runs = 5;
+    double threshold = 1.10;
+    std::string dir = BENCH_DIR;
+    const char *baselinePath = nullptr;
+    std::vector<std::string> only;
+    for (int i = 1; i < argc; ++i) {
+        if (std::strcmp(argv[i], "--vm") == 0) vm = true;
+        else if (std::strcmp(argv[i], "--no-fork") == 0) fork_each = false;
+        else if (std::strcmp(argv[i], "--runs") == 0 && i + 1 < argc) runs = std::max(1, std::atoi(argv[++i]));
+        else if (std::strcmp(argv[i], "--dir") == 0 && i + 1 < argc) dir = argv[++i];
+        else if (std::strcmp(argv[i], "--baseline") == 0 && i + 1 < argc) baselinePath = argv[++i];
+        else if (std::strcmp(argv[i], "--threshold") == 0 && i + 1 < argc) threshold = std::atof(argv[++i]);
+        else if (argv[i][0] != '-') only.push_back(argv[i]);
+        else return usage(argv[0]);
+    }
+
+    std::vector<Workload> workloads;
+    for (const char *name : FILE_WORKLOADS) {
+        Workload w;
+        w.name = name;
+        if (!readFile(dir + "/" + name + ".scm", w.source) || !readFile(dir + "/" + name + ".out", w.expected)) {
+            std::cerr << "cannot read workload " << dir << "/" << name << ".scm/.out\n";
+            return 1;
+        }
+        workloads.push_back(w);
+    }
+    workloads.push_back(quotedWorkload());
+    workloads.push_back(definesWorkload());
+    if (!only.empty()) {
+        std::vector<Workload> chosen;
+        for (auto &name : only) {
+            auto it = std::find_if(workloads.begin(), workloads.end(),
+                                   [&](const Workload &w) { return w.name == name; });
+            if (it == workloads.end()) {
+                std::cerr << "unknown workload " << name << "\n";
+                return 1;
+            }
+            chosen.push_back(*it);
+        }
+        workloads.swap(chosen);
+    }
+
+    std::map<std::string, double> baseline;
+    if (baselinePath != nullptr && !readBaseline(baselinePath, vm, baseline)) {
+        std::cerr << "cannot read baseline " << baselinePath << "\n";
+        return 1;
+    }
+
+    bool ok = true;
+    for (auto &w : workloads) {
+        if (!fork_each) {
+            Result r = runWorkload(w, runs, vm);
+            bool regressed = false;
+            std::cout << jsonLine(w, vm, r, maxRssKb(), baseline, threshold, regressed) << std::endl;
+            ok = ok && r.ok && !regressed;
+            continue;
+        }
+        std::cout.flush();
+        pid_t pid = fork();
+        if (pid < 0) {
+            std::cerr << "fork failed\n";
+            return 1;
+        }
+        if (pid == 0) {
+            Result r = runWorkload(w, runs, vm);
+            bool regressed = false;
+            std::cout << jsonLine(w, vm, r, maxRssKb(), baseline, threshold, regressed) << std::endl;
+            _exit(r.ok && !regressed ? 0 : 3);
+        }
+        int status = 0;
+        waitpid(pid, &status, 0);
+        if (!WIFEXITED(status) || (WEXITSTATUS(status) != 0 && WEXITSTATUS(status) != 3)) {
+            // 子进程崩溃或抛出了未捕获的异常: 仍输出一行
+            std::cout << "{\"workload\":\"" << w.name << "\",\"engine\":\"" << (vm ? "vm" : "tree")
+                      << "\",\"ok\":false,\"error\":\"crashed\"}" << std::endl;
+        }
+        ok = ok && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,13 @@
+; 循环中创建闭包: 捕获参数, 以及被set!修改而装箱的变量
+(define (adder n) (lambda (x) (+ x n)))
+(define (sum-adders k acc)
+  (if (= k 0) acc (sum-adders (- k 1) ((adder k) acc))))
+(define (make-counter)
+  (let ((n 0))
+    (lambda () (set! n (+ n 1)) n)))
+(define (run-counter c k)
+  (if (= k 0) (c) (begin (c) (run-counter c (- k 1)))))
+(define (counters k acc)
+  (if (= k 0) acc (counters (- k 1) (+ acc (run-counter (make-counter) 10)))))
+(sum-adders 100000 0)
+(counters 20000 0)
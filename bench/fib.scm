@@ -0,0 +1,6 @@
+; 树形递归: 调用开销
+(define (fib n)
+  (if (< n 2)
+      n
+      (+ (fib (- n 1)) (fib (- n 2)))))
+(fib 25)
@@ -0,0 +1,14 @@
+; 用cons/list构造长列表, 以及非尾递归的map
+(define (build n acc)
+  (if (= n 0) acc (build (- n 1) (cons (list n n) acc))))
+(define (len l acc)
+  (if (null? l) acc (len (cdr l) (+ acc 1))))
+(define (rev l acc)
+  (if (null? l) acc (rev (cdr l) (cons (car l) acc))))
+(define (my-map f l)
+  (if (null? l) '() (cons (f (car l)) (my-map f (cdr l)))))
+(define big (build 200000 '()))
+(len (rev big '()) 0)
+(car (car big))
+(define small (build 10000 '()))
+(len (my-map car small) 0)
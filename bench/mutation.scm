@@ -0,0 +1,20 @@
+; 反复set-car!/set-cdr!原地修改同一个列表
+(define (make n acc)
+  (if (= n 0) acc (make (- n 1) (cons 0 acc))))
+(define cells (make 1000 '()))
+(define (bump l)
+  (if (null? l)
+      'ok
+      (begin (set-car! l (+ (car l) 1))
+             (bump (cdr l)))))
+(define (relink l)
+  (if (null? (cdr l))
+      'ok
+      (begin (set-cdr! l (cdr l))
+             (relink (cdr l)))))
+(define (repeat k)
+  (if (= k 0)
+      'done
+      (begin (bump cells) (relink cells) (repeat (- k 1)))))
+(repeat 300)
+(car cells)
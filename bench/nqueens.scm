@@ -0,0 +1,20 @@
+; 八皇后: 内部define、and短路和列表
+(define (queens board-size)
+  (define (place k placed)
+    (if (= k 0)
+        1
+        (try-columns board-size k placed)))
+  (define (try-columns col k placed)
+    (if (= col 0)
+        0
+        (+ (if (safe? col 1 placed) (place (- k 1) (cons col placed)) 0)
+           (try-columns (- col 1) k placed))))
+  (define (safe? col dist placed)
+    (if (null? placed)
+        #t
+        (and (not (= (car placed) col))
+             (not (= (car placed) (+ col dist)))
+             (not (= (car placed) (- col dist)))
+             (safe? col (+ dist 1) (cdr placed)))))
+  (place board-size '()))
+(queens 8)
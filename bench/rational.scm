@@ -0,0 +1,7 @@
+; 有理数运算: 调和级数与大分子分母
+(define (harmonic n acc)
+  (if (= n 0) acc (harmonic (- n 1) (+ acc (/ 1 n)))))
+(harmonic 300 0)
+(define (alternating n acc)
+  (if (= n 0) acc (alternating (- n 1) (- (* acc (/ 3 2)) (/ n 7)))))
+(< (alternating 60 1) 0)
@@ -0,0 +1,117 @@
+#!/bin/bash
+
+echo "Checks saving and restoring images, and running through the parse cache"
+echo "--------------------------------------------------------------------------------"
+
+# 参数原样传给解释器, 例如 ./persist.sh --vm
+
+# 确保我们在score目录下
+cd "$(dirname "$0")"
+
+CODE=../build/code
+OUT=out/persist
+rm -rf $OUT
+mkdir -p $OUT/image $OUT/miss $OUT/hit $OUT/vm $OUT/flipped $OUT/corrupt
+
+failed=0
+fail() {
+    echo "FAILED: $1"
+    failed=1
+}
+
+# put_byte <文件> <偏移> <值>: 原地改写一个字节
+put_byte() {
+    printf "\\$(printf %o $3)" | dd of=$1 bs=1 seek=$2 conv=notrunc 2> /dev/null
+}
+
+# byte_at <文件> <偏移>
+byte_at() {
+    od -An -tu1 -j $2 -N 1 $1 | tr -d ' '
+}
+
+# dir中的每个<编号>.out都应与data/下的相同
+check_data() {
+    for f in data/*.out; do
+        if ! diff -b $1/$(basename $f) $f > /dev/null; then
+            fail "$2: $f"
+        fi
+    done
+}
+
+# 映像: 保存defs.scm定义的环境, 在恢复的环境中运行use.scm
+echo "Ready to test: IMAGE"
+$CODE "$@" --save-image $OUT/test.img -o $OUT/image persist/defs.scm || fail "saving the image"
+diff -b $OUT/image/defs.out persist/defs.out > /dev/null || fail "output before saving the image"
+$CODE "$@" --image $OUT/test.img -o $OUT/image persist/use.scm || fail "restoring the image"
+diff -b $OUT/image/use.out persist/use.out > /dev/null || fail "output after restoring the image"
+# 每次运行都从映像开始, 上一次的修改不影响下一次
+$CODE "$@" --image $OUT/test.img persist/use.scm | diff -b - persist/use.out > /dev/null || fail "second run from the image"
+$CODE "$@" --vm --image $OUT/test.img persist/use.scm | diff -b - persist/use.out > /dev/null || fail "image restored under --vm"
+
+# 损坏的槽位: 映像中(lambda (a b) b)里变量b的记录以深度0, 槽位1, 非全局结尾, 编码为 0 2 0;
+# 把槽位改为超出帧的3或负数-2, 恢复时应报告映像损坏, 而不是在运行时越界读取
+echo "(define (second a b) b)" > $OUT/slot.scm
+echo "(second 1 2)" > $OUT/slot-use.scm
+$CODE "$@" --save-image $OUT/slot.img $OUT/slot.scm || fail "saving the slot image"
+[ "$($CODE "$@" --image $OUT/slot.img $OUT/slot-use.scm)" = "2" ] || fail "slot image before corrupting it"
+bytes=($(od -An -v -tu1 $OUT/slot.img))
+at=-1
+for ((i = 0; i + 3 < ${#bytes[@]}; i = i + 1)); do
+    if [ "${bytes[*]:$i:4}" = "2 0 2 0" ]; then at=$((i + 2)); fi
+done
+if [ $at -lt 0 ]; then
+    fail "no slot record in the slot image"
+else
+    for slot in 6 3; do
+        cp $OUT/slot.img $OUT/bad-slot.img
+        put_byte $OUT/bad-slot.img $at $slot
+        $CODE "$@" --image $OUT/bad-slot.img $OUT/slot-use.scm > /dev/null 2>&1
+        [ $? -eq 2 ] || fail "image with a corrupted slot"
+    done
+fi
+
+# 解析缓存: 第一次全部未命中并写入, 第二次全部命中, 之后在--vm下命中
+echo "Ready to test: PARSE CACHE"
+CACHE=$OUT/cache
+$CODE "$@" --parse-cache $CACHE -o $OUT/miss data/*.in
+check_data $OUT/miss "parse cache miss"
+entries=$(ls $CACHE | wc -l)
+[ $entries -gt 0 ] || fail "parse cache miss wrote no entries"
+$CODE "$@" --parse-cache $CACHE -o $OUT/hit data/*.in
+check_data $OUT/hit "parse cache hit"
+[ $(ls $CACHE | wc -l) -eq $entries ] || fail "parse cache hit wrote new entries"
+$CODE "$@" --vm --parse-cache $CACHE -o $OUT/vm data/*.in
+check_data $OUT/vm "parse cache hit under --vm"
+[ $(ls $CACHE | wc -l) -eq $entries ] || fail "parse cache hit under --vm wrote new entries"
+
+# 从映像开始的运行有自己的条目
+$CODE "$@" --image $OUT/test.img --parse-cache $CACHE persist/use.scm | diff -b - persist/use.out > /dev/null || fail "parse cache miss from the image"
+$CODE "$@" --image $OUT/test.img --parse-cache $CACHE persist/use.scm | diff -b - persist/use.out > /dev/null || fail "parse cache hit from the image"
+[ $(ls $CACHE | wc -l) -eq $((entries + 1)) ] || fail "parse cache from the image"
+
+# 内容损坏的条目由开头的散列发现: 当作未命中, 重新解析后写回原样
+rm -rf $OUT/cache-good
+cp -r $CACHE $OUT/cache-good
+for f in $CACHE/*; do
+    middle=$(($(stat -c %s $f) / 2))
+    put_byte $f $middle $(($(byte_at $f $middle) ^ 1))
+done
+$CODE "$@" --parse-cache $CACHE -o $OUT/flipped data/*.in
+check_data $OUT/flipped "parse cache with a flipped byte"
+$CODE "$@" --image $OUT/test.img --parse-cache $CACHE persist/use.scm | diff -b - persist/use.out > /dev/null || fail "parse cache from the image with a flipped byte"
+for f in $OUT/cache-good/*; do
+    cmp -s $f $CACHE/$(basename $f) || fail "parse cache entry with a flipped byte not written again: $(basename $f)"
+done
+
+# 截断的条目同样当作未命中
+for f in $CACHE/*; do
+    head -c 20 $f > $f.tmp && mv $f.tmp $f
+done
+$CODE "$@" --parse-cache $CACHE -o $OUT/corrupt data/*.in
+check_data $OUT/corrupt "corrupted parse cache"
+
+echo "--------------------------------------------------------------------------------"
+if [ $failed -ne 0 ]; then
+    exit 1
+fi
+echo "All persistence tests passed"
@@ -0,0 +1,20 @@
+(define (make-counter)
+  (let ((n 0))
+    (lambda () (set! n (+ n 1)) n)))
+(define counter (make-counter))
+(counter)
+(counter)
+(define shared (let ((n 100)) (cons (lambda () (set! n (+ n 1)) n) (lambda () n))))
+(define (ev? n) (if (= n 0) #t (od? (- n 1))))
+(define (od? n) (if (= n 0) #f (ev? (- n 1))))
+(define-syntax swap!
+  (syntax-rules ()
+    ((_ a b) (let ((tmp a)) (set! a b) (set! b tmp)))))
+(define data '(1 "two" (3 . 4) #t sym))
+(define big (expt 3 100))
+(define ratio (/ big (expt 2 70)))
+(define v (vector 1 2 3))
+(define h (make-hash-table))
+(hash-set! h 'key 'value)
+(define cyc (list 1 2))
+(set-cdr! (cdr cyc) cyc)
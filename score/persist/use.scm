@@ -0,0 +1,15 @@
+(counter)
+((car shared))
+((cdr shared))
+(ev? 100)
+(define x 1)
+(define y 2)
+(swap! x y)
+(list x y)
+data
+big
+ratio
+(vector-ref v 2)
+(hash-ref h 'key)
+(list? cyc)
+(car (cdr (cdr cyc)))
@@ -3,11 +3,19 @@
 echo "This is a simple score shell script for you to find out problems in your program"
 echo "--------------------------------------------------------------------------------"
 
+# 参数原样传给解释器, 例如 ./score.sh --vm
+
 # 确保我们在score目录下
 cd "$(dirname "$0")"
 
+# 所有测试在同一个进程中批量运行, 每个输入的结果写到 out/<目录>/<编号>.out
+rm -rf out
+mkdir -p out/data out/more-tests
+../build/code "$@" -o out/data data/*.in
+../build/code "$@" -o out/more-tests more-tests/*.in
+
 L=1
-R=118
+R=128
 for ((i = $L; i <= $R; i = i + 1))
 do
     echo ""
@@ -21,14 +29,7 @@ do
         echo "Output file data/$i.out not found, skipping TEST $i"
         continue
     fi
-    ../build/code << EOF > scm.out
-    $(cat data/$i.in)
-    (exit)
-EOF
-    sed '$d' scm.out > scm_cleaned.out
-    mv scm_cleaned.out scm.out
-    sed 's/scm> //' scm.out > scm_cleaned.out
-    mv scm_cleaned.out scm.out
+    cp out/data/$i.out scm.out
     diff -b scm.out data/$i.out > diff_output.txt
     if [ $? -ne 0 ]; then
         echo "Wrong answer in TEST" $i
@@ -55,14 +56,7 @@ do
         echo "Output file more-tests/$i.out not found, skipping EXTRA TEST $i"
         continue
     fi
-    ../build/code << EOF > scm.out
-    $(cat more-tests/$i.in)
-    (exit)
-EOF
-    sed '$d' scm.out > scm_cleaned.out
-    mv scm_cleaned.out scm.out
-    sed 's/scm> //' scm.out > scm_cleaned.out
-    mv scm_cleaned.out scm.out
+    cp out/more-tests/$i.out scm.out
     diff -b scm.out more-tests/$i.out > diff_output.txt
     if [ $? -ne 0 ]; then
         echo "Wrong answer in EXTRA TEST" $i
@@ -20,12 +20,17 @@
  * - Arithmetic: +, -, *, /, modulo, expt
  * - Comparison: <, <=, =, >=, >
  * - List operations: cons, car, cdr, list, set-car!, set-cdr!
+ * - Vector operations: make-vector, vector, vector-length, vector-ref, vector-set!,
+ *   vector->list, list->vector
+ * - Hash tables: make-hash-table, hash-ref, hash-set!, hash-count
  * - Logic: not, and, or (and/or support short-circuit evaluation)
- * - Type predicates: eq?, boolean?, number?, null?, pair?, procedure?, symbol?, list?, string?
+ * - Type predicates: eq?, boolean?, number?, null?, pair?, procedure?, symbol?, list?, string?, vector?
  * - I/O: display
  * - Control: void, exit
+ * - Parallel evaluation: future, touch, parallel-map
+ * - Runtime statistics: runtime-stats
  */
-std::map<std::string, ExprType> primitives = {
+extern const std::map<std::string, ExprType> primitives = { // 只读, 各线程共用
     // Arithmetic operations
     {"+",        E_PLUS},
     {"-",        E_MINUS},
@@ -49,6 +54,21 @@ std::map<std::string, ExprType> primitives = {
     {"set-car!",  E_SETCAR},
     {"set-cdr!",  E_SETCDR},
 
+    // Vector operations
+    {"make-vector",   E_MAKE_VECTOR},
+    {"vector",        E_VECTOR},
+    {"vector-length", E_VECTOR_LENGTH},
+    {"vector-ref",    E_VECTOR_REF},
+    {"vector-set!",   E_VECTOR_SET},
+    {"vector->list",  E_VECTOR_TO_LIST},
+    {"list->vector",  E_LIST_TO_VECTOR},
+
+    // Hash table operations
+    {"make-hash-table", E_MAKE_HASH_TABLE},
+    {"hash-ref",        E_HASH_REF},
+    {"hash-set!",       E_HASH_SET},
+    {"hash-count",      E_HASH_COUNT},
+
     // Logic operations
     {"not",       E_NOT},
     {"and",       E_AND},
@@ -64,13 +84,22 @@ std::map<std::string, ExprType> primitives = {
     {"symbol?",    E_SYMBOLQ},
     {"list?",      E_LISTQ},
     {"string?",    E_STRINGQ},
+    {"vector?",    E_VECTORQ},
     
     // I/O operations
     {"display",   E_DISPLAY},
     
     // Special values and control
     {"void",      E_VOID},
-    {"exit",      E_EXIT}
+    {"exit",      E_EXIT},
+
+    // Parallel evaluation
+    {"future",       E_FUTURE},
+    {"touch",        E_TOUCH},
+    {"parallel-map", E_PARALLEL_MAP},
+
+    // Runtime statistics
+    {"runtime-stats", E_RUNTIME_STATS}
 };
 
 /**
@@ -85,13 +114,15 @@ std::map<std::string, ExprType> primitives = {
  * - Conditional : if, cond
  * - Function definition: lambda
  * - Variable and function definition: define
+ * - Macro definition: define-syntax (syntax-rules; the binders of a template
+ *   are renamed and its free identifiers mean what they mean at top level)
  * - Binding constructs: let, letrec
  * - Assignment: set!
  * 
  * Note: and/or have been moved to primitives to support function-style usage
  * while maintaining their short-circuit evaluation behavior.
  */
-std::map<std::string, ExprType> reserved_words = {
+extern const std::map<std::string, ExprType> reserved_words = {
     // Control flow constructs
     {"begin",   E_BEGIN},    
     {"quote",   E_QUOTE},    
@@ -105,6 +136,7 @@ std::map<std::string, ExprType> reserved_words = {
 
     // Variable and function definition
     {"define",  E_DEFINE},   
+    {"define-syntax", E_DEFINE_SYNTAX},
 
     // Binding constructs
     {"let",     E_LET},      
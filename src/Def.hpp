@@ -15,13 +15,51 @@
 #include <vector>
 #include <iostream>
 #include <map>
+#include <memory>
 
 // Forward declarations
 struct Syntax;
 struct Expr;
 struct Value;
+struct ValueBase;
 struct AssocList;
 struct Assoc;
+struct Symbol;
+struct Macro;
+
+/**
+ * @brief Interned identifier
+ *
+ * Every name is interned (see intern() in value.hpp), so two names are equal
+ * exactly when the pointers are, and the same object is the symbol value a
+ * quote of the name produces.
+ */
+typedef Symbol *Name;
+
+/**
+ * @brief Slot names of an environment frame
+ *
+ * Built once by the parser for every lambda/let/letrec and shared by all the
+ * frames created from it.
+ */
+typedef std::shared_ptr<const std::vector<Name>> FrameNames;
+
+/**
+ * @brief Syntax types enumeration
+ *
+ * Tags the nodes produced by the reader so that the parser and quote can
+ * dispatch on them with a switch instead of a chain of casts.
+ */
+enum SyntaxType {
+    S_NUMBER,
+    S_BIGNUM,
+    S_RATIONAL,
+    S_TRUE,
+    S_FALSE,
+    S_SYMBOL,
+    S_STRING,
+    S_LIST
+};
 
 /**
  * @brief Expression types enumeration
@@ -32,6 +70,7 @@ struct Assoc;
 enum ExprType {
     // Basic types and literals
     E_FIXNUM,          
+    E_BIGNUM,
     E_RATIONAL,        
     E_STRING,         
     E_TRUE,            
@@ -62,6 +101,21 @@ enum ExprType {
     E_SETCAR,          
     E_SETCDR,          
 
+    // Vector operations
+    E_MAKE_VECTOR,
+    E_VECTOR,
+    E_VECTOR_LENGTH,
+    E_VECTOR_REF,
+    E_VECTOR_SET,
+    E_VECTOR_TO_LIST,
+    E_LIST_TO_VECTOR,
+
+    // Hash table operations
+    E_MAKE_HASH_TABLE,
+    E_HASH_REF,
+    E_HASH_SET,
+    E_HASH_COUNT,
+
     // Logic operations
     E_NOT,              
     E_AND,             
@@ -77,6 +131,7 @@ enum ExprType {
     E_SYMBOLQ,         
     E_LISTQ,                
     E_STRINGQ,          
+    E_VECTORQ,
 
     // Control flow constructs
     E_BEGIN,          
@@ -91,6 +146,7 @@ enum ExprType {
     E_APPLY,           
     E_LAMBDA,         
     E_DEFINE,          
+    E_DEFINE_SYNTAX,
 
     // Binding constructs
     E_LET,            
@@ -101,6 +157,25 @@ enum ExprType {
 
     // I/O operations
     E_DISPLAY,         
+
+    // Parallel evaluation
+    E_FUTURE,
+    E_TOUCH,
+    E_PARALLEL_MAP,
+
+    // Runtime statistics
+    E_RUNTIME_STATS,
+
+    // Variadic forms of the arithmetic and comparison operations
+    E_PLUS_VAR,
+    E_MINUS_VAR,
+    E_MUL_VAR,
+    E_DIV_VAR,
+    E_LT_VAR,
+    E_LE_VAR,
+    E_EQ_VAR,
+    E_GE_VAR,
+    E_GT_VAR,
 };
 
 /**
@@ -111,13 +186,19 @@ enum ExprType {
  */
 enum ValueType {
     V_INT,              
+    V_BIGNUM,
     V_RATIONAL,         
     V_BOOL,             
     V_SYM,              
     V_NULL,             
     V_STRING,           
     V_PAIR,             
+    V_VECTOR,
+    V_HASH_TABLE,
     V_PROC,             
+    V_PRIM,
+    V_FUTURE,
+    V_BOX,
     V_VOID,            
     V_TERMINATE        
 };
@@ -0,0 +1,325 @@
+/**
+ * @file bigint.cpp
+ * @brief Limb arithmetic for BigInt
+ *
+ * The magnitude routines work on unsigned limb vectors; the public operators
+ * only combine them with signs. Division is Knuth's algorithm D.
+ */
+
+#include "bigint.hpp"
+#include "RE.hpp"
+#include <algorithm>
+#include <climits>
+
+namespace {
+
+typedef std::vector<uint32_t> Mag;
+
+const size_t KARATSUBA_THRESHOLD = 32; // 两个乘数都至少这么多limb时才用Karatsuba
+
+void trim(Mag &a) {
+    while (!a.empty() && a.back() == 0) a.pop_back();
+}
+
+int cmpMag(const Mag &a, const Mag &b) {
+    if (a.size() != b.size()) return a.size() < b.size() ? -1 : 1;
+    for (size_t i = a.size(); i-- > 0;) {
+        if (a[i] != b[i]) return a[i] < b[i] ? -1 : 1;
+    }
+    return 0;
+}
+
+Mag addMag(const Mag &a, const Mag &b) {
+    const Mag &x = a.size() >= b.size() ? a : b;
+    const Mag &y = a.size() >= b.size() ? b : a;
+    Mag r(x.size() + 1);
+    uint64_t carry = 0;
+    for (size_t i = 0; i < x.size(); ++i) {
+        uint64_t s = (uint64_t)x[i] + (i < y.size() ? y[i] : 0) + carry;
+        r[i] = (uint32_t)s;
+        carry = s >> 32;
+    }
+    r[x.size()] = (uint32_t)carry;
+    trim(r);
+    return r;
+}
+
+// a - b, requires a >= b
+Mag subMag(const Mag &a, const Mag &b) {
+    Mag r(a.size());
+    int64_t borrow = 0;
+    for (size_t i = 0; i < a.size(); ++i) {
+        int64_t d = (int64_t)a[i] - (i < b.size() ? b[i] : 0) - borrow;
+        borrow = d < 0;
+        r[i] = (uint32_t)d;
+    }
+    trim(r);
+    return r;
+}
+
+// r += a << (32 * shift), r must be large enough
+void addShifted(Mag &r, const Mag &a, size_t shift) {
+    uint64_t carry = 0;
+    size_t i = 0;
+    for (; i < a.size(); ++i) {
+        uint64_t s = (uint64_t)r[i + shift] + a[i] + carry;
+        r[i + shift] = (uint32_t)s;
+        carry = s >> 32;
+    }
+    for (size_t k = i + shift; carry != 0; ++k) {
+        uint64_t s = (uint64_t)r[k] + carry;
+        r[k] = (uint32_t)s;
+        carry = s >> 32;
+    }
+}
+
+Mag mulSchool(const Mag &a, const Mag &b) {
+    if (a.empty() || b.empty()) return Mag();
+    Mag r(a.size() + b.size());
+    for (size_t i = 0; i < a.size(); ++i) {
+        uint64_t carry = 0;
+        for (size_t j = 0; j < b.size(); ++j) {
+            uint64_t t = (uint64_t)a[i] * b[j] + r[i + j] + carry;
+            r[i + j] = (uint32_t)t;
+            carry = t >> 32;
+        }
+        r[i + b.size()] = (uint32_t)carry;
+    }
+    trim(r);
+    return r;
+}
+
+Mag slice(const Mag &a, size_t from, size_t to) {
+    from = std::min(from, a.size());
+    to = std::min(to, a.size());
+    Mag r(a.begin() + from, a.begin() + to);
+    trim(r);
+    return r;
+}
+
+Mag mulMag(const Mag &a, const Mag &b) {
+    if (std::min(a.size(), b.size()) < KARATSUBA_THRESHOLD) return mulSchool(a, b);
+
+    // a = a1*B^m + a0, b = b1*B^m + b0
+    size_t m = std::max(a.size(), b.size()) / 2;
+    Mag a0 = slice(a, 0, m), a1 = slice(a, m, a.size());
+    Mag b0 = slice(b, 0, m), b1 = slice(b, m, b.size());
+
+    Mag z0 = mulMag(a0, b0);
+    Mag z2 = mulMag(a1, b1);
+    Mag z1 = subMag(subMag(mulMag(addMag(a0, a1), addMag(b0, b1)), z0), z2); // a0*b1 + a1*b0
+
+    Mag r(a.size() + b.size() + 1);
+    addShifted(r, z0, 0);
+    addShifted(r, z1, m);
+    addShifted(r, z2, 2 * m);
+    trim(r);
+    return r;
+}
+
+// Divides by a single limb in place, returns the remainder
+uint32_t divSmall(Mag &a, uint32_t d) {
+    uint64_t rem = 0;
+    for (size_t i = a.size(); i-- > 0;) {
+        uint64_t cur = rem << 32 | a[i];
+        a[i] = (uint32_t)(cur / d);
+        rem = cur % d;
+    }
+    trim(a);
+    return (uint32_t)rem;
+}
+
+// a = a * m + add
+void mulAddSmall(Mag &a, uint32_t m, uint32_t add) {
+    uint64_t carry = add;
+    for (auto &limb : a) {
+        uint64_t t = (uint64_t)limb * m + carry;
+        limb = (uint32_t)t;
+        carry = t >> 32;
+    }
+    if (carry != 0) a.push_back((uint32_t)carry);
+}
+
+// Knuth, TAOCP vol. 2, 4.3.1, algorithm D. v must be non-zero.
+void divModMag(const Mag &u, const Mag &v, Mag &q, Mag &r) {
+    if (cmpMag(u, v) < 0) {
+        q.clear();
+        r = u;
+        return;
+    }
+    size_t n = v.size(), m = u.size();
+    if (n == 1) {
+        q = u;
+        uint32_t rem = divSmall(q, v[0]);
+        r = rem ? Mag(1, rem) : Mag();
+        return;
+    }
+
+    // 规格化: 使除数最高limb的最高位为1
+    int s = __builtin_clz(v[n - 1]);
+    Mag vn(n), un(m + 1);
+    for (size_t i = n - 1; i > 0; --i) vn[i] = (v[i] << s) | (s ? v[i - 1] >> (32 - s) : 0);
+    vn[0] = v[0] << s;
+    un[m] = s ? u[m - 1] >> (32 - s) : 0;
+    for (size_t i = m - 1; i > 0; --i) un[i] = (u[i] << s) | (s ? u[i - 1] >> (32 - s) : 0);
+    un[0] = u[0] << s;
+
+    const uint64_t B = 1ull << 32;
+    q.assign(m - n + 1, 0);
+    for (size_t j = m - n + 1; j-- > 0;) {
+        uint64_t num = (uint64_t)un[j + n] << 32 | un[j + n - 1];
+        uint64_t qhat = num / vn[n - 1], rhat = num % vn[n - 1];
+        while (qhat >= B || qhat * vn[n - 2] > (rhat << 32 | un[j + n - 2])) {
+            --qhat;
+            rhat += vn[n - 1];
+            if (rhat >= B) break;
+        }
+
+        // un[j..j+n] -= qhat * vn
+        uint64_t carry = 0;
+        int64_t borrow = 0;
+        for (size_t i = 0; i < n; ++i) {
+            uint64_t p = qhat * vn[i] + carry;
+            carry = p >> 32;
+            int64_t t = (int64_t)un[i + j] - (int64_t)(p & 0xffffffffu) - borrow;
+            un[i + j] = (uint32_t)t;
+            borrow = t < 0;
+        }
+        int64_t t = (int64_t)un[j + n] - (int64_t)carry - borrow;
+        un[j + n] = (uint32_t)t;
+
+        if (t < 0) { // qhat多估了1, 加回一个除数
+            --qhat;
+            uint64_t c = 0;
+            for (size_t i = 0; i < n; ++i) {
+                uint64_t sum = (uint64_t)un[i + j] + vn[i] + c;
+                un[i + j] = (uint32_t)sum;
+                c = sum >> 32;
+            }
+            un[j + n] += (uint32_t)c;
+        }
+        q[j] = (uint32_t)qhat;
+    }
+    trim(q);
+
+    r.assign(n, 0);
+    for (size_t i = 0; i < n; ++i) r[i] = (un[i] >> s) | (s ? (uint32_t)((uint64_t)un[i + 1] << (32 - s)) : 0);
+    trim(r);
+}
+
+} // namespace
+
+BigInt::BigInt(bool neg, Mag &&m) : neg(neg), mag(std::move(m)) {
+    trim(mag);
+    if (mag.empty()) this->neg = false;
+}
+
+BigInt::BigInt(long long v) : neg(v < 0) {
+    uint64_t u = neg ? 0 - (uint64_t)v : (uint64_t)v;
+    while (u != 0) {
+        mag.push_back((uint32_t)u);
+        u >>= 32;
+    }
+}
+
+bool BigInt::parse(const std::string &s, BigInt &out) {
+    size_t i = 0;
+    bool negative = false;
+    if (i < s.size() && (s[i] == '+' || s[i] == '-')) negative = s[i++] == '-';
+    if (i == s.size()) return false;
+    Mag m;
+    for (; i < s.size(); ++i) {
+        if (s[i] < '0' || s[i] > '9') return false;
+        mulAddSmall(m, 10, s[i] - '0');
+    }
+    out = BigInt(negative, std::move(m));
+    return true;
+}
+
+bool BigInt::fitsInt() const {
+    if (mag.size() > 1) return false;
+    if (mag.empty()) return true;
+    return neg ? mag[0] <= (uint32_t)INT_MAX + 1 : mag[0] <= (uint32_t)INT_MAX;
+}
+
+int BigInt::toInt() const {
+    if (mag.empty()) return 0;
+    int64_t v = mag[0];
+    return (int)(neg ? -v : v);
+}
+
+size_t BigInt::hash() const {
+    uint64_t h = neg ? 0x9E3779B97F4A7C15ull : 0; // FNV-1a
+    for (uint32_t limb : mag) h = (h ^ limb) * 0x100000001B3ull;
+    return size_t(h);
+}
+
+std::string BigInt::toString() const {
+    if (mag.empty()) return "0";
+    Mag m = mag;
+    std::string digits;
+    while (!m.empty()) { // 每次取出9位十进制数
+        uint32_t chunk = divSmall(m, 1000000000u);
+        for (int k = 0; k < 9; ++k) {
+            digits.push_back(char('0' + chunk % 10));
+            chunk /= 10;
+            if (m.empty() && chunk == 0) break;
+        }
+    }
+    if (neg) digits.push_back('-');
+    std::reverse(digits.begin(), digits.end());
+    return digits;
+}
+
+BigInt BigInt::operator-() const {
+    return BigInt(!neg, Mag(mag));
+}
+
+BigInt operator+(const BigInt &a, const BigInt &b) {
+    if (a.neg == b.neg) return BigInt(a.neg, addMag(a.mag, b.mag));
+    if (cmpMag(a.mag, b.mag) >= 0) return BigInt(a.neg, subMag(a.mag, b.mag));
+    return BigInt(b.neg, subMag(b.mag, a.mag));
+}
+
+BigInt operator-(const BigInt &a, const BigInt &b) {
+    return a + (-b);
+}
+
+BigInt operator*(const BigInt &a, const BigInt &b) {
+    return BigInt(a.neg != b.neg, mulMag(a.mag, b.mag));
+}
+
+void BigInt::divMod(const BigInt &a, const BigInt &b, BigInt &q, BigInt &r) {
+    if (b.isZero()) throw RuntimeError("Division by zero");
+    Mag qm, rm;
+    divModMag(a.mag, b.mag, qm, rm);
+    q = BigInt(a.neg != b.neg, std::move(qm));
+    r = BigInt(a.neg, std::move(rm));
+}
+
+BigInt BigInt::gcd(BigInt a, BigInt b) {
+    a.neg = b.neg = false;
+    while (!b.isZero()) {
+        BigInt q, r;
+        divMod(a, b, q, r);
+        a = std::move(b);
+        b = std::move(r);
+    }
+    return a;
+}
+
+BigInt BigInt::pow(BigInt base, unsigned exp) {
+    BigInt result(1);
+    while (exp > 0) { // 快速幂
+        if (exp & 1) result = result * base;
+        exp >>= 1;
+        if (exp > 0) base = base * base;
+    }
+    return result;
+}
+
+int BigInt::compare(const BigInt &a, const BigInt &b) {
+    if (a.neg != b.neg) return a.neg ? -1 : 1;
+    int c = cmpMag(a.mag, b.mag);
+    return a.neg ? -c : c;
+}
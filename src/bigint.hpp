@@ -0,0 +1,58 @@
+#ifndef BIGINT_HPP
+#define BIGINT_HPP
+
+/**
+ * @file bigint.hpp
+ * @brief Arbitrary-precision integers
+ *
+ * Sign and magnitude, the magnitude stored as little-endian 32-bit limbs
+ * without leading zero limbs (zero has no limbs). Multiplication switches
+ * from the schoolbook method to Karatsuba once both operands are large.
+ *
+ * The interpreter only uses BigInt for integers that do not fit a fixnum;
+ * see IntegerV in value.hpp for the promotion/demotion rules.
+ */
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+class BigInt {
+public:
+    BigInt() : neg(false) {}
+    BigInt(long long);
+
+    /// Decimal digits with an optional sign; false if s is not such a number
+    static bool parse(const std::string &s, BigInt &out);
+
+    bool isZero() const { return mag.empty(); }
+    bool negative() const { return neg; }
+    bool fitsInt() const;
+    int toInt() const;               ///< Only meaningful when fitsInt()
+    std::string toString() const;
+    size_t hash() const;             ///< Equal values hash alike
+
+    BigInt operator-() const;
+    friend BigInt operator+(const BigInt &, const BigInt &);
+    friend BigInt operator-(const BigInt &, const BigInt &);
+    friend BigInt operator*(const BigInt &, const BigInt &);
+
+    /// Truncating division like C++ `/` and `%`: q rounds toward zero and r
+    /// has the sign of a. Throws RuntimeError when b is zero.
+    static void divMod(const BigInt &a, const BigInt &b, BigInt &q, BigInt &r);
+    static BigInt gcd(BigInt a, BigInt b);   ///< Non-negative
+    static BigInt pow(BigInt base, unsigned exp);
+
+    static int compare(const BigInt &, const BigInt &);
+    friend bool operator==(const BigInt &a, const BigInt &b) { return a.neg == b.neg && a.mag == b.mag; }
+    friend bool operator!=(const BigInt &a, const BigInt &b) { return !(a == b); }
+
+private:
+    typedef std::vector<uint32_t> Mag;
+    bool neg;
+    Mag mag;
+
+    BigInt(bool neg, Mag &&mag);
+};
+
+#endif // BIGINT_HPP
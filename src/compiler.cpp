@@ -0,0 +1,332 @@
+/**
+ * @file compiler.cpp
+ * @brief Lowering of Expr trees to bytecode
+ *
+ * Every construct is compiled for tail or non-tail position. In tail position
+ * the value is returned with OP_RETURN and calls become OP_TAIL_CALL, the same
+ * positions in which the tree walker's evalTail hands back a subexpression.
+ */
+
+#include "vm.hpp"
+#include "RE.hpp"
+
+using std::vector;
+
+namespace {
+
+struct Compiler {
+    Bytecode &bc;
+    explicit Compiler(Bytecode &bc) : bc(bc) {}
+
+    size_t emit(OpCode op, int a = 0, int b = 0) {
+        bc.code.push_back(Instr{op, a, b});
+        return bc.code.size() - 1;
+    }
+    size_t here() const { return bc.code.size(); }
+    void patch(size_t at) { bc.code[at].a = int(here()); }
+
+    int constant(const Value &v) {
+        bc.consts.push_back(v);
+        return int(bc.consts.size() - 1);
+    }
+    int node(ExprBase *e) {
+        bc.exprs.push_back(e);
+        return int(bc.exprs.size() - 1);
+    }
+    int frame(const FrameNames &names) {
+        bc.frames.push_back(names);
+        return int(bc.frames.size() - 1);
+    }
+    int cell(Value *c) {
+        bc.cells.push_back(c);
+        return int(bc.cells.size() - 1);
+    }
+
+    void ret(bool tail) {
+        if (tail) emit(OP_RETURN);
+    }
+    void push(const Value &v, bool tail) {
+        emit(OP_CONST, constant(v));
+        ret(tail);
+    }
+    void fallback(ExprBase *e, bool tail) { // 交给树遍历求值
+        emit(OP_EVAL, node(e));
+        ret(tail);
+    }
+    // 字面量和引用的数据: 用节点上物化的值, 和树遍历求值得到的是同一个
+    void literal(ExprBase *e, bool tail) {
+        Assoc none(nullptr);
+        push(e->eval(none), tail);
+    }
+
+    void expr(ExprBase *e, bool tail);
+    void sequence(const vector<Expr> &es, size_t from, bool tail);
+    void begin(Begin *b, bool tail);
+    void beginDefines(Begin *b, bool tail);
+    void defineGlobals(const vector<Define*> &ds);
+    void cond(Cond *c, bool tail);
+    void apply(Apply *ap, bool tail);
+};
+
+// es[from..] in order, the value of the last one is the result
+void Compiler::sequence(const vector<Expr> &es, size_t from, bool tail) {
+    for (size_t i = from; i + 1 < es.size(); ++i) {
+        expr(es[i].get(), false);
+        emit(OP_POP);
+    }
+    expr(es.back().get(), tail);
+}
+
+// Binds the globals of ds, then evaluates and assigns them in order
+void Compiler::defineGlobals(const vector<Define*> &ds) {
+    for (Define *d : ds) emit(OP_BIND, node(d)); // 先创建占位符, 它们可以互相引用
+    for (Define *d : ds) {
+        expr(d->e.get(), false);
+        emit(OP_STORE_GLOBAL, cell(d->cell));
+    }
+}
+
+// A begin of top-level defines, or one ending with a define: its value is
+// that of the last expression that is not a define, and in a top-level begin
+// each run of consecutive defines is bound together
+void Compiler::beginDefines(Begin *b, bool tail) {
+    const vector<Expr> &es = b->es;
+    size_t last = es.size();
+    for (size_t i = es.size(); i-- > 0;) {
+        if (es[i]->e_type != E_DEFINE) {
+            last = i;
+            break;
+        }
+    }
+    vector<size_t> terminated;
+    vector<Define*> pending;
+    for (size_t i = 0; i < es.size(); ++i) {
+        if (es[i]->e_type == E_DEFINE) {
+            if (b->toplevel) pending.push_back(static_cast<Define*>(es[i].get()));
+            else {
+                expr(es[i].get(), false);
+                emit(OP_POP);
+            }
+            continue;
+        }
+        defineGlobals(pending);
+        pending.clear();
+        expr(es[i].get(), false);
+        if (i != last) terminated.push_back(emit(OP_NEXT)); // (exit)提前结束begin
+        else if (i + 1 < es.size()) terminated.push_back(emit(OP_JUMP_EXIT)); // 保留为结果
+    }
+    defineGlobals(pending);
+    if (last == es.size()) emit(OP_CONST, constant(VoidV()));
+    for (size_t at : terminated) patch(at);
+    ret(tail);
+}
+
+void Compiler::begin(Begin *b, bool tail) {
+    if (b->toplevel || b->es.empty() || b->es.back()->e_type == E_DEFINE) return beginDefines(b, tail);
+
+    vector<size_t> terminated;
+    for (size_t i = 0; i + 1 < b->es.size(); ++i) {
+        expr(b->es[i].get(), false);
+        terminated.push_back(emit(OP_NEXT)); // (exit)提前结束begin
+    }
+    expr(b->es.back().get(), tail);
+    if (terminated.empty()) return;
+    for (size_t at : terminated) patch(at);
+    ret(tail);
+}
+
+void Compiler::cond(Cond *c, bool tail) {
+    static thread_local const Name ELSE = intern("else");
+    vector<size_t> done, kept;
+    for (auto &cl : c->clauses) {
+        if (cl.empty()) continue;
+        if (cl[0]->e_type == E_VAR && static_cast<Var*>(cl[0].get())->x == ELSE) {
+            if (cl.size() == 1) break;
+            sequence(cl, 1, tail);
+            if (!tail) done.push_back(emit(OP_JUMP));
+            break;
+        }
+        expr(cl[0].get(), false);
+        if (cl.size() == 1) { // 条件的值即结果
+            kept.push_back(emit(OP_JUMP_TRUE));
+            continue;
+        }
+        size_t next = emit(OP_JUMP_FALSE);
+        sequence(cl, 1, tail);
+        if (!tail) done.push_back(emit(OP_JUMP));
+        patch(next);
+    }
+    emit(OP_CONST, constant(VoidV())); // 没有匹配子句
+    for (size_t at : kept) patch(at);
+    ret(tail);
+    for (size_t at : done) patch(at);
+}
+
+void Compiler::apply(Apply *ap, bool tail) {
+    if (ap->global != nullptr) emit(OP_CALLEE, node(ap)); // 用Apply节点上的内联缓存
+    else {
+        expr(ap->rator.get(), false);
+        emit(OP_CHECK_PROC); // 先检查操作符, 再求值参数
+    }
+    for (auto &arg : ap->rand) expr(arg.get(), false);
+    emit(tail ? OP_TAIL_CALL : OP_CALL, int(ap->rand.size()));
+    ret(tail); // 原语不进入新的调用, 其值在此返回
+}
+
+void Compiler::expr(ExprBase *e, bool tail) {
+    switch (e->e_type) {
+        case E_FIXNUM: return push(IntegerV(static_cast<Fixnum*>(e)->n), tail);
+        case E_BIGNUM:
+        case E_RATIONAL:
+        case E_STRING:
+        case E_QUOTE:  return literal(e, tail);
+        case E_TRUE:   return push(BooleanV(true), tail);
+        case E_FALSE:  return push(BooleanV(false), tail);
+        case E_VOID:   return push(VoidV(), tail);
+        case E_EXIT:   return push(TerminateV(), tail);
+
+        case E_VAR: {
+            auto v = static_cast<Var*>(e);
+            if (v->global) emit(OP_GLOBAL, node(e));
+            else emit(OP_LOCAL, v->depth, v->slot);
+            return ret(tail);
+        }
+        case E_DEFINE: {
+            auto d = static_cast<Define*>(e);
+            if (d->global) {
+                defineGlobals(vector<Define*>(1, d));
+                return push(VoidV(), tail);
+            }
+            expr(d->e.get(), false);
+            emit(OP_STORE, d->depth, d->slot);
+            return push(VoidV(), tail);
+        }
+        case E_SET: {
+            auto s = static_cast<Set*>(e);
+            if (s->global) {
+                emit(OP_CHECK_GLOBAL, node(e)); // 先检查变量, 再求值右边
+                expr(s->e.get(), false);
+                emit(OP_STORE_GLOBAL, cell(s->cell));
+                return push(VoidV(), tail);
+            }
+            expr(s->e.get(), false);
+            emit(OP_STORE, s->depth, s->slot);
+            return push(VoidV(), tail);
+        }
+
+        case E_IF: {
+            auto i = static_cast<If*>(e);
+            expr(i->cond.get(), false);
+            size_t alter = emit(OP_JUMP_FALSE);
+            expr(i->conseq.get(), tail);
+            size_t done = tail ? 0 : emit(OP_JUMP);
+            patch(alter);
+            expr(i->alter.get(), tail);
+            if (!tail) patch(done);
+            return;
+        }
+        case E_COND:  return cond(static_cast<Cond*>(e), tail);
+        case E_DEFINE_SYNTAX: return push(VoidV(), tail); // 宏在解析时已定义
+        case E_BEGIN: return begin(static_cast<Begin*>(e), tail);
+
+        case E_AND: {
+            auto &rands = static_cast<AndVar*>(e)->rands;
+            if (rands.empty()) return push(BooleanV(true), tail);
+            vector<size_t> shortcut;
+            for (size_t i = 0; i + 1 < rands.size(); ++i) {
+                expr(rands[i].get(), false);
+                shortcut.push_back(emit(OP_JUMP_FALSE)); // 遇到#f则短路
+            }
+            expr(rands.back().get(), tail);
+            if (shortcut.empty()) return;
+            size_t done = tail ? 0 : emit(OP_JUMP);
+            for (size_t at : shortcut) patch(at);
+            push(BooleanV(false), tail);
+            if (!tail) patch(done);
+            return;
+        }
+        case E_OR: {
+            auto &rands = static_cast<OrVar*>(e)->rands;
+            if (rands.empty()) return push(BooleanV(false), tail);
+            vector<size_t> shortcut;
+            for (size_t i = 0; i + 1 < rands.size(); ++i) {
+                expr(rands[i].get(), false);
+                shortcut.push_back(emit(OP_JUMP_TRUE));
+            }
+            expr(rands.back().get(), tail);
+            if (shortcut.empty()) return;
+            for (size_t at : shortcut) patch(at);
+            return ret(tail);
+        }
+
+        case E_LET: {
+            auto l = static_cast<Let*>(e);
+            for (auto &kv : l->bind) expr(kv.second.get(), false); // 环境中求值
+            emit(OP_ENTER, frame(l->frame), int(l->bind.size()));
+            expr(l->body.get(), tail);
+            if (!tail) emit(OP_LEAVE);
+            return;
+        }
+        case E_LETREC: {
+            auto l = static_cast<Letrec*>(e);
+            emit(OP_ENTER_REC, frame(l->frame));
+            for (size_t i = 0; i < l->bind.size(); ++i) {
+                expr(l->bind[i].second.get(), false);
+                emit(OP_STORE, 0, int(i));
+            }
+            expr(l->body.get(), tail);
+            if (!tail) emit(OP_LEAVE);
+            return;
+        }
+
+        case E_APPLY: return apply(static_cast<Apply*>(e), tail);
+        case E_LAMBDA: {
+            auto l = static_cast<Lambda*>(e);
+            for (auto &c : l->captures) emit(c.boxed ? OP_CAPTURE_BOX : OP_CAPTURE, c.depth, c.slot);
+            emit(OP_CLOSURE, node(e), int(l->captures.size()));
+            return ret(tail);
+        }
+
+        case E_NOT:
+        case E_CAR: case E_CDR:
+        case E_BOOLQ: case E_INTQ: case E_NULLQ: case E_PAIRQ:
+        case E_PROCQ: case E_SYMBOLQ: case E_LISTQ: case E_STRINGQ: case E_VECTORQ:
+        case E_VECTOR_LENGTH: case E_VECTOR_TO_LIST: case E_LIST_TO_VECTOR: case E_HASH_COUNT:
+        case E_DISPLAY: case E_FUTURE: case E_TOUCH:
+            expr(static_cast<Unary*>(e)->rand.get(), false);
+            emit(OP_UNARY, node(e));
+            return ret(tail);
+
+        case E_PLUS: case E_MINUS: case E_MUL: case E_DIV: case E_MODULO: case E_EXPT:
+        case E_LT: case E_LE: case E_EQ: case E_GE: case E_GT:
+        case E_CONS: case E_SETCAR: case E_SETCDR: case E_EQQ: case E_VECTOR_REF:
+        case E_PARALLEL_MAP: {
+            auto b = static_cast<Binary*>(e);
+            expr(b->rand1.get(), false);
+            expr(b->rand2.get(), false);
+            emit(OP_BINARY, node(e));
+            return ret(tail);
+        }
+
+        case E_PLUS_VAR: case E_MINUS_VAR: case E_MUL_VAR: case E_DIV_VAR:
+        case E_LT_VAR: case E_LE_VAR: case E_EQ_VAR: case E_GE_VAR: case E_GT_VAR:
+        case E_LIST: case E_MAKE_VECTOR: case E_VECTOR: case E_VECTOR_SET:
+        case E_MAKE_HASH_TABLE: case E_HASH_REF: case E_HASH_SET: case E_RUNTIME_STATS: {
+            auto &rands = static_cast<Variadic*>(e)->rands;
+            for (auto &r : rands) expr(r.get(), false);
+            emit(OP_VARIADIC, node(e), int(rands.size()));
+            return ret(tail);
+        }
+
+        default: // 没有专门指令的节点
+            return fallback(e, tail);
+    }
+}
+
+} // namespace
+
+Bytecode compile(ExprBase *e) {
+    Bytecode bc;
+    Compiler(bc).expr(e, true);
+    return bc;
+}
@@ -10,291 +10,324 @@
 #include "expr.hpp" 
 #include "RE.hpp"
 #include "syntax.hpp"
+#include "profile.hpp"
+#include "parallel.hpp"
+#include "stats.hpp"
 #include <vector>
 #include <map>
+#include <unordered_map>
 #include <climits>
 #include <iostream>
 
 using std::string;
 using std::vector;
 
-extern std::map<std::string, ExprType> primitives;
-extern std::map<std::string, ExprType> reserved_words;
+extern const std::map<std::string, ExprType> primitives;
+extern const std::map<std::string, ExprType> reserved_words;
 
 Value Fixnum::eval(Assoc &e) { // evaluation of a fixnum
+    PROFILE_NODE(e_type);
     return IntegerV(n);
 }
 
+Value BignumExpr::eval(Assoc &e) { // evaluation of a big integer
+    PROFILE_NODE(e_type);
+    if (!value) value = std::make_shared<Value>(IntegerV(n));
+    return *value;
+}
+
 Value RationalNum::eval(Assoc &e) { // evaluation of a rational number
-    return RationalV(numerator, denominator);
+    PROFILE_NODE(e_type);
+    if (!value) value = std::make_shared<Value>(RationalV(numerator, denominator));
+    return *value;
 }
 
 Value StringExpr::eval(Assoc &e) { // evaluation of a string
-    return StringV(s);
+    PROFILE_NODE(e_type);
+    if (!value) value = std::make_shared<Value>(StringV(s));
+    return *value;
 }
 
 Value True::eval(Assoc &e) { // evaluation of #t
+    PROFILE_NODE(e_type);
     return BooleanV(true);
 }
 
 Value False::eval(Assoc &e) { // evaluation of #f
+    PROFILE_NODE(e_type);
     return BooleanV(false);
 }
 
 Value MakeVoid::eval(Assoc &e) { // (void)
+    PROFILE_NODE(e_type);
     return VoidV();
 }
 
 Value Exit::eval(Assoc &e) { // (exit)
+    PROFILE_NODE(e_type);
     return TerminateV();
 }
 
 
 Value Unary::eval(Assoc &e) { // evaluation of single-operator primitive
+    PROFILE_NODE(e_type);
     return evalRator(rand->eval(e));
 }
 
 Value Binary::eval(Assoc &e) { // evaluation of two-operators primitive
+    PROFILE_NODE(e_type);
     return evalRator(rand1->eval(e), rand2->eval(e));
 }
 
 Value Variadic::eval(Assoc &e) {
+    PROFILE_NODE(e_type);
     vector<Value> vals;
     for (auto &x : rands) vals.push_back(x->eval(e));
     return evalRator(vals);
 }
 
 
-static Rational asRational(const Value &v) {
-    if (v->v_type == V_RATIONAL) return *dynamic_cast<Rational*>(v.get());
-    if (v->v_type == V_INT)      return Rational(dynamic_cast<Integer*>(v.get())->n, 1);
+static bool isNumber(const Value &v) {
+    return isInteger(v) || v.type() == V_RATIONAL;
+}
+
+// Exact value of a number as numerator/denominator, denominator positive
+struct Fraction {
+    BigInt num, den;
+};
+
+static Fraction asFraction(const Value &v) {
+    if (v.type() == V_RATIONAL) {
+        Rational *r = static_cast<Rational*>(v.get());
+        return Fraction{r->numerator, r->denominator};
+    }
+    if (isInteger(v)) return Fraction{toBigInt(v), BigInt(1)};
     throw RuntimeError("Numeric operand required");
 }
 
-static Value makeNumber(const Rational &r) { 
-    return RationalV(r.numerator, r.denominator); 
+// A result of two fixnums computed in 64 bits: a fixnum unless it leaves
+// the int range, and only then a bignum
+static Value fixnumResult(long long r) {
+    if (r >= INT_MIN && r <= INT_MAX) return IntegerV(int(r));
+    return IntegerV(BigInt(r));
+}
+
+// Generic arithmetic. Two fixnums are combined in 64 bits and only promoted
+// when the result leaves the int range; integers stay integers, and anything
+// involving a rational is done on fractions and normalised by RationalV.
+static Value addNumbers(const Value &a, const Value &b) {
+    if (a.isFixnum() && b.isFixnum()) return fixnumResult((long long)a.fixnum() + b.fixnum());
+    if (isInteger(a) && isInteger(b)) return IntegerV(toBigInt(a) + toBigInt(b));
+    Fraction x = asFraction(a), y = asFraction(b);
+    return RationalV(x.num * y.den + y.num * x.den, x.den * y.den);
+}
+
+static Value subNumbers(const Value &a, const Value &b) {
+    if (a.isFixnum() && b.isFixnum()) return fixnumResult((long long)a.fixnum() - b.fixnum());
+    if (isInteger(a) && isInteger(b)) return IntegerV(toBigInt(a) - toBigInt(b));
+    Fraction x = asFraction(a), y = asFraction(b);
+    return RationalV(x.num * y.den - y.num * x.den, x.den * y.den);
+}
+
+static Value mulNumbers(const Value &a, const Value &b) {
+    if (a.isFixnum() && b.isFixnum()) return fixnumResult((long long)a.fixnum() * b.fixnum());
+    if (isInteger(a) && isInteger(b)) return IntegerV(toBigInt(a) * toBigInt(b));
+    Fraction x = asFraction(a), y = asFraction(b);
+    return RationalV(x.num * y.num, x.den * y.den);
+}
+
+static Value divNumbers(const Value &a, const Value &b) {
+    Fraction x = asFraction(a), y = asFraction(b);
+    if (y.num.isZero()) throw RuntimeError("Division by zero");
+    return RationalV(x.num * y.den, x.den * y.num);
 }
 
 int compareNumericValues(const Value &v1, const Value &v2) {
-    if (v1->v_type == V_INT && v2->v_type == V_INT) { // integer and integer
-        int n1 = dynamic_cast<Integer*>(v1.get())->n;
-        int n2 = dynamic_cast<Integer*>(v2.get())->n;
+    if (v1.isFixnum() && v2.isFixnum()) { // integer and integer
+        int n1 = v1.fixnum();
+        int n2 = v2.fixnum();
         return (n1 < n2) ? -1 : (n1 > n2) ? 1 : 0;
-    } 
-    else if (v1->v_type == V_RATIONAL && v2->v_type == V_INT) { // rational and integer
-        Rational* r1 = dynamic_cast<Rational*>(v1.get());
-        int n2 = dynamic_cast<Integer*>(v2.get())->n;
-        int left = r1->numerator;
-        int right = n2 * r1->denominator;
-        return (left < right) ? -1 : (left > right) ? 1 : 0;
-    } 
-    else if (v1->v_type == V_INT && v2->v_type == V_RATIONAL) { // integer and rational
-        int n1 = dynamic_cast<Integer*>(v1.get())->n;
-        Rational* r2 = dynamic_cast<Rational*>(v2.get());
-        int left = n1 * r2->denominator;
-        int right = r2->numerator;
-        return (left < right) ? -1 : (left > right) ? 1 : 0;
-    } 
-    else if (v1->v_type == V_RATIONAL && v2->v_type == V_RATIONAL) { // rational and rational
-        Rational* r1 = dynamic_cast<Rational*>(v1.get());
-        Rational* r2 = dynamic_cast<Rational*>(v2.get());
-        int left = r1->numerator * r2->denominator;
-        int right = r2->numerator * r1->denominator;
-        return (left < right) ? -1 : (left > right) ? 1 : 0;
     }
-    throw RuntimeError("Wrong typename in numeric comparison");
+    if (!isNumber(v1) || !isNumber(v2)) throw RuntimeError("Wrong typename in numeric comparison");
+    if (isInteger(v1) && isInteger(v2)) return BigInt::compare(toBigInt(v1), toBigInt(v2));
+    Fraction x = asFraction(v1), y = asFraction(v2); // 分母为正, 交叉相乘不改变大小关系
+    return BigInt::compare(x.num * y.den, y.num * x.den);
+}
+
+// Implementations of the primitive procedures. They reuse the evalRator of the
+// corresponding operator node, which does not look at the node's operands.
+template <class Op> static Value unaryPrim(const vector<Value> &args) {
+    static Op op((Expr()));
+    return op.evalRator(args[0]);
+}
+template <class Op> static Value binaryPrim(const vector<Value> &args) {
+    static Op op((Expr()), Expr());
+    return op.evalRator(args[0], args[1]);
+}
+template <class Op> static Value variadicPrim(const vector<Value> &args) {
+    static Op op((vector<Expr>()));
+    return op.evalRator(args);
 }
+static Value voidPrim(const vector<Value> &) { return VoidV(); }
+static Value exitPrim(const vector<Value> &) { return TerminateV(); }
+static Value andPrim(const vector<Value> &) { return BooleanV(true); }  // 只能无参调用
+static Value orPrim(const vector<Value> &) { return BooleanV(false); }
 
-static Value makePrimitiveClosure(ExprType et, Assoc &env) { 
+static Value makePrimitive(ExprType et) {
     switch (et) {
-        case E_VOID:   return ProcedureV({}, Expr(new MakeVoid()), env);
-        case E_EXIT:   return ProcedureV({}, Expr(new Exit()), env);
-
-        case E_BOOLQ:    return ProcedureV({"x"}, Expr(new IsBoolean(Expr(new Var("x")))), env);
-        case E_INTQ:     return ProcedureV({"x"}, Expr(new IsFixnum(Expr(new Var("x")))), env);
-        case E_NULLQ:    return ProcedureV({"x"}, Expr(new IsNull(Expr(new Var("x")))), env);
-        case E_PAIRQ:    return ProcedureV({"x"}, Expr(new IsPair(Expr(new Var("x")))), env);
-        case E_PROCQ:    return ProcedureV({"x"}, Expr(new IsProcedure(Expr(new Var("x")))), env);
-        case E_SYMBOLQ:  return ProcedureV({"x"}, Expr(new IsSymbol(Expr(new Var("x")))), env);
-        case E_STRINGQ:  return ProcedureV({"x"}, Expr(new IsString(Expr(new Var("x")))), env);
-        case E_LISTQ:    return ProcedureV({"x"}, Expr(new IsList(Expr(new Var("x")))), env);
-        case E_NOT:      return ProcedureV({"x"}, Expr(new Not(Expr(new Var("x")))), env);
-        case E_DISPLAY:  return ProcedureV({"x"}, Expr(new Display(Expr(new Var("x")))), env);
-
-        case E_MODULO: return ProcedureV({"a","b"}, Expr(new Modulo(Expr(new Var("a")), Expr(new Var("b")))), env);
-        case E_EXPT:   return ProcedureV({"a","b"}, Expr(new Expt(Expr(new Var("a")), Expr(new Var("b")))), env);
-        case E_CONS:   return ProcedureV({"a","b"}, Expr(new Cons(Expr(new Var("a")), Expr(new Var("b")))), env);
-        case E_CAR:    return ProcedureV({"p"}, Expr(new Car(Expr(new Var("p")))), env);
-        case E_CDR:    return ProcedureV({"p"}, Expr(new Cdr(Expr(new Var("p")))), env);
-        case E_SETCAR: return ProcedureV({"p","v"}, Expr(new SetCar(Expr(new Var("p")), Expr(new Var("v")))), env);
-        case E_SETCDR: return ProcedureV({"p","v"}, Expr(new SetCdr(Expr(new Var("p")), Expr(new Var("v")))), env);
-        case E_EQQ:    return ProcedureV({"a","b"}, Expr(new IsEq(Expr(new Var("a")), Expr(new Var("b")))), env);
-
-        case E_PLUS:    return ProcedureV({}, Expr(new PlusVar({})), env);
-        case E_MINUS:   return ProcedureV({}, Expr(new MinusVar({})), env);
-        case E_MUL:     return ProcedureV({}, Expr(new MultVar({})), env);
-        case E_DIV:     return ProcedureV({}, Expr(new DivVar({})), env);
-        case E_EQ:      return ProcedureV({}, Expr(new EqualVar({})), env);
-        case E_LT:      return ProcedureV({}, Expr(new LessVar({})), env);
-        case E_LE:      return ProcedureV({}, Expr(new LessEqVar({})), env);
-        case E_GE:      return ProcedureV({}, Expr(new GreaterEqVar({})), env);
-        case E_GT:      return ProcedureV({}, Expr(new GreaterVar({})), env);
-        case E_LIST:    return ProcedureV({}, Expr(new ListFunc({})), env);
-        case E_AND:     return ProcedureV({}, Expr(new AndVar({})), env);
-        case E_OR:      return ProcedureV({}, Expr(new OrVar({})), env);
+        case E_VOID:   return PrimitiveV(voidPrim, 0);
+        case E_EXIT:   return PrimitiveV(exitPrim, 0);
+
+        case E_BOOLQ:    return PrimitiveV(unaryPrim<IsBoolean>, 1);
+        case E_INTQ:     return PrimitiveV(unaryPrim<IsFixnum>, 1);
+        case E_NULLQ:    return PrimitiveV(unaryPrim<IsNull>, 1);
+        case E_PAIRQ:    return PrimitiveV(unaryPrim<IsPair>, 1);
+        case E_PROCQ:    return PrimitiveV(unaryPrim<IsProcedure>, 1);
+        case E_SYMBOLQ:  return PrimitiveV(unaryPrim<IsSymbol>, 1);
+        case E_STRINGQ:  return PrimitiveV(unaryPrim<IsString>, 1);
+        case E_LISTQ:    return PrimitiveV(unaryPrim<IsList>, 1);
+        case E_VECTORQ:  return PrimitiveV(unaryPrim<IsVector>, 1);
+        case E_NOT:      return PrimitiveV(unaryPrim<Not>, 1);
+        case E_DISPLAY:  return PrimitiveV(unaryPrim<Display>, 1);
+        case E_FUTURE:   return PrimitiveV(unaryPrim<MakeFuture>, 1);
+        case E_TOUCH:    return PrimitiveV(unaryPrim<Touch>, 1);
+        case E_PARALLEL_MAP: return PrimitiveV(binaryPrim<ParallelMap>, 2);
+        case E_RUNTIME_STATS: return PrimitiveV(variadicPrim<RuntimeStats>, 0);
+
+        case E_MODULO: return PrimitiveV(binaryPrim<Modulo>, 2);
+        case E_EXPT:   return PrimitiveV(binaryPrim<Expt>, 2);
+        case E_CONS:   return PrimitiveV(binaryPrim<Cons>, 2);
+        case E_CAR:    return PrimitiveV(unaryPrim<Car>, 1);
+        case E_CDR:    return PrimitiveV(unaryPrim<Cdr>, 1);
+        case E_SETCAR: return PrimitiveV(binaryPrim<SetCar>, 2);
+        case E_SETCDR: return PrimitiveV(binaryPrim<SetCdr>, 2);
+        case E_EQQ:    return PrimitiveV(binaryPrim<IsEq>, 2);
+
+        case E_MAKE_VECTOR:    return PrimitiveV(variadicPrim<MakeVector>, -1);
+        case E_VECTOR:         return PrimitiveV(variadicPrim<VectorFunc>, -1);
+        case E_VECTOR_LENGTH:  return PrimitiveV(unaryPrim<VectorLength>, 1);
+        case E_VECTOR_REF:     return PrimitiveV(binaryPrim<VectorRef>, 2);
+        case E_VECTOR_SET:     return PrimitiveV(variadicPrim<VectorSet>, 3);
+        case E_VECTOR_TO_LIST: return PrimitiveV(unaryPrim<VectorToList>, 1);
+        case E_LIST_TO_VECTOR: return PrimitiveV(unaryPrim<ListToVector>, 1);
+
+        case E_MAKE_HASH_TABLE: return PrimitiveV(variadicPrim<MakeHashTable>, 0);
+        case E_HASH_REF:        return PrimitiveV(variadicPrim<HashRef>, -1);
+        case E_HASH_SET:        return PrimitiveV(variadicPrim<HashSet>, 3);
+        case E_HASH_COUNT:      return PrimitiveV(unaryPrim<HashCount>, 1);
+
+        case E_PLUS:    return PrimitiveV(variadicPrim<PlusVar>, -1);
+        case E_MINUS:   return PrimitiveV(variadicPrim<MinusVar>, -1);
+        case E_MUL:     return PrimitiveV(variadicPrim<MultVar>, -1);
+        case E_DIV:     return PrimitiveV(variadicPrim<DivVar>, -1);
+        case E_EQ:      return PrimitiveV(variadicPrim<EqualVar>, -1);
+        case E_LT:      return PrimitiveV(variadicPrim<LessVar>, -1);
+        case E_LE:      return PrimitiveV(variadicPrim<LessEqVar>, -1);
+        case E_GE:      return PrimitiveV(variadicPrim<GreaterEqVar>, -1);
+        case E_GT:      return PrimitiveV(variadicPrim<GreaterVar>, -1);
+        case E_LIST:    return PrimitiveV(variadicPrim<ListFunc>, -1);
+        case E_AND:     return PrimitiveV(andPrim, 0);
+        case E_OR:      return PrimitiveV(orPrim, 0);
         default: break;
     }
-    throw RuntimeError("Unsupported primitive closure");
+    throw RuntimeError("Unsupported primitive");
+}
+
+const Value *builtin(Name x) {
+    // 每个线程一份, 从不释放 (同intern表)
+    static thread_local std::unordered_map<Name, Value> *table = [] {
+        auto t = new std::unordered_map<Name, Value>();
+        for (auto &kv : primitives) t->emplace(intern(kv.first), makePrimitive(kv.second));
+        return t;
+    }();
+    auto it = table->find(x);
+    return it == table->end() ? nullptr : &it->second;
 }
 
 Value Var::eval(Assoc &e) {
-    // 在环境中查找变量
-    Value matched_value = find(x, e);
-    if (matched_value.get() != nullptr) return matched_value;
+    PROFILE_NODE(e_type);
+    if (!global) return unbox(locate(depth, slot, e));
+
+    // 全局变量: 直接读取解析时确定的单元
+    ++stats::counters.globalLookups;
+    if (cell != nullptr && !cell->unbound()) return *cell;
 
-    // 未找到，是内置函数
-    auto it = primitives.find(x);
-    if (it != primitives.end()) return makePrimitiveClosure(it->second, e);
+    // 未定义，是内置函数
+    if (const Value *prim = builtin(x)) return *prim;
 
-    throw RuntimeError("Invalid variable: " + x);
+    throw RuntimeError("Invalid variable: " + x->s);
 }
 
 Value Plus::evalRator(const Value &a, const Value &b) {
-    Rational ra = asRational(a), rb = asRational(b);
-    Rational sum(ra.numerator * rb.denominator + rb.numerator * ra.denominator,
-                 ra.denominator * rb.denominator);
-    return makeNumber(sum); // 约分
-    throw(RuntimeError("Wrong typename"));
+    return addNumbers(a, b);
 }
 
 Value Minus::evalRator(const Value &a, const Value &b) {
-    Rational ra = asRational(a), rb = asRational(b);
-    Rational diff(ra.numerator * rb.denominator - rb.numerator * ra.denominator,
-                  ra.denominator * rb.denominator);
-    return makeNumber(diff);
-    throw(RuntimeError("Wrong typename"));
+    return subNumbers(a, b);
 }
 
 Value Mult::evalRator(const Value &a, const Value &b) {
-    Rational ra = asRational(a), rb = asRational(b);
-    Rational prod(ra.numerator * rb.numerator, ra.denominator * rb.denominator);
-    return makeNumber(prod);
-    throw(RuntimeError("Wrong typename"));
+    return mulNumbers(a, b);
 }
 
 Value Div::evalRator(const Value &a, const Value &b) {
-    Rational ra = asRational(a), rb = asRational(b);
-    if (rb.numerator == 0) throw RuntimeError("Division by zero");
-    Rational q(ra.numerator * rb.denominator, ra.denominator * rb.numerator);
-    return makeNumber(q);
-    throw(RuntimeError("Wrong typename"));
+    return divNumbers(a, b);
 }
 
 Value Modulo::evalRator(const Value &a, const Value &b) {
-    int lhs, rhs;
-    if (a->v_type == V_INT) lhs = dynamic_cast<Integer*>(a.get())->n;
-    else if (a->v_type == V_RATIONAL && dynamic_cast<Rational*>(a.get())->denominator == 1)
-        lhs = dynamic_cast<Rational*>(a.get())->numerator;
-    else throw RuntimeError("modulo is only defined for integers");
-
-    if (b->v_type == V_INT) rhs = dynamic_cast<Integer*>(b.get())->n;
-    else if (b->v_type == V_RATIONAL && dynamic_cast<Rational*>(b.get())->denominator == 1)
-        rhs = dynamic_cast<Rational*>(b.get())->numerator;
-    else throw RuntimeError("modulo is only defined for integers");
-
-    if (rhs == 0) throw RuntimeError("Division by zero");
-    return IntegerV(lhs % rhs);
+    if (!isInteger(a) || !isInteger(b)) throw RuntimeError("modulo is only defined for integers");
+    if (a.isFixnum() && b.isFixnum()) {
+        int rhs = b.fixnum();
+        if (rhs == 0) throw RuntimeError("Division by zero");
+        if (rhs == -1) return IntegerV(0); // INT_MIN % -1 会溢出
+        return IntegerV(a.fixnum() % rhs);
+    }
+    BigInt q, r;
+    BigInt::divMod(toBigInt(a), toBigInt(b), q, r); // 与C++的%一样, 余数与被除数同号
+    return IntegerV(r);
 }
 
 Value Expt::evalRator(const Value &rand1, const Value &rand2) { // expt
-    if (((rand1->v_type == V_INT) || (rand1->v_type == V_RATIONAL && dynamic_cast<Rational*>(rand1.get())->denominator == 1)) 
-     && ((rand2->v_type == V_INT) || (rand2->v_type == V_RATIONAL && dynamic_cast<Rational*>(rand2.get())->denominator == 1))) {
-        int base = (rand1->v_type == V_INT) ? dynamic_cast<Integer*>(rand1.get())->n : dynamic_cast<Rational*>(rand1.get())->numerator;
-        int exponent = (rand2->v_type == V_INT) ?dynamic_cast<Integer*>(rand2.get())->n : dynamic_cast<Rational*>(rand2.get())->numerator;
-        
-        if (exponent < 0) {
-            throw(RuntimeError("Negative exponent not supported for integers"));
-        }
-        if (base == 0 && exponent == 0) {
-            throw(RuntimeError("0^0 is undefined"));
-        }
-        
-        // 快速幂
-        long long result = 1;
-        long long b = base;
-        int exp = exponent;
-        
-        while (exp > 0) {
-            if (exp % 2 == 1) {
-                result *= b;
-                if (result > INT_MAX || result < INT_MIN) {
-                    throw(RuntimeError("Integer overflow in expt"));
-                }
-            }
-            b *= b;
-            if (b > INT_MAX || b < INT_MIN) {
-                if (exp > 1) {
-                    throw(RuntimeError("Integer overflow in expt"));
-                }
-            }
-            exp /= 2;
-        } 
-        
-        return IntegerV((int)result);
+    if (!isNumber(rand1) || !isInteger(rand2)) throw(RuntimeError("Wrong typename in expt"));
+    if (!rand2.isFixnum()) throw(RuntimeError("Exponent too large in expt"));
+    int exponent = rand2.fixnum();
+    if (exponent < 0) {
+        throw(RuntimeError("Negative exponent not supported for integers"));
+    }
+    Fraction base = asFraction(rand1);
+    if (base.num.isZero() && exponent == 0) {
+        throw(RuntimeError("0^0 is undefined"));
     }
-    throw(RuntimeError("Wrong typename in expt"));
+    if (base.den == BigInt(1)) return IntegerV(BigInt::pow(base.num, exponent));
+    return RationalV(BigInt::pow(base.num, exponent), BigInt::pow(base.den, exponent));
 }
 
 Value PlusVar::evalRator(const std::vector<Value> &args) {
-    if (args.empty()) return IntegerV(0);
-    Rational acc = asRational(args[0]);
-    for (size_t i = 1; i < args.size(); ++i) {
-        Rational rv = asRational(args[i]);
-        acc = Rational(acc.numerator * rv.denominator + rv.numerator * acc.denominator,
-                       acc.denominator * rv.denominator);
-    }
-    return makeNumber(acc);
+    Value acc = IntegerV(0);
+    for (auto &v : args) acc = addNumbers(acc, v);
+    return acc;
 }
 
 Value MinusVar::evalRator(const std::vector<Value> &args) {
     if (args.empty()) throw RuntimeError("Wrong number of arguments for -");
-    if (args.size() == 1) {
-        Rational r = asRational(args[0]);
-        return makeNumber(Rational(-r.numerator, r.denominator));
-    }
-    Rational acc = asRational(args[0]);
-    for (size_t i = 1; i < args.size(); ++i) {
-        Rational rv = asRational(args[i]);
-        acc = Rational(acc.numerator * rv.denominator - rv.numerator * acc.denominator,
-                       acc.denominator * rv.denominator);
-    }
-    return makeNumber(acc);
+    if (args.size() == 1) return subNumbers(IntegerV(0), args[0]);
+    Value acc = args[0];
+    for (size_t i = 1; i < args.size(); ++i) acc = subNumbers(acc, args[i]);
+    return acc;
 }
 
 Value MultVar::evalRator(const std::vector<Value> &args) {
-    if (args.empty()) return IntegerV(1);
-    Rational acc(1,1);
-    for (auto &v : args) {
-        Rational rv = asRational(v);
-        acc = Rational(acc.numerator * rv.numerator, acc.denominator * rv.denominator);
-    }
-    return makeNumber(acc);
+    Value acc = IntegerV(1);
+    for (auto &v : args) acc = mulNumbers(acc, v);
+    return acc;
 }
 
 Value DivVar::evalRator(const std::vector<Value> &args) {
     if (args.empty()) throw RuntimeError("Wrong number of arguments for /");
-    if (args.size() == 1) {
-        Rational r = asRational(args[0]);
-        if (r.numerator == 0) throw RuntimeError("Division by zero");
-        return makeNumber(Rational(r.denominator, r.numerator));
-    }
-    Rational acc = asRational(args[0]);
-    for (size_t i = 1; i < args.size(); ++i) {
-        Rational rv = asRational(args[i]);
-        if (rv.numerator == 0) throw RuntimeError("Division by zero");
-        acc = Rational(acc.numerator * rv.denominator, acc.denominator * rv.numerator);
-    }
-    return makeNumber(acc);
+    if (args.size() == 1) return divNumbers(IntegerV(1), args[0]);
+    Value acc = args[0];
+    for (size_t i = 1; i < args.size(); ++i) acc = divNumbers(acc, args[i]);
+    return acc;
 }
 
 // Comparisons (binary)
@@ -364,110 +397,233 @@ Value ListFunc::evalRator(const std::vector<Value> &args) {
     return lst;
 }
 
+// 龟兔赛跑: fast每次走两步, slow走一步, 两者相遇说明cdr链成环
 static bool isProperList(const Value &v) {
-    if (v->v_type == V_NULL) return true;
-    if (v->v_type != V_PAIR) return false;
-    return isProperList(dynamic_cast<Pair*>(v.get())->cdr);
+    const Value *slow = &v, *fast = &v;
+    while (true) {
+        for (int step = 0; step < 2; ++step) {
+            if (fast->type() == V_NULL) return true;
+            if (fast->type() != V_PAIR) return false;
+            fast = &static_cast<Pair*>(fast->get())->cdr;
+        }
+        slow = &static_cast<Pair*>(slow->get())->cdr;
+        if (*fast == *slow) return false;
+    }
 }
 Value IsList::evalRator(const Value &v) {
     return BooleanV(isProperList(v));
 }
 
 Value Car::evalRator(const Value &v) {
-    if (v->v_type != V_PAIR) throw RuntimeError("car on non-pair");
-    return dynamic_cast<Pair*>(v.get())->car;
+    if (v.type() != V_PAIR) throw RuntimeError("car on non-pair");
+    return static_cast<Pair*>(v.get())->car;
 }
 Value Cdr::evalRator(const Value &v) {
-    if (v->v_type != V_PAIR) throw RuntimeError("cdr on non-pair");
-    return dynamic_cast<Pair*>(v.get())->cdr;
+    if (v.type() != V_PAIR) throw RuntimeError("cdr on non-pair");
+    return static_cast<Pair*>(v.get())->cdr;
 }
 Value SetCar::evalRator(const Value &p, const Value &nv) {
-    if (p->v_type != V_PAIR) throw RuntimeError("set-car! on non-pair");
-    dynamic_cast<Pair*>(p.get())->car = nv;
+    if (p.type() != V_PAIR) throw RuntimeError("set-car! on non-pair");
+    static_cast<Pair*>(p.get())->car = nv;
     return VoidV();
 }
 Value SetCdr::evalRator(const Value &p, const Value &nv) {
-    if (p->v_type != V_PAIR) throw RuntimeError("set-cdr! on non-pair");
-    dynamic_cast<Pair*>(p.get())->cdr = nv;
+    if (p.type() != V_PAIR) throw RuntimeError("set-cdr! on non-pair");
+    static_cast<Pair*>(p.get())->cdr = nv;
+    return VoidV();
+}
+
+Value MakeVector::evalRator(const std::vector<Value> &args) {
+    if (args.size() != 1 && args.size() != 2) throw RuntimeError("Wrong number of arguments for make-vector");
+    if (!args[0].isFixnum() || args[0].fixnum() < 0) throw RuntimeError("make-vector needs a non-negative length");
+    return VectorV(std::vector<Value>(size_t(args[0].fixnum()), args.size() == 2 ? args[1] : IntegerV(0)));
+}
+
+Value VectorFunc::evalRator(const std::vector<Value> &args) {
+    return VectorV(std::vector<Value>(args));
+}
+
+static Vector *asVector(const Value &v, const char *op) {
+    if (v.type() != V_VECTOR) throw RuntimeError(std::string(op) + " on non-vector");
+    return static_cast<Vector*>(v.get());
+}
+static size_t vectorIndex(const Vector *vec, const Value &k, const char *op) {
+    if (!k.isFixnum() || k.fixnum() < 0 || size_t(k.fixnum()) >= vec->elems.size()) {
+        throw RuntimeError(std::string(op) + " index out of range");
+    }
+    return size_t(k.fixnum());
+}
+
+Value VectorLength::evalRator(const Value &v) {
+    return IntegerV(int(asVector(v, "vector-length")->elems.size()));
+}
+
+Value VectorRef::evalRator(const Value &v, const Value &k) {
+    Vector *vec = asVector(v, "vector-ref");
+    return vec->elems[vectorIndex(vec, k, "vector-ref")];
+}
+
+Value VectorSet::evalRator(const std::vector<Value> &args) {
+    Vector *vec = asVector(args[0], "vector-set!");
+    vec->elems[vectorIndex(vec, args[1], "vector-set!")] = args[2];
     return VoidV();
 }
 
+Value VectorToList::evalRator(const Value &v) {
+    Vector *vec = asVector(v, "vector->list");
+    Value lst = NullV();
+    for (size_t i = vec->elems.size(); i-- > 0;) lst = PairV(vec->elems[i], lst);
+    return lst;
+}
+
+Value ListToVector::evalRator(const Value &l) {
+    std::vector<Value> elems;
+    Value v = l;
+    for (; v.type() == V_PAIR; v = static_cast<Pair*>(v.get())->cdr) elems.push_back(static_cast<Pair*>(v.get())->car);
+    if (v.type() != V_NULL) throw RuntimeError("list->vector on non-list");
+    return VectorV(std::move(elems));
+}
+
+Value MakeHashTable::evalRator(const std::vector<Value> &) {
+    return HashTableV();
+}
+
+static HashTable *asHashTable(const Value &v, const char *op) {
+    if (v.type() != V_HASH_TABLE) throw RuntimeError(std::string(op) + " on non-hash-table");
+    return static_cast<HashTable*>(v.get());
+}
+
+Value HashRef::evalRator(const std::vector<Value> &args) {
+    if (args.size() != 2 && args.size() != 3) throw RuntimeError("Wrong number of arguments for hash-ref");
+    Value *v = asHashTable(args[0], "hash-ref")->find(args[1]);
+    if (v != nullptr) return *v;
+    if (args.size() == 3) return args[2];
+    throw RuntimeError("hash-ref: no value for key");
+}
+
+Value HashSet::evalRator(const std::vector<Value> &args) {
+    asHashTable(args[0], "hash-set!")->set(args[1], args[2]);
+    return VoidV();
+}
+
+Value HashCount::evalRator(const Value &v) {
+    return IntegerV(int(asHashTable(v, "hash-count")->count));
+}
+
 Value IsEq::evalRator(const Value &a, const Value &b) {
-    if ((a->v_type == V_INT || a->v_type == V_RATIONAL) &&
-        (b->v_type == V_INT || b->v_type == V_RATIONAL)) {
+    if (isNumber(a) && isNumber(b)) {
         return BooleanV(compareNumericValues(a,b) == 0);
     }
-    if (a->v_type == V_BOOL && b->v_type == V_BOOL) {
-        return BooleanV(dynamic_cast<Boolean*>(a.get())->b == dynamic_cast<Boolean*>(b.get())->b);
-    }
-    if (a->v_type == V_SYM && b->v_type == V_SYM) {
-        return BooleanV(dynamic_cast<Symbol*>(a.get())->s == dynamic_cast<Symbol*>(b.get())->s);
-    }
-    if ((a->v_type == V_NULL && b->v_type == V_NULL) || (a->v_type == V_VOID && b->v_type == V_VOID)) {
-        return BooleanV(true);
-    }
-    return BooleanV(a.get() == b.get());
+    return BooleanV(a == b); // 立即值比较位, 堆对象(包括驻留的符号和向量)比较指针
 }
 
 Value IsBoolean::evalRator(const Value &v) {
-    return BooleanV(v->v_type == V_BOOL); 
+    return BooleanV(v.type() == V_BOOL); 
 }
 
 Value IsFixnum::evalRator(const Value &v) {
-    return BooleanV(v->v_type == V_INT || v->v_type == V_RATIONAL);
+    return BooleanV(isNumber(v));
 }
 
 Value IsNull::evalRator(const Value &v) {
-    return BooleanV(v->v_type == V_NULL);
+    return BooleanV(v.type() == V_NULL);
 }
 
 Value IsPair::evalRator(const Value &v) {
-    return BooleanV(v->v_type == V_PAIR); 
+    return BooleanV(v.type() == V_PAIR); 
 }
 
 Value IsProcedure::evalRator(const Value &v) {
-    return BooleanV(v->v_type == V_PROC); 
+    return BooleanV(isProcedure(v));
 }
 
 Value IsSymbol::evalRator(const Value &v) {
-    return BooleanV(v->v_type == V_SYM); 
+    return BooleanV(v.type() == V_SYM); 
 }
 
 Value IsString::evalRator(const Value &v) {
-    return BooleanV(v->v_type == V_STRING);
+    return BooleanV(v.type() == V_STRING);
+}
+
+Value IsVector::evalRator(const Value &v) {
+    return BooleanV(v.type() == V_VECTOR);
 }
 
 
+ExprBase *ExprBase::evalTail(Assoc &env, Value &result) {
+    result = eval(env);
+    return nullptr;
+}
+
+// Evaluation of a node in non-tail position: run its tail expression directly
+static Value evalNonTail(ExprBase *ex, Assoc &env) {
+    Value result(nullptr);
+    ExprBase *tail = ex->evalTail(env, result);
+    return tail != nullptr ? tail->eval(env) : result;
+}
+
 Value Begin::eval(Assoc &e) {
+    if (!toplevel) return evalNonTail(this, e);
+    PROFILE_NODE(e_type);
     if (es.empty()) return VoidV();
 
     Value last = VoidV();
-    std::vector<std::pair<string, Expr>> pending; 
+    std::vector<Define*> pending;
 
     // 执行pending中的define
     auto flush = [&](Assoc &env) {
         if (pending.empty()) return;
-        for (auto &kv : pending) env = extend(kv.first, VoidV(), env); // 创建占位符
-        for (auto &kv : pending) { // 求值后赋值
-            Value rhs = kv.second->eval(env);
-            modify(kv.first, rhs, env);
+        for (Define *d : pending) d->bind(); // 创建占位符
+        for (Define *d : pending) { // 求值后赋值
+            Value rhs = d->e->eval(env);
+            ++stats::counters.globalLookups;
+            assignGlobal(d->cell, rhs);
         }
         pending.clear();
     };
 
     for (auto &ex : es) {
-        if (auto d = dynamic_cast<Define*>(ex.get())) { // 添加define
-            pending.push_back({d->var, d->e});
+        if (ex->e_type == E_DEFINE) {
+            pending.push_back(static_cast<Define*>(ex.get())); // 添加define
             continue;
         }
         flush(e); // 执行pending
         last = ex->eval(e); // 求值当前
-        if (last->v_type == V_TERMINATE) return last;
+        if (last.type() == V_TERMINATE) return last;
     }
     flush(e); // 执行剩余
     return last;
 }
 
+ExprBase *Begin::evalTail(Assoc &e, Value &result) {
+    if (toplevel) {
+        result = eval(e);
+        return nullptr;
+    }
+    PROFILE_NODE(e_type);
+    if (es.empty() || es.back()->e_type == E_DEFINE) { // 值为最后一个非define表达式的值
+        Value last = VoidV();
+        for (auto &ex : es) {
+            Value v = ex->eval(e);
+            if (v.type() == V_TERMINATE) {
+                result = v;
+                return nullptr;
+            }
+            if (ex->e_type != E_DEFINE) last = v;
+        }
+        result = last;
+        return nullptr;
+    }
+    for (size_t i = 0; i + 1 < es.size(); ++i) { // 内部define的槽位已在创建帧时分配
+        Value v = es[i]->eval(e);
+        if (v.type() == V_TERMINATE) {
+            result = v;
+            return nullptr;
+        }
+    }
+    return es.back().get();
+}
+
 static Value quoteToValue(const Syntax &s);
 static Value listFrom(const std::vector<Syntax> &elems, size_t lo, size_t hi) {
     Value tail = NullV();
@@ -477,160 +633,318 @@ static Value listFrom(const std::vector<Syntax> &elems, size_t lo, size_t hi) {
     return tail;
 }
 static Value spliceDotted(const std::vector<Syntax> &elems) {
+    static thread_local const Name DOT = intern(".");
     size_t dot = elems.size();
     for (size_t i = 0; i < elems.size(); ++i) {
-        if (auto sym = dynamic_cast<SymbolSyntax*>(elems[i].get())) {
-            if (sym->s == ".") { dot = i; break; } // 得到.位置
+        if (auto sym = asSymbol(elems[i])) {
+            if (sym->s == DOT) { dot = i; break; } // 得到.位置
         }
     }
     if (dot == elems.size()) return listFrom(elems, 0, elems.size());
     if (dot + 1 >= elems.size()) throw RuntimeError("Malformed dotted list");
     Value left = listFrom(elems, 0, dot);
     Value right = quoteToValue(elems[dot + 1]);
-    if (left->v_type == V_NULL) return right;
+    if (left.type() == V_NULL) return right;
     Value cur = left;
     Pair* lastp = nullptr;
-    while (cur->v_type == V_PAIR) {
-        lastp = dynamic_cast<Pair*>(cur.get());
+    while (cur.type() == V_PAIR) {
+        lastp = static_cast<Pair*>(cur.get());
         cur = lastp->cdr;
     }
     if (lastp) lastp->cdr = right;
     return left;
 }
 static Value quoteToValue(const Syntax &s) {
-    if (auto n = dynamic_cast<Number*>(s.get()))          return IntegerV(n->n);
-    if (auto r = dynamic_cast<RationalSyntax*>(s.get()))  return RationalV(r->numerator, r->denominator);
-    if (auto t = dynamic_cast<TrueSyntax*>(s.get()))      return BooleanV(true);
-    if (auto f = dynamic_cast<FalseSyntax*>(s.get()))     return BooleanV(false);
-    if (auto str = dynamic_cast<StringSyntax*>(s.get()))  return StringV(str->s);
-    if (auto sym = dynamic_cast<SymbolSyntax*>(s.get()))  return SymbolV(sym->s);
-    if (auto lst = dynamic_cast<List*>(s.get()))          return spliceDotted(lst->stxs);
+    SyntaxBase *b = s.get();
+    switch (b->s_type) {
+        case S_NUMBER:   return IntegerV(static_cast<Number*>(b)->n);
+        case S_BIGNUM:   return IntegerV(static_cast<BignumSyntax*>(b)->n);
+        case S_RATIONAL: {
+            auto r = static_cast<RationalSyntax*>(b);
+            return RationalV(r->numerator, r->denominator);
+        }
+        case S_TRUE:     return BooleanV(true);
+        case S_FALSE:    return BooleanV(false);
+        case S_STRING:   return StringV(static_cast<StringSyntax*>(b)->s);
+        case S_SYMBOL:   return SymbolV(unalias(static_cast<SymbolSyntax*>(b)->s)); // 宏展开产生的别名quote出来是它代表的符号
+        case S_LIST:     return spliceDotted(static_cast<List*>(b)->stxs);
+    }
     throw RuntimeError("Bad quoted form");
 }
-Value Quote::eval(Assoc &e) {
-    return quoteToValue(s);
+Value Quote::eval(Assoc &) {
+    PROFILE_NODE(e_type);
+    if (!value) value = std::make_shared<Value>(quoteToValue(s));
+    return *value;
 }
 
 
 Value AndVar::eval(Assoc &e) {
-    if (rands.empty()) return BooleanV(true);
-    Value last = BooleanV(true);
-    for (auto &ex : rands) {
-        last = ex->eval(e);
-        if (last->v_type == V_BOOL && !dynamic_cast<Boolean*>(last.get())->b) return BooleanV(false); // 遇到#f则短路
+    return evalNonTail(this, e);
+}
+
+ExprBase *AndVar::evalTail(Assoc &e, Value &result) {
+    PROFILE_NODE(e_type);
+    if (rands.empty()) {
+        result = BooleanV(true);
+        return nullptr;
     }
-    return last;
+    for (size_t i = 0; i + 1 < rands.size(); ++i) {
+        Value v = rands[i]->eval(e);
+        if (isFalse(v)) { // 遇到#f则短路
+            result = BooleanV(false);
+            return nullptr;
+        }
+    }
+    return rands.back().get(); // 最后一个参数的值即结果
 }
 
 Value OrVar::eval(Assoc &e) {
-    if (rands.empty()) return BooleanV(false);
-    for (auto &ex : rands) {
-        Value v = ex->eval(e);
-        if (!(v->v_type == V_BOOL && !dynamic_cast<Boolean*>(v.get())->b)) return v;
+    return evalNonTail(this, e);
+}
+
+ExprBase *OrVar::evalTail(Assoc &e, Value &result) {
+    PROFILE_NODE(e_type);
+    if (rands.empty()) {
+        result = BooleanV(false);
+        return nullptr;
     }
-    return BooleanV(false);
+    for (size_t i = 0; i + 1 < rands.size(); ++i) {
+        Value v = rands[i]->eval(e);
+        if (!isFalse(v)) {
+            result = v;
+            return nullptr;
+        }
+    }
+    return rands.back().get();
 }
 
 Value Not::evalRator(const Value &v) {
-    if (v->v_type == V_BOOL && !dynamic_cast<Boolean*>(v.get())->b) return BooleanV(true);
+    if (isFalse(v)) return BooleanV(true);
     return BooleanV(false);
 }
 
 Value If::eval(Assoc &e) {
+    return evalNonTail(this, e);
+}
+
+ExprBase *If::evalTail(Assoc &e, Value &) {
+    PROFILE_NODE(e_type);
     Value c = cond->eval(e); // 求值条件
-    bool isFalse = (c->v_type == V_BOOL && !dynamic_cast<Boolean*>(c.get())->b);
-    return isFalse ? alter->eval(e) : conseq->eval(e);
+    bool isF = isFalse(c);
+    return isF ? alter.get() : conseq.get();
 }
 
 Value Cond::eval(Assoc &env) {
+    return evalNonTail(this, env);
+}
+
+// 求值子句中除最后一个表达式外的部分, 返回最后一个表达式
+static ExprBase *clauseTail(const std::vector<Expr> &cl, Assoc &env) {
+    for (size_t i = 1; i + 1 < cl.size(); ++i) cl[i]->eval(env);
+    return cl.back().get();
+}
+
+ExprBase *Cond::evalTail(Assoc &env, Value &result) {
+    PROFILE_NODE(e_type);
+    static thread_local const Name ELSE = intern("else");
     for (auto &cl : clauses) {
         if (cl.empty()) continue;
-        if (auto v = dynamic_cast<Var*>(cl[0].get())) {
-            if (v->x == "else") { // check else
-                if (cl.size() == 1) return VoidV();
-                Value last = VoidV();
-                for (size_t i = 1; i < cl.size(); ++i) last = cl[i]->eval(env); // 求值else子句
-                return last;
-            }
+        if (cl[0]->e_type == E_VAR && static_cast<Var*>(cl[0].get())->x == ELSE) { // check else
+            if (cl.size() == 1) break;
+            return clauseTail(cl, env); // 求值else子句
         }
         Value pred = cl[0]->eval(env); // 求值条件
-        bool pass = !(pred->v_type == V_BOOL && !dynamic_cast<Boolean*>(pred.get())->b);
+        bool pass = !isFalse(pred);
         if (pass) {
-            if (cl.size() == 1) return pred;
-            Value last = VoidV();
-            for (size_t i = 1; i < cl.size(); ++i) last = cl[i]->eval(env); // 求值子句
-            return last;
+            if (cl.size() == 1) {
+                result = pred;
+                return nullptr;
+            }
+            return clauseTail(cl, env); // 求值子句
         }
     }
-    return VoidV(); // 没有匹配子句
+    result = VoidV(); // 没有匹配子句
+    return nullptr;
 }
 
 Value Lambda::eval(Assoc &env) { 
-    return ProcedureV(x, e, env);
+    PROFILE_NODE(e_type);
+    const Assoc &top = outermost(env);
+    if (captures.empty()) return ProcedureV(frame, x.size(), e, top);
+    vector<Value> vals;
+    vals.reserve(captures.size());
+    for (auto &c : captures) {
+        Value &v = locate(c.depth, c.slot, env);
+        if (c.boxed && v.type() != V_BOX) v = BoxV(v); // 第一次被捕获时装箱, 此后槽位和副本共用
+        vals.push_back(v);
+    }
+    return ProcedureV(frame, x.size(), e, extend(captureFrame, std::move(vals), top));
 }
 
-Value Apply::eval(Assoc &e) {
-    Value fun = rator->eval(e);
-    if (fun->v_type != V_PROC) throw RuntimeError("Attempt to apply a non-procedure");
-    auto proc = dynamic_cast<Procedure*>(fun.get());
+// Operator check, done before the operands are evaluated
+static void checkApplicable(const Value &fun) {
+    if (!isProcedure(fun)) throw RuntimeError("Attempt to apply a non-procedure");
+}
 
+// Arguments of a call to fun, with room for the slots of its internal defines
+static vector<Value> evalArgs(const Value &fun, const vector<Expr> &rand, Assoc &env) {
     vector<Value> argv;
-    for (auto &ex : rand) argv.push_back(ex->eval(e));
+    argv.reserve(fun.type() == V_PROC ? static_cast<Procedure*>(fun.get())->frame->size() : rand.size());
+    for (auto &ex : rand) argv.push_back(ex->eval(env));
+    return argv;
+}
 
-    if (auto varBody = dynamic_cast<Variadic*>(proc->e.get())) {
-        return varBody->evalRator(argv);
+Value Apply::callee(Assoc &env, bool &checked) {
+    if (cachedEpoch == globalEpoch) {
+        ++stats::counters.globalLookups; // 代替了读取被调用者的单元
+        checked = true;
+        return Value(cachedFun);
     }
+    Value fun = rator->eval(env);
+    checkApplicable(fun);
+    // 只缓存参数个数正确的调用; 出错时照常在参数求值之后报告
+    checked = fun.type() == V_PRIM || static_cast<Procedure*>(fun.get())->arity == rand.size();
+    if (global != nullptr && checked) {
+        cachedFun = fun.get();
+        cachedEpoch = globalEpoch;
+    }
+    return fun;
+}
+
+// Calls fun, checked applicable, with argv. checked says the arity is known
+// to match as well.
+static Value applyLoop(Value fun, vector<Value> argv, bool checked) {
+    PROFILE_SCOPE();
+    stats::DepthScope depthScope;
+    stats::enterCall();
+    while (true) { // 尾调用在同一个C++栈帧中循环执行
+        gcSafePoint();
+        ++stats::counters.calls;
+        if (fun.type() == V_PRIM) return applyPrimitive(static_cast<Primitive*>(fun.get()), argv);
+
+        Procedure *proc = static_cast<Procedure*>(fun.get());
+        if (!checked && argv.size() != proc->arity) throw RuntimeError("Wrong number of arguments");
+        PROFILE_CALL(proc);
+
+        while (argv.size() < proc->frame->size()) argv.push_back(VoidV()); // 内部define占位符
+        Assoc penv = extend(proc->frame, std::move(argv), proc->env); // 参数帧
+
+        // 求值函数体, 直到尾位置上只剩一个调用
+        Value result(nullptr);
+        ExprBase *body = proc->e.get();
+        while (body != nullptr && body->e_type != E_APPLY) body = body->evalTail(penv, result);
+        if (body == nullptr) return result;
+
+        // 尾调用: fun仍持有call所在的函数体, 直到新的操作符和参数求值完毕
+        Apply *call = static_cast<Apply*>(body);
+        PROFILE_NODE(E_APPLY);
+        Value next = call->callee(penv, checked);
+        argv = evalArgs(next, call->rand, penv);
+        fun = next;
+    }
+}
 
-    if (argv.size() != proc->parameters.size()) throw RuntimeError("Wrong number of arguments");
-
-    Assoc penv = proc->env;
-    for (size_t i = 0; i < argv.size(); ++i) {
-        penv = extend(proc->parameters[i], argv[i], penv);
-    } // 扩展环境-绑定
+Value Apply::eval(Assoc &e) {
+    PROFILE_NODE(e_type);
+    bool checked;
+    Value fun = callee(e, checked);
+    vector<Value> argv = evalArgs(fun, rand, e);
+    return applyLoop(std::move(fun), std::move(argv), checked);
+}
 
-    if (auto bg = dynamic_cast<Begin*>(proc->e.get())) return bg->eval(penv); // 求值
-    return proc->e->eval(penv);
+Value applyProcedure(const Value &fun, vector<Value> args) {
+    checkApplicable(fun);
+    return applyLoop(fun, std::move(args), false);
 }
 
 Value Define::eval(Assoc &env) {
-    Value existing = find(var, env);
-    if (existing.get() == nullptr) { // 变量不存在则增添绑定
-        env = extend(var, VoidV(), env);
+    PROFILE_NODE(e_type);
+    if (!global) {
+        Value rhs = e->eval(env);
+        unbox(locate(depth, slot, env)) = rhs;
+        return VoidV();
     }
+    bind();
     Value rhs = e->eval(env);
-    modify(var, rhs, env);
+    ++stats::counters.globalLookups;
+    assignGlobal(cell, rhs);
+    return VoidV();
+}
+
+void Define::bind() {
+    if (cell == nullptr) throw RuntimeError("Define outside a global environment");
+    if (cell->unbound()) assignGlobal(cell, VoidV()); // 变量不存在则增添绑定
+}
+
+Value DefineSyntax::eval(Assoc &env) {
+    PROFILE_NODE(e_type);
+    (void)env;
     return VoidV();
 }
 
 Value Let::eval(Assoc &env) {
+    Assoc inner = env;
+    return evalNonTail(this, inner);
+}
+
+ExprBase *Let::evalTail(Assoc &env, Value &) {
+    PROFILE_NODE(e_type);
     vector<Value> vals;
-    vals.reserve(bind.size());
+    vals.reserve(frame->size());
     for (auto &kv : bind) vals.push_back(kv.second->eval(env)); // 环境中求值
+    while (vals.size() < frame->size()) vals.push_back(VoidV());
 
-    Assoc inner = env;
-    for (size_t i = 0; i < bind.size(); ++i) inner = extend(bind[i].first, vals[i], inner); // 扩展环境
-    return body->eval(inner); // 在新环境中求值
+    env = extend(frame, std::move(vals), env); // 扩展环境
+    return body.get(); // 在新环境中求值
 }
 
 Value Letrec::eval(Assoc &env) {
     Assoc inner = env;
-    for (auto &kv : bind) inner = extend(kv.first, VoidV(), inner);
-    for (auto &kv : bind) {
-        Value v = kv.second->eval(inner);
-        modify(kv.first, v, inner);
+    return evalNonTail(this, inner);
+}
+
+ExprBase *Letrec::evalTail(Assoc &env, Value &) {
+    PROFILE_NODE(e_type);
+    vector<Value> slots(frame->size(), VoidV());
+    env = extend(frame, std::move(slots), env);
+    for (size_t i = 0; i < bind.size(); ++i) {
+        Value v = bind[i].second->eval(env);
+        unbox(env->values[i]) = v; // 可能已被前面的闭包装箱
     }
-    return body->eval(inner);
+    return body.get();
 }
 
 Value Set::eval(Assoc &env) {
-    Value cur = find(var, env);
-    if (cur.get() == nullptr) throw RuntimeError("Undefined variable : " + var);
+    PROFILE_NODE(e_type);
+    if (!global) {
+        Value nv = e->eval(env);
+        unbox(locate(depth, slot, env)) = nv;
+        return VoidV();
+    }
+    if (cell == nullptr || cell->unbound()) throw RuntimeError("Undefined variable : " + var->s);
     Value nv = e->eval(env);
-    modify(var, nv, env);
+    ++stats::counters.globalLookups;
+    assignGlobal(cell, nv);
     return VoidV();
 }
 
 Value Display::evalRator(const Value &v) {
-    v->show(std::cout);
+    v.show(currentOutput());
     return VoidV();
-}
\ No newline at end of file
+}
+
+Value MakeFuture::evalRator(const Value &thunk) {
+    return parallel::future(thunk);
+}
+
+Value Touch::evalRator(const Value &v) {
+    return parallel::touch(v);
+}
+
+Value ParallelMap::evalRator(const Value &fun, const Value &list) {
+    return parallel::map(fun, list);
+}
+
+Value RuntimeStats::evalRator(const std::vector<Value> &) {
+    return stats::snapshot();
+}
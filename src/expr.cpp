@@ -14,7 +14,8 @@ ExprBase* Expr::get() const { return ptr.get(); }
 
 // BASIC TYPES AND LITERALS
 Fixnum::Fixnum(int x) : ExprBase(E_FIXNUM), n(x) {}
-RationalNum::RationalNum(int num, int den) : ExprBase(E_RATIONAL), numerator(num), denominator(den) {}
+BignumExpr::BignumExpr(const BigInt &x) : ExprBase(E_BIGNUM), n(x) {}
+RationalNum::RationalNum(const BigInt &num, const BigInt &den) : ExprBase(E_RATIONAL), numerator(num), denominator(den) {}
 StringExpr::StringExpr(const std::string &str) : ExprBase(E_STRING), s(str) {}
 True::True() : ExprBase(E_TRUE) {}
 False::False() : ExprBase(E_FALSE) {}
@@ -33,21 +34,21 @@ Mult::Mult(const Expr &r1, const Expr &r2) : Binary(E_MUL, r1, r2) {}
 Div::Div(const Expr &r1, const Expr &r2) : Binary(E_DIV, r1, r2) {}
 Modulo::Modulo(const Expr &r1, const Expr &r2) : Binary(E_MODULO, r1, r2) {}
 Expt::Expt(const Expr &r1, const Expr &r2) : Binary(E_EXPT, r1, r2) {}
-PlusVar::PlusVar(const std::vector<Expr> &rands) : Variadic(E_PLUS, rands) {}
-MinusVar::MinusVar(const std::vector<Expr> &rands) : Variadic(E_MINUS, rands) {}
-MultVar::MultVar(const std::vector<Expr> &rands) : Variadic(E_MUL, rands) {}
-DivVar::DivVar(const std::vector<Expr> &rands) : Variadic(E_DIV, rands) {}
+PlusVar::PlusVar(const std::vector<Expr> &rands) : Variadic(E_PLUS_VAR, rands) {}
+MinusVar::MinusVar(const std::vector<Expr> &rands) : Variadic(E_MINUS_VAR, rands) {}
+MultVar::MultVar(const std::vector<Expr> &rands) : Variadic(E_MUL_VAR, rands) {}
+DivVar::DivVar(const std::vector<Expr> &rands) : Variadic(E_DIV_VAR, rands) {}
 
 Less::Less(const Expr &r1, const Expr &r2) : Binary(E_LT, r1, r2) {}
 LessEq::LessEq(const Expr &r1, const Expr &r2) : Binary(E_LE, r1, r2) {}
 Equal::Equal(const Expr &r1, const Expr &r2) : Binary(E_EQ, r1, r2) {}
 GreaterEq::GreaterEq(const Expr &r1, const Expr &r2) : Binary(E_GE, r1, r2) {}
 Greater::Greater(const Expr &r1, const Expr &r2) : Binary(E_GT, r1, r2) {}
-LessVar::LessVar(const std::vector<Expr> &rands) : Variadic(E_LT, rands) {}
-LessEqVar::LessEqVar(const std::vector<Expr> &rands) : Variadic(E_LE, rands) {}
-EqualVar::EqualVar(const std::vector<Expr> &rands) : Variadic(E_EQ, rands) {}
-GreaterEqVar::GreaterEqVar(const std::vector<Expr> &rands) : Variadic(E_GE, rands) {}
-GreaterVar::GreaterVar(const std::vector<Expr> &rands) : Variadic(E_GT, rands) {}
+LessVar::LessVar(const std::vector<Expr> &rands) : Variadic(E_LT_VAR, rands) {}
+LessEqVar::LessEqVar(const std::vector<Expr> &rands) : Variadic(E_LE_VAR, rands) {}
+EqualVar::EqualVar(const std::vector<Expr> &rands) : Variadic(E_EQ_VAR, rands) {}
+GreaterEqVar::GreaterEqVar(const std::vector<Expr> &rands) : Variadic(E_GE_VAR, rands) {}
+GreaterVar::GreaterVar(const std::vector<Expr> &rands) : Variadic(E_GT_VAR, rands) {}
 
 // LIST OPERATIONS
 Cons::Cons(const Expr &r1, const Expr &r2) : Binary(E_CONS, r1, r2) {}
@@ -57,6 +58,21 @@ ListFunc::ListFunc(const std::vector<Expr> &rands) : Variadic(E_LIST, rands) {}
 SetCar::SetCar(const Expr &r1, const Expr &r2) : Binary(E_SETCAR, r1, r2) {}
 SetCdr::SetCdr(const Expr &r1, const Expr &r2) : Binary(E_SETCDR, r1, r2) {}
 
+// VECTOR OPERATIONS
+MakeVector::MakeVector(const std::vector<Expr> &rands) : Variadic(E_MAKE_VECTOR, rands) {}
+VectorFunc::VectorFunc(const std::vector<Expr> &rands) : Variadic(E_VECTOR, rands) {}
+VectorLength::VectorLength(const Expr &r1) : Unary(E_VECTOR_LENGTH, r1) {}
+VectorRef::VectorRef(const Expr &r1, const Expr &r2) : Binary(E_VECTOR_REF, r1, r2) {}
+VectorSet::VectorSet(const std::vector<Expr> &rands) : Variadic(E_VECTOR_SET, rands) {}
+VectorToList::VectorToList(const Expr &r1) : Unary(E_VECTOR_TO_LIST, r1) {}
+ListToVector::ListToVector(const Expr &r1) : Unary(E_LIST_TO_VECTOR, r1) {}
+
+// HASH TABLE OPERATIONS
+MakeHashTable::MakeHashTable(const std::vector<Expr> &rands) : Variadic(E_MAKE_HASH_TABLE, rands) {}
+HashRef::HashRef(const std::vector<Expr> &rands) : Variadic(E_HASH_REF, rands) {}
+HashSet::HashSet(const std::vector<Expr> &rands) : Variadic(E_HASH_SET, rands) {}
+HashCount::HashCount(const Expr &r1) : Unary(E_HASH_COUNT, r1) {}
+
 // LOGIC OPERATIONS
 AndVar::AndVar(const std::vector<Expr> &rands) : ExprBase(E_AND), rands(rands) {}
 OrVar::OrVar(const std::vector<Expr> &rands) : ExprBase(E_OR), rands(rands) {}
@@ -72,9 +88,14 @@ IsProcedure::IsProcedure(const Expr &r1) : Unary(E_PROCQ, r1) {}
 IsSymbol::IsSymbol(const Expr &r1) : Unary(E_SYMBOLQ, r1) {}
 IsList::IsList(const Expr &r1) : Unary(E_LISTQ, r1) {}
 IsString::IsString(const Expr &r1) : Unary(E_STRINGQ, r1) {}
+IsVector::IsVector(const Expr &r1) : Unary(E_VECTORQ, r1) {}
 
 // CONTROL FLOW / QUOTE
-Begin::Begin(const vector<Expr> &vec) : ExprBase(E_BEGIN), es(vec) {}
+Begin::Begin(const vector<Expr> &vec) : ExprBase(E_BEGIN), es(vec), toplevel(false) {
+    for (auto &ex : es) {
+        if (ex->e_type == E_DEFINE && static_cast<Define*>(ex.get())->global) toplevel = true;
+    }
+}
 Quote::Quote(const Syntax &t) : ExprBase(E_QUOTE), s(t) {}
 
 // CONDITIONAL
@@ -82,17 +103,44 @@ If::If(const Expr &c, const Expr &c_t, const Expr &c_e) : ExprBase(E_IF), cond(c
 Cond::Cond(const std::vector<std::vector<Expr>> &cls) : ExprBase(E_COND), clauses(cls) {}
 
 // VARIABLE AND FUNCTION DEFINITION
-Var::Var(const string &s) : ExprBase(E_VAR), x(s) {}
-Apply::Apply(const Expr &expr, const vector<Expr> &vec) : ExprBase(E_APPLY), rator(expr), rand(vec) {}
-Lambda::Lambda(const vector<string> &vec, const Expr &expr) : ExprBase(E_LAMBDA), x(vec), e(expr) {}
-Define::Define(const string &variable, const Expr &expr) : ExprBase(E_DEFINE), var(variable), e(expr) {}
+Var::Var(Name s, int d, int i, bool g, Value *c) : ExprBase(E_VAR), x(s), depth(d), slot(i), global(g), cell(c) {}
+Apply::Apply(const Expr &expr, const vector<Expr> &vec)
+    : ExprBase(E_APPLY), rator(expr), rand(vec), global(nullptr), cachedFun(nullptr), cachedEpoch(0) {
+    if (expr->e_type == E_VAR && static_cast<Var*>(expr.get())->global) global = static_cast<Var*>(expr.get());
+}
+Lambda::Lambda(const vector<Name> &vec, const Expr &expr, const vector<Name> &ls, const vector<Capture> &cs)
+    : ExprBase(E_LAMBDA), x(vec), e(expr), captures(cs) {
+    vector<Name> names = vec;
+    names.insert(names.end(), ls.begin(), ls.end());
+    frame = std::make_shared<const vector<Name>>(names);
+    vector<Name> captured;
+    for (auto &c : cs) captured.push_back(c.x);
+    captureFrame = std::make_shared<const vector<Name>>(captured);
+}
+Define::Define(Name variable, const Expr &expr, int d, int i, bool g, Value *c) : ExprBase(E_DEFINE), var(variable), e(expr), depth(d), slot(i), global(g), cell(c) {}
+
+DefineSyntax::DefineSyntax(Name variable) : ExprBase(E_DEFINE_SYNTAX), var(variable) {}
 
 // BINDING CONSTRUCTS
-Let::Let(const vector<pair<string, Expr>> &vec, const Expr &expr) : ExprBase(E_LET), bind(vec), body(expr) {}
-Letrec::Letrec(const vector<pair<string, Expr>> &vec, const Expr &expr) : ExprBase(E_LETREC), bind(vec), body(expr) {}
+static FrameNames bindingFrame(const vector<pair<Name, Expr>> &bind, const vector<Name> &ls) {
+    vector<Name> names;
+    for (auto &kv : bind) names.push_back(kv.first);
+    names.insert(names.end(), ls.begin(), ls.end());
+    return std::make_shared<const vector<Name>>(names);
+}
+Let::Let(const vector<pair<Name, Expr>> &vec, const Expr &expr, const vector<Name> &ls) : ExprBase(E_LET), bind(vec), body(expr), frame(bindingFrame(vec, ls)) {}
+Letrec::Letrec(const vector<pair<Name, Expr>> &vec, const Expr &expr, const vector<Name> &ls) : ExprBase(E_LETREC), bind(vec), body(expr), frame(bindingFrame(vec, ls)) {}
 
 // ASSIGNMENT
-Set::Set(const std::string &var, const Expr &expr) : ExprBase(E_SET), var(var), e(expr) {}
+Set::Set(Name var, const Expr &expr, int d, int i, bool g, Value *c) : ExprBase(E_SET), var(var), e(expr), depth(d), slot(i), global(g), cell(c) {}
 
 // I/O OPERATIONS
-Display::Display(const Expr &r1) : Unary(E_DISPLAY, r1) {}
\ No newline at end of file
+Display::Display(const Expr &r1) : Unary(E_DISPLAY, r1) {}
+
+// PARALLEL EVALUATION
+MakeFuture::MakeFuture(const Expr &r1) : Unary(E_FUTURE, r1) {}
+Touch::Touch(const Expr &r1) : Unary(E_TOUCH, r1) {}
+ParallelMap::ParallelMap(const Expr &r1, const Expr &r2) : Binary(E_PARALLEL_MAP, r1, r2) {}
+
+// RUNTIME STATISTICS
+RuntimeStats::RuntimeStats(const vector<Expr> &rands) : Variadic(E_RUNTIME_STATS, rands) {}
@@ -4,16 +4,23 @@
 #include "Def.hpp"
 #include "syntax.hpp"
 #include "RE.hpp"
+#include <cstdint>
 #include <memory>
 #include <vector>
 #include <string>
 
 struct Value;
+struct Bytecode;
 
 struct ExprBase {
     ExprType e_type;
+    std::shared_ptr<Bytecode> bytecode;   ///< Set by the VM on procedure bodies, compiled on first call
     ExprBase(ExprType et);
     virtual Value eval(Assoc &env) = 0;
+    // Proper tail calls: evaluates everything except the subexpression in tail
+    // position and returns it, with env updated to the environment it must run
+    // in. Returns nullptr once the value is known and stored in result.
+    virtual ExprBase *evalTail(Assoc &env, Value &result);
     virtual ~ExprBase() = default;
 };
 
@@ -33,16 +40,26 @@ struct Fixnum : ExprBase {
     Value eval(Assoc &env) override;
 };
 
+// Integer literal outside the fixnum range
+struct BignumExpr : ExprBase {
+    BigInt n;
+    std::shared_ptr<Value> value;   ///< Materialised on first evaluation
+    BignumExpr(const BigInt &);
+    Value eval(Assoc &env) override;
+};
+
 //Rational literal expression
 struct RationalNum : ExprBase {
-    int numerator, denominator;
-    RationalNum(int num, int den);
+    BigInt numerator, denominator;
+    std::shared_ptr<Value> value;   ///< Materialised on first evaluation
+    RationalNum(const BigInt &num, const BigInt &den);
     Value eval(Assoc &env) override;
 };
 
 // String literal expression
 struct StringExpr : ExprBase {
     std::string s;
+    std::shared_ptr<Value> value;   ///< Materialised on first evaluation
     StringExpr(const std::string &);
     Value eval(Assoc &env) override;
 };
@@ -201,6 +218,59 @@ struct SetCdr : Binary {
     Value evalRator(const Value &, const Value &) override; 
 };
 
+// VECTOR OPERATIONS
+// (make-vector k [fill]); fill defaults to 0
+struct MakeVector : Variadic {
+    MakeVector(const std::vector<Expr> &);
+    Value evalRator(const std::vector<Value> &) override;
+};
+struct VectorFunc : Variadic {
+    VectorFunc(const std::vector<Expr> &);
+    Value evalRator(const std::vector<Value> &) override;
+};
+struct VectorLength : Unary {
+    VectorLength(const Expr &);
+    Value evalRator(const Value &) override;
+};
+struct VectorRef : Binary {
+    VectorRef(const Expr &, const Expr &);
+    Value evalRator(const Value &, const Value &) override;
+};
+// (vector-set! v k x), always three operands
+struct VectorSet : Variadic {
+    VectorSet(const std::vector<Expr> &);
+    Value evalRator(const std::vector<Value> &) override;
+};
+struct VectorToList : Unary {
+    VectorToList(const Expr &);
+    Value evalRator(const Value &) override;
+};
+struct ListToVector : Unary {
+    ListToVector(const Expr &);
+    Value evalRator(const Value &) override;
+};
+
+// HASH TABLE OPERATIONS
+// (make-hash-table), never with operands
+struct MakeHashTable : Variadic {
+    MakeHashTable(const std::vector<Expr> &);
+    Value evalRator(const std::vector<Value> &) override;
+};
+// (hash-ref table key [default]); without default a missing key is an error
+struct HashRef : Variadic {
+    HashRef(const std::vector<Expr> &);
+    Value evalRator(const std::vector<Value> &) override;
+};
+// (hash-set! table key value), always three operands
+struct HashSet : Variadic {
+    HashSet(const std::vector<Expr> &);
+    Value evalRator(const std::vector<Value> &) override;
+};
+struct HashCount : Unary {
+    HashCount(const Expr &);
+    Value evalRator(const Value &) override;
+};
+
 // TYPE PREDICATES
 struct IsEq : Binary { 
     IsEq(const Expr &, const Expr &); 
@@ -238,17 +308,23 @@ struct IsString : Unary {
     IsString(const Expr &); 
     Value evalRator(const Value &) override; 
 };
+struct IsVector : Unary {
+    IsVector(const Expr &);
+    Value evalRator(const Value &) override;
+};
 
 // LOGIC OPERATIONS
 struct AndVar : ExprBase { 
     std::vector<Expr> rands; 
     AndVar(const std::vector<Expr> &); 
     Value eval(Assoc &env) override; 
+    ExprBase *evalTail(Assoc &env, Value &result) override; 
 };
 struct OrVar  : ExprBase { 
     std::vector<Expr> rands; 
     OrVar(const std::vector<Expr> &);  
     Value eval(Assoc &env) override; 
+    ExprBase *evalTail(Assoc &env, Value &result) override; 
 };
 struct Not : Unary { 
     Not(const Expr &); 
@@ -258,11 +334,15 @@ struct Not : Unary {
 // CONTROL FLOW CONSTRUCTS
 struct Begin : ExprBase { 
     std::vector<Expr> es; 
+    bool toplevel;   ///< Contains top-level defines, which are batched by eval
     Begin(const std::vector<Expr> &); 
     Value eval(Assoc &env) override; 
+    ExprBase *evalTail(Assoc &env, Value &result) override; 
 };
 struct Quote : ExprBase { 
-    Syntax s; Quote(const Syntax &); 
+    Syntax s; 
+    std::shared_ptr<Value> value;   ///< Quoted datum, built on first evaluation and shared afterwards
+    Quote(const Syntax &); 
     Value eval(Assoc &env) override; 
 };
 
@@ -271,53 +351,113 @@ struct If : ExprBase {
     Expr cond, conseq, alter; 
     If(const Expr &, const Expr &, const Expr &); 
     Value eval(Assoc &env) override; 
+    ExprBase *evalTail(Assoc &env, Value &result) override; 
 };
 struct Cond : ExprBase { 
     std::vector<std::vector<Expr>> clauses; 
     Cond(const std::vector<std::vector<Expr>> &); 
     Value eval(Assoc &env) override; 
+    ExprBase *evalTail(Assoc &env, Value &result) override; 
 };
 
 // VARIABLE AND FUNCTION DEFINITION
+// Lexical addressing: the parser mirrors the runtime environment frame for
+// frame, so a local is found `depth` frames up at index `slot`. For globals
+// `depth` is the number of local frames in scope, and `cell` is the binding
+// in the GlobalEnv the expression was parsed in (nullptr when there was
+// none, then only primitives are visible).
 struct Var : ExprBase { 
-    std::string x; 
-    Var(const std::string &);
+    Name x; 
+    int depth, slot;
+    bool global;
+    Value *cell;
+    Var(Name, int depth = 0, int slot = 0, bool global = true, Value *cell = nullptr);
     Value eval(Assoc &env) override; 
 };
+/**
+ * A call whose operator is a global variable has a monomorphic inline cache:
+ * the procedure the variable held, checked applicable and of the right arity
+ * for this call, and the globalEpoch it was found at. While the epoch is
+ * unchanged the cell still holds (and keeps alive) that procedure, so the
+ * call uses it without evaluating the operator or checking it again.
+ */
 struct Apply : ExprBase { 
     Expr rator; std::vector<Expr> rand; 
+    Var *global;             ///< rator when it is a global variable, else nullptr
+    ValueBase *cachedFun;    ///< Callee found through global at cachedEpoch
+    uint64_t cachedEpoch;    ///< 0 when nothing is cached
     Apply(const Expr &, const std::vector<Expr> &); 
     Value eval(Assoc &env) override; 
-};
+    Value callee(Assoc &env, bool &checked);   ///< The operator; checked says its arity is known to match
+};
+/**
+ * A local variable of the enclosing frames that a lambda's body uses. The
+ * closure copies it, so the body finds it in a frame of its own (see Lambda).
+ */
+struct Capture {
+    Name x;
+    int depth, slot;   ///< Where it is in the environment the lambda is evaluated in
+    bool boxed;        ///< It may be assigned later, so the copy shares a Box with the slot
+};
+/**
+ * A closure does not keep the environment it was created in: it gets one
+ * frame holding the captured variables, in the order of `captures`, linked
+ * straight to the outermost frame (the GlobalEnv), or that frame alone when
+ * it captures nothing. The body's frame is opened on top of it, so in the body
+ * the captured variables are one frame further out than the parameters.
+ */
 struct Lambda : ExprBase { 
-    std::vector<std::string> x; 
+    std::vector<Name> x; 
     Expr e; 
-    Lambda(const std::vector<std::string> &, const Expr &); 
+    FrameNames frame;   ///< Parameters followed by internal defines
+    std::vector<Capture> captures;
+    FrameNames captureFrame;   ///< Names of the captures
+    Lambda(const std::vector<Name> &, const Expr &, const std::vector<Name> & = {},
+           const std::vector<Capture> & = {}); 
     Value eval(Assoc &env) override; 
 };
 struct Define : ExprBase { 
-    std::string var; Expr e; 
-    Define(const std::string &, const Expr &); 
+    Name var; Expr e; 
+    int depth, slot;
+    bool global;
+    Value *cell;
+    Define(Name, const Expr &, int depth = 0, int slot = 0, bool global = true, Value *cell = nullptr); 
     Value eval(Assoc &env) override; 
+    void bind();   ///< Binds a global to #<void> unless it is bound already
+};
+
+// The macro is registered by the parser; evaluating the form does nothing
+struct DefineSyntax : ExprBase {
+    Name var;
+    DefineSyntax(Name);
+    Value eval(Assoc &env) override;
 };
 
 // BINDING CONSTRUCTS
 struct Let : ExprBase { 
-    std::vector<std::pair<std::string, Expr>> bind; Expr body; 
-    Let(const std::vector<std::pair<std::string, Expr>> &, const Expr &); 
+    std::vector<std::pair<Name, Expr>> bind; Expr body; 
+    FrameNames frame;   ///< Bound variables followed by internal defines
+    Let(const std::vector<std::pair<Name, Expr>> &, const Expr &, const std::vector<Name> & = {}); 
     Value eval(Assoc &env) override; 
+    ExprBase *evalTail(Assoc &env, Value &result) override; 
 };
 struct Letrec : ExprBase { 
-    std::vector<std::pair<std::string, Expr>> bind; 
-    Expr body; Letrec(const std::vector<std::pair<std::string, Expr>> &, const Expr &); 
+    std::vector<std::pair<Name, Expr>> bind; 
+    Expr body; 
+    FrameNames frame;
+    Letrec(const std::vector<std::pair<Name, Expr>> &, const Expr &, const std::vector<Name> & = {}); 
     Value eval(Assoc &env) override; 
+    ExprBase *evalTail(Assoc &env, Value &result) override; 
 };
 
 // ASSIGNMENT
 struct Set : ExprBase { 
-    std::string var; 
+    Name var; 
     Expr e; 
-    Set(const std::string &, const Expr &); 
+    int depth, slot;
+    bool global;
+    Value *cell;
+    Set(Name, const Expr &, int depth = 0, int slot = 0, bool global = true, Value *cell = nullptr); 
     Value eval(Assoc &env) override; 
 };
 
@@ -327,6 +467,33 @@ struct Display : Unary {
     Value evalRator(const Value &) override; 
 };
 
+// ============================================================================
+// Parallel evaluation (see parallel.hpp)
+// ============================================================================
+
+struct MakeFuture : Unary {
+    MakeFuture(const Expr &);
+    Value evalRator(const Value &) override;
+};
+struct Touch : Unary {
+    Touch(const Expr &);
+    Value evalRator(const Value &) override;
+};
+struct ParallelMap : Binary {
+    ParallelMap(const Expr &, const Expr &);
+    Value evalRator(const Value &, const Value &) override;
+};
+
+// ============================================================================
+// Runtime statistics (see stats.hpp)
+// ============================================================================
+
+// (runtime-stats), never with operands
+struct RuntimeStats : Variadic {
+    RuntimeStats(const std::vector<Expr> &);
+    Value evalRator(const std::vector<Value> &) override;
+};
+
 // UTILITIES
 Value syntax_to_value(const Syntax &stx);
 
@@ -0,0 +1,107 @@
+/**
+ * @file gc.cpp
+ * @brief Mark-sweep over the registry of managed objects
+ */
+
+#include "gc.hpp"
+#include "profile.hpp"
+#include <algorithm>
+#include <vector>
+
+namespace {
+
+const size_t GC_MIN_THRESHOLD = 1 << 16; // 堆很小时也不要过于频繁地回收
+
+// 不用带析构函数的全局对象: 静态Value在退出时析构, 仍会访问注册表
+thread_local GcObject *registry = nullptr;
+thread_local size_t liveObjects = 0;
+thread_local std::vector<GcObject*> *markStack = nullptr;
+
+// gcFree中, 析构函数释放的对象排在这里, 由最外层的gcFree逐个删除
+thread_local std::vector<GcObject*> *freeQueue = nullptr;
+thread_local bool freeing = false;
+
+void dropInternalRef(GcObject *o) {
+    --o->gcRefs;
+}
+
+void mark(GcObject *o) {
+    if (o->gcMarked) return;
+    o->gcMarked = true;
+    markStack->push_back(o);
+}
+
+} // namespace
+
+thread_local size_t gcAllocated = 0;
+thread_local size_t gcTotalAllocated = 0;
+thread_local size_t gcThreshold = GC_MIN_THRESHOLD;
+
+GcObject::GcObject() : refs(0), gcRefs(0), gcMarked(false), gcPrev(nullptr), gcNext(registry) {
+    if (registry != nullptr) registry->gcPrev = this;
+    registry = this;
+    ++gcAllocated;
+    ++gcTotalAllocated;
+    ++liveObjects;
+    PROFILE_ALLOCATION();
+}
+
+GcObject::~GcObject() {
+    if (gcPrev != nullptr) gcPrev->gcNext = gcNext;
+    else registry = gcNext;
+    if (gcNext != nullptr) gcNext->gcPrev = gcPrev;
+    --liveObjects;
+}
+
+void gcFree(GcObject *o) {
+    if (freeing) {
+        freeQueue->push_back(o);
+        return;
+    }
+    if (freeQueue == nullptr) freeQueue = new std::vector<GcObject*>();
+    freeing = true;
+    delete o;
+    while (!freeQueue->empty()) {
+        GcObject *next = freeQueue->back();
+        freeQueue->pop_back();
+        delete next;
+    }
+    freeing = false;
+}
+
+size_t gcCollect() {
+    // 1. 减去堆内对象之间的引用, 剩下的是来自堆外的引用
+    for (GcObject *o = registry; o != nullptr; o = o->gcNext) {
+        o->gcRefs = o->refs;
+        o->gcMarked = false;
+    }
+    for (GcObject *o = registry; o != nullptr; o = o->gcNext) o->trace(dropInternalRef);
+
+    // 2. 从有堆外引用的对象出发标记
+    std::vector<GcObject*> stack;
+    markStack = &stack;
+    for (GcObject *o = registry; o != nullptr; o = o->gcNext) {
+        if (o->gcRefs > 0) mark(o);
+    }
+    while (!stack.empty()) {
+        GcObject *o = stack.back();
+        stack.pop_back();
+        o->trace(mark);
+    }
+    markStack = nullptr;
+
+    // 3. 清除: 先拆开垃圾之间的引用, 再释放, 避免析构时递归或重复释放
+    std::vector<GcObject*> garbage;
+    for (GcObject *o = registry; o != nullptr; o = o->gcNext) {
+        if (!o->gcMarked) garbage.push_back(o);
+    }
+    for (GcObject *o : garbage) ++o->refs;
+    for (GcObject *o : garbage) o->clearRefs();
+    for (GcObject *o : garbage) {
+        if (--o->refs == 0) delete o;
+    }
+
+    gcAllocated = 0;
+    gcThreshold = std::max(GC_MIN_THRESHOLD, liveObjects); // 堆增长一倍时再回收
+    return garbage.size();
+}
@@ -0,0 +1,78 @@
+#ifndef GC_HPP
+#define GC_HPP
+
+/**
+ * @file gc.hpp
+ * @brief Tracing collector for heap values and environment frames
+ *
+ * Reference counting frees most objects as soon as the last Value or Assoc to
+ * them goes away, but never frees a cycle, and every closure that can call
+ * itself (letrec, a recursive define) refers back to itself, through the Box
+ * or the GlobalEnv cell it is stored in. So every heap object is also
+ * registered here, and gcCollect() periodically runs a mark-sweep over the
+ * whole registry that frees whatever is no longer reachable.
+ *
+ * The roots are derived from the reference counts rather than from a scan of
+ * the C++ stack: subtracting the references held by other heap objects from
+ * each count leaves the references held from outside the heap (locals of the
+ * evaluator, the VM stacks, the REPL's global environment, literals cached in
+ * Expr nodes, the primitive table). Objects with such a reference are the
+ * roots, so the collector needs no cooperation from the code holding them.
+ *
+ * A collection may only run at a safe point (gcSafePoint()), where every live
+ * object is owned by a Value or Assoc; the evaluator and the VM check at each
+ * procedure call.
+ */
+
+#include "pool.hpp"
+#include <cstddef>
+
+struct GcObject;
+typedef void (*GcVisit)(GcObject *);
+
+/**
+ * @brief Base of every object managed by the collector
+ */
+struct GcObject {
+    int refs;                    ///< Intrusive reference count, managed by Value and Assoc
+    int gcRefs;                  ///< References from outside the heap, during a collection
+    bool gcMarked;               ///< Reachable from a root, during a collection
+    GcObject *gcPrev, *gcNext;   ///< Registry of all live objects
+
+    GcObject();
+    GcObject(const GcObject &) = delete;
+    GcObject &operator=(const GcObject &) = delete;
+    virtual ~GcObject();
+
+    // Managed objects live in the size-class pools (the virtual destructor
+    // makes delete pass the size of the dynamic type)
+    static void *operator new(size_t n) { return poolAlloc(n); }
+    static void operator delete(void *p, size_t n) { poolFree(p, n); }
+
+    /// Calls visit on every managed object this one references directly
+    virtual void trace(GcVisit visit) { (void)visit; }
+    /// Drops those references, used to break up garbage cycles
+    virtual void clearRefs() {}
+};
+
+// Each thread has a heap of its own: objects are registered with, and
+// collected by, the thread that allocated them, so a Value must never be
+// passed to another thread.
+extern thread_local size_t gcAllocated;   ///< Objects allocated since the last collection
+extern thread_local size_t gcTotalAllocated;   ///< Objects allocated by this thread since it started
+extern thread_local size_t gcThreshold;   ///< gcAllocated that triggers the next collection
+
+/// Frees every unreachable object of this thread and returns how many there were
+size_t gcCollect();
+
+/// Deletes o, whose reference count has dropped to zero. Objects released by
+/// its destructor are deleted after it returns rather than from within it, so
+/// dropping a long list (or frame chain) takes constant stack.
+void gcFree(GcObject *o);
+
+/// Collects if enough has been allocated since the last collection
+inline void gcSafePoint() {
+    if (gcAllocated >= gcThreshold) gcCollect();
+}
+
+#endif // GC_HPP
@@ -0,0 +1,1228 @@
+/**
+ * @file image.cpp
+ * @brief Image encoding and decoding
+ *
+ * Every record starts with a tag. Heap values, frames, Expr nodes, names and
+ * frame name lists are numbered in the order they are first written; a
+ * later occurrence is written as a reference to that number. The decoder
+ * numbers objects in the same order, registering each one before it reads
+ * the fields, so references to an object still being decoded (a frame that
+ * holds a closure over itself) resolve to it.
+ *
+ * Lists and frame chains are written as a loop along the cdr / next link
+ * rather than recursively, so long lists and a long chain of top-level
+ * frames need no stack.
+ *
+ * A transfer (encodeTransfer) is the same encoding of a single value, except
+ * that its GlobalEnv record has no cells and no macros. The cells are written
+ * after the value instead, each one as a 1 byte, its name and its value, up
+ * to a 0 byte: only the globals that the Var, Define and Set nodes written so
+ * far refer to, including those written as part of these cells.
+ *
+ * A list of parsed forms (encodeForms) is a count followed by each form's
+ * Expr, X_NULL for one that failed to parse, and its macro changes: a count
+ * of names, each followed by a 1 byte and the macro, or a 0 byte for a
+ * removal. It holds no values; Var, Define and Set nodes are resolved to
+ * cells of the GlobalEnv the forms are decoded for.
+ *
+ * Once everything is decoded, the lexical addresses of the code are checked
+ * against the frames it runs in: those of a closure body are its own frame,
+ * its capture frame and, for a restored procedure, the frames of its
+ * environment; let and letrec add theirs. An address outside them, or a
+ * capture of one, makes the image corrupted rather than reading past a frame
+ * at run time.
+ */
+
+#include "image.hpp"
+#include "expr.hpp"
+#include "macro.hpp"
+#include "RE.hpp"
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <set>
+#include <unordered_map>
+#include <vector>
+
+extern const std::map<std::string, ExprType> primitives;
+
+namespace {
+
+const char IMAGE_MAGIC[8] = {'S', 'C', 'M', 'I', 'M', 'G', '\0', '\10'};
+const size_t NO_EXPR = size_t(-1);
+
+// Value records
+enum : unsigned char {
+    T_NONE, T_FIXNUM, T_CONST, T_REF, T_BIGNUM, T_RATIONAL,
+    T_SYMBOL, T_STRING, T_PAIR, T_PROC, T_PRIM, T_VECTOR, T_HASH_TABLE, T_BOX
+};
+
+// Frame (Assoc) records; the GlobalEnv is followed by its bound cells and macros
+enum : unsigned char { A_EMPTY, A_REF, A_FRAME, A_GLOBAL };
+
+// Expr records; a node is followed by its ExprType and fields
+enum : unsigned char { X_NULL, X_REF, X_NODE };
+
+// What a writer encodes: an image, a transfer or a list of parsed forms
+enum WriterMode { W_IMAGE, W_TRANSFER, W_FORMS };
+
+bool isUnary(ExprType t) {
+    switch (t) {
+        case E_CAR: case E_CDR: case E_NOT: case E_DISPLAY: case E_FUTURE: case E_TOUCH:
+        case E_BOOLQ: case E_INTQ: case E_NULLQ: case E_PAIRQ:
+        case E_PROCQ: case E_SYMBOLQ: case E_LISTQ: case E_STRINGQ: case E_VECTORQ:
+        case E_VECTOR_LENGTH: case E_VECTOR_TO_LIST: case E_LIST_TO_VECTOR: case E_HASH_COUNT:
+            return true;
+        default:
+            return false;
+    }
+}
+
+bool isBinary(ExprType t) {
+    switch (t) {
+        case E_PLUS: case E_MINUS: case E_MUL: case E_DIV: case E_MODULO: case E_EXPT:
+        case E_LT: case E_LE: case E_EQ: case E_GE: case E_GT:
+        case E_CONS: case E_SETCAR: case E_SETCDR: case E_EQQ: case E_VECTOR_REF:
+        case E_PARALLEL_MAP:
+            return true;
+        default:
+            return false;
+    }
+}
+
+bool isVariadic(ExprType t) {
+    switch (t) {
+        case E_PLUS_VAR: case E_MINUS_VAR: case E_MUL_VAR: case E_DIV_VAR:
+        case E_LT_VAR: case E_LE_VAR: case E_EQ_VAR: case E_GE_VAR: case E_GT_VAR:
+        case E_LIST: case E_MAKE_VECTOR: case E_VECTOR: case E_VECTOR_SET:
+        case E_MAKE_HASH_TABLE: case E_HASH_REF: case E_HASH_SET: case E_RUNTIME_STATS:
+            return true;
+        default:
+            return false;
+    }
+}
+
+ExprBase *unaryNode(ExprType t, const Expr &a) {
+    switch (t) {
+        case E_CAR:     return new Car(a);
+        case E_CDR:     return new Cdr(a);
+        case E_NOT:     return new Not(a);
+        case E_DISPLAY: return new Display(a);
+        case E_FUTURE:  return new MakeFuture(a);
+        case E_TOUCH:   return new Touch(a);
+        case E_BOOLQ:   return new IsBoolean(a);
+        case E_INTQ:    return new IsFixnum(a);
+        case E_NULLQ:   return new IsNull(a);
+        case E_PAIRQ:   return new IsPair(a);
+        case E_PROCQ:   return new IsProcedure(a);
+        case E_SYMBOLQ: return new IsSymbol(a);
+        case E_LISTQ:   return new IsList(a);
+        case E_VECTORQ: return new IsVector(a);
+        case E_VECTOR_LENGTH:  return new VectorLength(a);
+        case E_VECTOR_TO_LIST: return new VectorToList(a);
+        case E_LIST_TO_VECTOR: return new ListToVector(a);
+        case E_HASH_COUNT:     return new HashCount(a);
+        default:        return new IsString(a);
+    }
+}
+
+ExprBase *binaryNode(ExprType t, const Expr &a, const Expr &b) {
+    switch (t) {
+        case E_PLUS:   return new Plus(a, b);
+        case E_MINUS:  return new Minus(a, b);
+        case E_MUL:    return new Mult(a, b);
+        case E_DIV:    return new Div(a, b);
+        case E_MODULO: return new Modulo(a, b);
+        case E_EXPT:   return new Expt(a, b);
+        case E_LT:     return new Less(a, b);
+        case E_LE:     return new LessEq(a, b);
+        case E_EQ:     return new Equal(a, b);
+        case E_GE:     return new GreaterEq(a, b);
+        case E_GT:     return new Greater(a, b);
+        case E_CONS:   return new Cons(a, b);
+        case E_SETCAR: return new SetCar(a, b);
+        case E_SETCDR: return new SetCdr(a, b);
+        case E_VECTOR_REF: return new VectorRef(a, b);
+        case E_PARALLEL_MAP: return new ParallelMap(a, b);
+        default:       return new IsEq(a, b);
+    }
+}
+
+ExprBase *variadicNode(ExprType t, const std::vector<Expr> &rands) {
+    switch (t) {
+        case E_PLUS_VAR:  return new PlusVar(rands);
+        case E_MINUS_VAR: return new MinusVar(rands);
+        case E_MUL_VAR:   return new MultVar(rands);
+        case E_DIV_VAR:   return new DivVar(rands);
+        case E_LT_VAR:    return new LessVar(rands);
+        case E_LE_VAR:    return new LessEqVar(rands);
+        case E_EQ_VAR:    return new EqualVar(rands);
+        case E_GE_VAR:    return new GreaterEqVar(rands);
+        case E_GT_VAR:    return new GreaterVar(rands);
+        case E_MAKE_VECTOR: return new MakeVector(rands);
+        case E_VECTOR:      return new VectorFunc(rands);
+        case E_VECTOR_SET:  return new VectorSet(rands);
+        case E_MAKE_HASH_TABLE: return new MakeHashTable(rands);
+        case E_HASH_REF:    return new HashRef(rands);
+        case E_HASH_SET:    return new HashSet(rands);
+        case E_RUNTIME_STATS: return new RuntimeStats(rands);
+        default:          return new ListFunc(rands);
+    }
+}
+
+// ============================================================================
+// Writer
+// ============================================================================
+
+class ImageWriter {
+public:
+    std::string out;
+
+    explicit ImageWriter(WriterMode mode = W_IMAGE) : transfer(mode == W_TRANSFER), forms(mode == W_FORMS) {
+        out.append(IMAGE_MAGIC, sizeof IMAGE_MAGIC);
+        for (auto &kv : primitives) {
+            Name x = intern(kv.first);
+            primitiveNames.emplace(builtin(x)->get(), x);
+        }
+    }
+
+    void value(Value v);
+    void env(Assoc e);
+    void expr(const Expr &);
+    void referencedGlobals();   ///< The cells of a transfer, after its value
+    void parsedForms(const std::vector<ParsedForm> &);
+
+private:
+    bool transfer;
+    bool forms;   // 形式已经运行过, 其中构造好的常量不写出
+    GlobalEnv *transferGlobals = nullptr;
+    std::vector<Name> referenced;   // 传输中用到的全局变量, 按首次出现的顺序
+    std::unordered_map<Name, bool> isReferenced;
+    std::unordered_map<const GcObject*, size_t> objects;
+    std::unordered_map<Name, size_t> names;
+    std::unordered_map<const std::vector<Name>*, size_t> frames;
+    std::unordered_map<const ExprBase*, size_t> exprs;
+    std::unordered_map<const ValueBase*, Name> primitiveNames;
+
+    void byte(unsigned char b) { out.push_back(char(b)); }
+    void uint(uint64_t n) {
+        for (; n >= 0x80; n >>= 7) byte((unsigned char)(n | 0x80));
+        byte((unsigned char)n);
+    }
+    void sint(int64_t n) { uint(n < 0 ? ~(uint64_t(n) << 1) : uint64_t(n) << 1); }
+    void str(const std::string &s) {
+        uint(s.size());
+        out.append(s);
+    }
+
+    // Writes the number of a known object, or registers a new one (the
+    // caller then writes its contents); true if it was known
+    template <class K>
+    bool reference(std::unordered_map<K, size_t> &table, K key) {
+        auto it = table.find(key);
+        if (it != table.end()) {
+            uint(it->second);
+            return true;
+        }
+        size_t n = table.size();
+        table.emplace(key, n);
+        uint(n);
+        return false;
+    }
+
+    void name(Name x) {
+        if (!reference(names, x)) str(x->s);
+    }
+    void frame(const FrameNames &f) {
+        if (reference(frames, f.get())) return;
+        uint(f->size());
+        for (Name x : *f) name(x);
+    }
+    void nameList(const std::vector<Name> &xs) {
+        uint(xs.size());
+        for (Name x : xs) name(x);
+    }
+    void exprList(const std::vector<Expr> &es) {
+        uint(es.size());
+        for (auto &e : es) expr(e);
+    }
+    void syntax(const Syntax &);
+    void macro(const Macro &);
+    void globals(GlobalEnv *);
+    void global(Name x, bool isGlobal) {
+        if (transfer && isGlobal && isReferenced.emplace(x, true).second) referenced.push_back(x);
+    }
+};
+
+void ImageWriter::globals(GlobalEnv *g) {
+    byte(A_GLOBAL);
+    if (transfer) { // 用到的单元在值之后写出
+        if (transferGlobals != nullptr && transferGlobals != g) {
+            throw RuntimeError("Procedures of different global environments cannot be passed together");
+        }
+        transferGlobals = g;
+        uint(0);
+        uint(0);
+        return;
+    }
+    size_t bound = 0;
+    for (auto &kv : g->cells) bound += !kv.second.unbound();
+    uint(bound);
+    for (auto &kv : g->cells) {
+        if (kv.second.unbound()) continue; // 未绑定的单元在加载时按需创建
+        name(kv.first);
+        value(kv.second);
+    }
+    uint(g->macros.size());
+    for (auto &kv : g->macros) {
+        name(kv.first);
+        macro(*kv.second);
+    }
+}
+
+void ImageWriter::macro(const Macro &m) { // 规则按原样保存, 加载时重新分析
+    name(m.ellipsis);
+    nameList(m.literals);
+    uint(m.rules.size());
+    for (auto &r : m.rules) {
+        syntax(r.pattern);
+        syntax(r.tmpl);
+    }
+}
+
+void ImageWriter::parsedForms(const std::vector<ParsedForm> &fs) {
+    uint(fs.size());
+    for (auto &f : fs) {
+        expr(f.expr);
+        uint(f.macros.size());
+        for (auto &kv : f.macros) {
+            name(kv.first);
+            byte(kv.second ? 1 : 0);
+            if (kv.second) macro(*kv.second);
+        }
+    }
+}
+
+void ImageWriter::referencedGlobals() {
+    for (size_t i = 0; i < referenced.size(); ++i) { // 写出的值可能用到更多全局变量
+        if (transferGlobals == nullptr) break;
+        auto it = transferGlobals->cells.find(referenced[i]);
+        if (it == transferGlobals->cells.end() || it->second.unbound()) continue;
+        byte(1);
+        name(it->first);
+        value(it->second);
+    }
+    byte(0);
+}
+
+void ImageWriter::value(Value v) {
+    while (true) {
+        if (v.unbound()) {
+            byte(T_NONE);
+            return;
+        }
+        if (v.isFixnum()) {
+            byte(T_FIXNUM);
+            sint(v.fixnum());
+            return;
+        }
+        if (!v.isHeap()) {
+            byte(T_CONST);
+            uint(v.bits >> 2);
+            return;
+        }
+        ValueBase *p = v.get();
+        auto it = objects.find(p);
+        if (it != objects.end()) {
+            byte(T_REF);
+            uint(it->second);
+            return;
+        }
+        objects.emplace(p, objects.size());
+        switch (p->v_type) {
+            case V_PAIR: { // cdr紧接在car之后, 循环写出
+                Pair *pair = static_cast<Pair*>(p);
+                byte(T_PAIR);
+                value(pair->car);
+                v = pair->cdr;
+                continue;
+            }
+            case V_BIGNUM:
+                byte(T_BIGNUM);
+                str(static_cast<Bignum*>(p)->n.toString());
+                return;
+            case V_RATIONAL: {
+                Rational *r = static_cast<Rational*>(p);
+                byte(T_RATIONAL);
+                str(r->numerator.toString());
+                str(r->denominator.toString());
+                return;
+            }
+            case V_SYM:
+                byte(T_SYMBOL);
+                name(static_cast<Symbol*>(p));
+                return;
+            case V_STRING:
+                byte(T_STRING);
+                str(static_cast<String*>(p)->s);
+                return;
+            case V_PROC: {
+                Procedure *proc = static_cast<Procedure*>(p);
+                byte(T_PROC);
+                frame(proc->frame);
+                uint(proc->arity);
+                expr(proc->e);
+                env(proc->env);
+                return;
+            }
+            case V_PRIM:
+                byte(T_PRIM);
+                name(primitiveNames.at(p));
+                return;
+            case V_VECTOR: {
+                Vector *vec = static_cast<Vector*>(p);
+                byte(T_VECTOR);
+                uint(vec->elems.size());
+                for (auto &x : vec->elems) value(x);
+                return;
+            }
+            case V_HASH_TABLE: {
+                HashTable *table = static_cast<HashTable*>(p);
+                byte(T_HASH_TABLE);
+                uint(table->count);
+                for (auto &s : table->slots) {
+                    if (s.key.unbound()) continue;
+                    value(s.key);
+                    value(s.value);
+                }
+                return;
+            }
+            case V_BOX:
+                byte(T_BOX);
+                v = static_cast<Box*>(p)->v;
+                continue;
+            default:
+                throw RuntimeError(transfer ? "Value cannot be passed to another thread"
+                                            : "Value cannot be saved in an image");
+        }
+    }
+}
+
+void ImageWriter::env(Assoc e) {
+    while (true) {
+        AssocList *f = e.get();
+        if (f == nullptr) {
+            byte(A_EMPTY);
+            return;
+        }
+        auto it = objects.find(f);
+        if (it != objects.end()) {
+            byte(A_REF);
+            uint(it->second);
+            return;
+        }
+        objects.emplace(f, objects.size());
+        if (f->isGlobal) { // 链的末尾
+            globals(static_cast<GlobalEnv*>(f));
+            return;
+        }
+        byte(A_FRAME);
+        frame(f->names);
+        uint(f->values.size());
+        for (auto &v : f->values) value(v);
+        e = f->next;
+    }
+}
+
+void ImageWriter::syntax(const Syntax &stx) {
+    SyntaxBase *b = stx.get();
+    byte((unsigned char)b->s_type);
+    switch (b->s_type) {
+        case S_NUMBER:   sint(static_cast<Number*>(b)->n); break;
+        case S_BIGNUM:   str(static_cast<BignumSyntax*>(b)->n.toString()); break;
+        case S_RATIONAL: {
+            auto r = static_cast<RationalSyntax*>(b);
+            str(r->numerator.toString());
+            str(r->denominator.toString());
+            break;
+        }
+        case S_TRUE:
+        case S_FALSE:    break;
+        case S_SYMBOL:   name(static_cast<SymbolSyntax*>(b)->s); break;
+        case S_STRING:   str(static_cast<StringSyntax*>(b)->s); break;
+        case S_LIST: {
+            auto &stxs = static_cast<List*>(b)->stxs;
+            uint(stxs.size());
+            for (auto &s : stxs) syntax(s);
+            break;
+        }
+    }
+}
+
+void ImageWriter::expr(const Expr &expr) {
+    ExprBase *e = expr.get();
+    if (e == nullptr) {
+        byte(X_NULL);
+        return;
+    }
+    auto it = exprs.find(e);
+    if (it != exprs.end()) {
+        byte(X_REF);
+        uint(it->second);
+        return;
+    }
+    exprs.emplace(e, exprs.size());
+    byte(X_NODE);
+    uint(e->e_type);
+
+    ExprType t = e->e_type;
+    if (isUnary(t)) {
+        this->expr(static_cast<Unary*>(e)->rand);
+        return;
+    }
+    if (isBinary(t)) {
+        this->expr(static_cast<Binary*>(e)->rand1);
+        this->expr(static_cast<Binary*>(e)->rand2);
+        return;
+    }
+    if (isVariadic(t)) {
+        exprList(static_cast<Variadic*>(e)->rands);
+        return;
+    }
+    switch (t) {
+        case E_FIXNUM: sint(static_cast<Fixnum*>(e)->n); break;
+        case E_BIGNUM: str(static_cast<BignumExpr*>(e)->n.toString()); break;
+        case E_RATIONAL: {
+            auto r = static_cast<RationalNum*>(e);
+            str(r->numerator.toString());
+            str(r->denominator.toString());
+            break;
+        }
+        case E_STRING: str(static_cast<StringExpr*>(e)->s); break;
+        case E_TRUE: case E_FALSE: case E_VOID: case E_EXIT: break;
+        case E_AND: exprList(static_cast<AndVar*>(e)->rands); break;
+        case E_OR:  exprList(static_cast<OrVar*>(e)->rands); break;
+        case E_BEGIN: exprList(static_cast<Begin*>(e)->es); break;
+        case E_QUOTE: { // 已构造的常量一并保存, 保持其同一性
+            auto q = static_cast<Quote*>(e);
+            syntax(q->s);
+            bool cached = q->value && !forms;
+            byte(cached ? 1 : 0);
+            if (cached) value(*q->value);
+            break;
+        }
+        case E_IF: {
+            auto i = static_cast<If*>(e);
+            this->expr(i->cond);
+            this->expr(i->conseq);
+            this->expr(i->alter);
+            break;
+        }
+        case E_COND: {
+            auto &clauses = static_cast<Cond*>(e)->clauses;
+            uint(clauses.size());
+            for (auto &c : clauses) exprList(c);
+            break;
+        }
+        case E_VAR: {
+            auto v = static_cast<Var*>(e);
+            name(v->x);
+            sint(v->depth);
+            sint(v->slot);
+            byte(v->global);
+            global(v->x, v->global);
+            break;
+        }
+        case E_APPLY: {
+            auto a = static_cast<Apply*>(e);
+            this->expr(a->rator);
+            exprList(a->rand);
+            break;
+        }
+        case E_LAMBDA: {
+            auto l = static_cast<Lambda*>(e);
+            nameList(l->x);
+            this->expr(l->e);
+            frame(l->frame);
+            frame(l->captureFrame);
+            for (auto &c : l->captures) {
+                sint(c.depth);
+                sint(c.slot);
+                byte(c.boxed);
+            }
+            break;
+        }
+        case E_DEFINE: {
+            auto d = static_cast<Define*>(e);
+            name(d->var);
+            this->expr(d->e);
+            sint(d->depth);
+            sint(d->slot);
+            byte(d->global);
+            global(d->var, d->global);
+            break;
+        }
+        case E_SET: {
+            auto s = static_cast<Set*>(e);
+            name(s->var);
+            this->expr(s->e);
+            sint(s->depth);
+            sint(s->slot);
+            byte(s->global);
+            global(s->var, s->global);
+            break;
+        }
+        case E_DEFINE_SYNTAX: name(static_cast<DefineSyntax*>(e)->var); break;
+        case E_LET:
+        case E_LETREC: {
+            auto &bind = t == E_LET ? static_cast<Let*>(e)->bind : static_cast<Letrec*>(e)->bind;
+            uint(bind.size());
+            for (auto &kv : bind) {
+                name(kv.first);
+                this->expr(kv.second);
+            }
+            this->expr(t == E_LET ? static_cast<Let*>(e)->body : static_cast<Letrec*>(e)->body);
+            frame(t == E_LET ? static_cast<Let*>(e)->frame : static_cast<Letrec*>(e)->frame);
+            break;
+        }
+        default:
+            throw RuntimeError("Expression cannot be saved in an image");
+    }
+}
+
+// ============================================================================
+// Reader
+// ============================================================================
+
+class ImageReader {
+public:
+    explicit ImageReader(const std::string &data) : p(data.data()), end(data.data() + data.size()) {
+        if (size_t(end - p) < sizeof IMAGE_MAGIC || std::memcmp(p, IMAGE_MAGIC, sizeof IMAGE_MAGIC) != 0) corrupt();
+        p += sizeof IMAGE_MAGIC;
+    }
+    /// Reads parsed forms, whose global variables are cells of target
+    ImageReader(const std::string &data, GlobalEnv *target) : ImageReader(data) {
+        globals = target;
+        globalsRef = Assoc(target);
+        globalsRead = true; // 数据中不能再有A_GLOBAL
+    }
+
+    Value value();
+    Assoc env();
+    Expr expr(size_t *index = nullptr);
+    std::vector<ParsedForm> parsedForms();
+
+    // Reads the cells that follow the value of a transfer
+    void referencedGlobals() {
+        while (byte() != 0) {
+            Value *c = globalEnv()->cell(name());
+            assignGlobal(c, value());
+        }
+    }
+
+    // Sets the bodies of closures that referred to a node still being decoded,
+    // then checks the lexical addresses of the code
+    void finish() {
+        for (auto &fix : fixups) fix.first->e = exprs[fix.second];
+        if (p != end || (globals != nullptr && !globalsRead)) corrupt(); // 单元必须属于某个闭包的环境
+        std::vector<size_t> scope;
+        for (const Expr &form : forms) checkAddresses(form.get(), scope);
+        for (Procedure *proc : procs) {
+            scope.clear();
+            for (AssocList *f = proc->env.get(); f != nullptr && !f->isGlobal; f = f->next.get())
+                scope.insert(scope.begin(), f->values.size());
+            scope.push_back(proc->frame->size());
+            checkBody(proc->e.get(), scope);
+        }
+    }
+
+private:
+    const char *p, *end;
+    std::vector<GcObject*> objects;   // 由所属的Value/Assoc持有
+    std::vector<Name> names;
+    std::vector<FrameNames> frames;
+    std::vector<Expr> exprs;
+    std::vector<std::pair<Procedure*, size_t>> fixups;
+    std::vector<Procedure*> procs;   // 解码完后检查函数体
+    std::vector<Expr> forms;
+    std::set<std::pair<const ExprBase*, std::vector<size_t>>> checkedBodies;
+    GlobalEnv *globals = nullptr;   // 整个映像只有一个
+    Assoc globalsRef = empty();     // 在A_GLOBAL之前已被引用时由它持有
+    bool globalsRead = false;
+
+    [[noreturn]] static void corrupt() { throw RuntimeError("Corrupted image"); }
+
+    unsigned char byte() {
+        if (p == end) corrupt();
+        return (unsigned char)*p++;
+    }
+    uint64_t uint() {
+        uint64_t n = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            unsigned char b = byte();
+            n |= uint64_t(b & 0x7f) << shift;
+            if (!(b & 0x80)) return n;
+        }
+        corrupt();
+    }
+    int64_t sint() {
+        uint64_t n = uint();
+        return n & 1 ? int64_t(~(n >> 1)) : int64_t(n >> 1);
+    }
+    size_t count() { // 每个元素至少占一个字节
+        uint64_t n = uint();
+        if (n > uint64_t(end - p)) corrupt();
+        return size_t(n);
+    }
+    std::string str() {
+        size_t n = count();
+        std::string s(p, n);
+        p += n;
+        return s;
+    }
+    BigInt bigint() {
+        BigInt n;
+        if (!BigInt::parse(str(), n)) corrupt();
+        return n;
+    }
+    size_t index(size_t known) {
+        uint64_t n = uint();
+        if (n > known) corrupt();
+        return size_t(n);
+    }
+
+    Name name() {
+        size_t n = index(names.size());
+        if (n == names.size()) names.push_back(intern(str()));
+        return names[n];
+    }
+    FrameNames frame() {
+        size_t n = index(frames.size());
+        if (n < frames.size()) return frames[n];
+        frames.push_back(std::make_shared<const std::vector<Name>>(nameList()));
+        return frames.back();
+    }
+    std::vector<Name> nameList() {
+        std::vector<Name> xs(count());
+        for (auto &x : xs) x = name();
+        return xs;
+    }
+    // A subexpression: never missing, and never a node still being decoded
+    Expr child() {
+        Expr e = expr();
+        if (e.get() == nullptr) corrupt();
+        return e;
+    }
+    std::vector<Expr> exprList() {
+        std::vector<Expr> es(count());
+        for (auto &e : es) e = child();
+        return es;
+    }
+    // 传输中函数体在其环境之前写出, 全局环境在第一次用到时创建
+    GlobalEnv *globalEnv() {
+        if (globals == nullptr) {
+            globals = new GlobalEnv();
+            globalsRef = Assoc(globals);
+        }
+        return globals;
+    }
+    Value *cell(Name x, bool global) {
+        if (!global) return nullptr;
+        return globalEnv()->cell(x);
+    }
+    GcObject *object() {
+        size_t n = uint();
+        if (n >= objects.size()) corrupt();
+        return objects[n];
+    }
+    Syntax syntax();
+    std::shared_ptr<const Macro> macro();
+    Value atom(unsigned char tag);
+    ExprBase *node(ExprType t);
+
+    // scope holds the sizes of the frames the code runs in, innermost last
+    static void checkAddress(int depth, int slot, const std::vector<size_t> &scope) {
+        if (depth < 0 || size_t(depth) >= scope.size() || slot < 0 || size_t(slot) >= scope[scope.size() - 1 - depth])
+            corrupt();
+    }
+    void checkBody(const ExprBase *body, const std::vector<size_t> &scope);
+    void checkAddresses(const ExprBase *e, std::vector<size_t> &scope);
+};
+
+// A closure body, checked once for each scope it runs in
+void ImageReader::checkBody(const ExprBase *body, const std::vector<size_t> &scope) {
+    if (!checkedBodies.insert({body, scope}).second) return;
+    std::vector<size_t> inner = scope;
+    checkAddresses(body, inner);
+}
+
+void ImageReader::checkAddresses(const ExprBase *e, std::vector<size_t> &scope) {
+    if (e == nullptr) return;
+    ExprType t = e->e_type;
+    if (isUnary(t)) return checkAddresses(static_cast<const Unary*>(e)->rand.get(), scope);
+    if (isBinary(t)) {
+        checkAddresses(static_cast<const Binary*>(e)->rand1.get(), scope);
+        return checkAddresses(static_cast<const Binary*>(e)->rand2.get(), scope);
+    }
+    auto all = [&](const std::vector<Expr> &es) {
+        for (auto &x : es) checkAddresses(x.get(), scope);
+    };
+    if (isVariadic(t)) return all(static_cast<const Variadic*>(e)->rands);
+
+    switch (t) {
+        case E_AND:   return all(static_cast<const AndVar*>(e)->rands);
+        case E_OR:    return all(static_cast<const OrVar*>(e)->rands);
+        case E_BEGIN: return all(static_cast<const Begin*>(e)->es);
+        case E_IF: {
+            auto i = static_cast<const If*>(e);
+            checkAddresses(i->cond.get(), scope);
+            checkAddresses(i->conseq.get(), scope);
+            return checkAddresses(i->alter.get(), scope);
+        }
+        case E_COND:
+            for (auto &c : static_cast<const Cond*>(e)->clauses) all(c);
+            return;
+        case E_APPLY: {
+            auto a = static_cast<const Apply*>(e);
+            checkAddresses(a->rator.get(), scope);
+            return all(a->rand);
+        }
+        case E_VAR: {
+            auto v = static_cast<const Var*>(e);
+            if (!v->global) checkAddress(v->depth, v->slot, scope);
+            return;
+        }
+        case E_DEFINE: {
+            auto d = static_cast<const Define*>(e);
+            checkAddresses(d->e.get(), scope);
+            if (!d->global) checkAddress(d->depth, d->slot, scope);
+            return;
+        }
+        case E_SET: {
+            auto st = static_cast<const Set*>(e);
+            checkAddresses(st->e.get(), scope);
+            if (!st->global) checkAddress(st->depth, st->slot, scope);
+            return;
+        }
+        case E_LAMBDA: { // 捕获在外层作用域中解析, 函数体只看得到自己的帧和捕获帧
+            auto l = static_cast<const Lambda*>(e);
+            for (auto &c : l->captures) checkAddress(c.depth, c.slot, scope);
+            std::vector<size_t> body;
+            if (!l->captures.empty()) body.push_back(l->captureFrame->size());
+            body.push_back(l->frame->size());
+            return checkBody(l->e.get(), body);
+        }
+        case E_LET: {
+            auto l = static_cast<const Let*>(e);
+            for (auto &kv : l->bind) checkAddresses(kv.second.get(), scope);
+            scope.push_back(l->frame->size());
+            checkAddresses(l->body.get(), scope);
+            scope.pop_back();
+            return;
+        }
+        case E_LETREC: {
+            auto l = static_cast<const Letrec*>(e);
+            scope.push_back(l->frame->size());
+            for (auto &kv : l->bind) checkAddresses(kv.second.get(), scope);
+            checkAddresses(l->body.get(), scope);
+            scope.pop_back();
+            return;
+        }
+        default: // 字面量, quote, define-syntax
+            return;
+    }
+}
+
+Value ImageReader::value() {
+    Value head;
+    Pair *last = nullptr;
+    while (true) {
+        unsigned char tag = byte();
+        if (tag != T_PAIR) {
+            Value v = atom(tag);
+            if (last == nullptr) return v;
+            last->cdr = v;
+            return head;
+        }
+        // 先链入列表再读car, 使car中对它的引用可以解析
+        Pair *pair = new Pair(NullV(), NullV());
+        if (last == nullptr) head = Value(pair);
+        else last->cdr = Value(pair);
+        objects.push_back(pair);
+        last = pair;
+        pair->car = value();
+    }
+}
+
+Value ImageReader::atom(unsigned char tag) {
+    switch (tag) {
+        case T_NONE:     return Value(nullptr);
+        case T_FIXNUM: {
+            int64_t n = sint();
+            if (n < INT32_MIN || n > INT32_MAX) corrupt();
+            return IntegerV(int(n));
+        }
+        case T_CONST: {
+            uint64_t k = uint();
+            if (k > K_TERMINATE) corrupt();
+            return Value::constantV(int(k));
+        }
+        case T_REF: {
+            GcObject *o = object();
+            ValueBase *v = dynamic_cast<ValueBase*>(o);
+            if (v == nullptr) corrupt();
+            return Value(v);
+        }
+        case T_BIGNUM: {
+            Value v = IntegerV(bigint());
+            if (!v.isHeap()) corrupt();
+            objects.push_back(v.get());
+            return v;
+        }
+        case T_RATIONAL: {
+            BigInt num = bigint(), den = bigint();
+            Value v = RationalV(num, den);
+            if (!v.isHeap()) corrupt();
+            objects.push_back(v.get());
+            return v;
+        }
+        case T_SYMBOL: {
+            Name x = name();
+            objects.push_back(x);
+            return SymbolV(x);
+        }
+        case T_STRING: {
+            Value v = StringV(str());
+            objects.push_back(v.get());
+            return v;
+        }
+        case T_PROC: {
+            Procedure *proc = new Procedure(nullptr, 0, Expr(), empty());
+            Value v(proc);
+            objects.push_back(proc);
+            procs.push_back(proc);
+            proc->frame = frame();
+            proc->arity = uint();
+            if (proc->arity > proc->frame->size()) corrupt();
+            size_t body;
+            proc->e = expr(&body);
+            if (proc->e.get() == nullptr) {
+                if (body == NO_EXPR) corrupt();
+                fixups.push_back({proc, body});
+            }
+            proc->env = env();
+            return v;
+        }
+        case T_PRIM: {
+            const Value *prim = builtin(name());
+            if (prim == nullptr) corrupt();
+            objects.push_back(prim->get());
+            return *prim;
+        }
+        case T_VECTOR: { // 先登记再读元素, 使元素中对它的引用可以解析
+            size_t n = count();
+            Vector *vec = new Vector(std::vector<Value>());
+            Value v(vec);
+            objects.push_back(vec);
+            vec->elems.reserve(n);
+            for (size_t i = 0; i < n; ++i) vec->elems.push_back(value());
+            return v;
+        }
+        case T_HASH_TABLE: { // 按标识散列的键地址已变, 逐个重新插入
+            size_t n = count();
+            HashTable *table = new HashTable();
+            Value v(table);
+            objects.push_back(table);
+            for (size_t i = 0; i < n; ++i) {
+                Value key = value();
+                if (key.unbound() || table->find(key) != nullptr) corrupt();
+                table->set(key, value());
+            }
+            return v;
+        }
+        case T_BOX: {
+            Box *box = new Box(Value(nullptr));
+            Value v(box);
+            objects.push_back(box);
+            box->v = value();
+            return v;
+        }
+    }
+    corrupt();
+}
+
+Assoc ImageReader::env() {
+    Assoc head = empty();
+    AssocList *last = nullptr;
+    while (true) {
+        unsigned char tag = byte();
+        if (tag != A_FRAME) {
+            Assoc e = empty();
+            if (tag == A_GLOBAL) {
+                if (globalsRead) corrupt();
+                globalsRead = true;
+                e = Assoc(globalEnv());
+                objects.push_back(globals);
+                for (size_t n = count(); n > 0; --n) {
+                    Value *c = globals->cell(name());
+                    assignGlobal(c, value());
+                }
+                for (size_t n = count(); n > 0; --n) {
+                    Name x = name();
+                    globals->macros[x] = macro();
+                }
+            } else if (tag == A_REF) {
+                e = Assoc(dynamic_cast<AssocList*>(object()));
+                if (e.get() == nullptr) corrupt();
+            } else if (tag != A_EMPTY) {
+                corrupt();
+            }
+            if (last == nullptr) return e;
+            last->next = e;
+            return head;
+        }
+        AssocList *f = new AssocList(frame(), std::vector<Value>(), empty());
+        if (last == nullptr) head = Assoc(f);
+        else last->next = Assoc(f);
+        objects.push_back(f);
+        last = f;
+        size_t n = count();
+        if (n != f->names->size()) corrupt();
+        f->values.resize(n);
+        for (auto &v : f->values) v = value();
+    }
+}
+
+std::shared_ptr<const Macro> ImageReader::macro() {
+    Name ellipsis = name();
+    std::vector<Name> literals = nameList();
+    std::vector<std::pair<Syntax, Syntax>> rules(count(), {Syntax(nullptr), Syntax(nullptr)});
+    for (auto &r : rules) {
+        r.first = syntax();
+        r.second = syntax();
+        if (r.first->s_type != S_LIST) corrupt();
+    }
+    return std::make_shared<const Macro>(ellipsis, literals, rules);
+}
+
+std::vector<ParsedForm> ImageReader::parsedForms() {
+    std::vector<ParsedForm> fs(count());
+    for (auto &f : fs) {
+        f.expr = expr();
+        forms.push_back(f.expr);
+        f.macros.resize(count());
+        for (auto &kv : f.macros) {
+            kv.first = name();
+            if (byte()) kv.second = macro();
+        }
+    }
+    return fs;
+}
+
+Syntax ImageReader::syntax() {
+    switch (byte()) {
+        case S_NUMBER: {
+            int64_t n = sint();
+            if (n < INT32_MIN || n > INT32_MAX) corrupt();
+            return Syntax(new Number(int(n)));
+        }
+        case S_BIGNUM:   return Syntax(new BignumSyntax(bigint()));
+        case S_RATIONAL: {
+            BigInt num = bigint(), den = bigint();
+            return Syntax(new RationalSyntax(num, den));
+        }
+        case S_TRUE:     return Syntax(new TrueSyntax());
+        case S_FALSE:    return Syntax(new FalseSyntax());
+        case S_SYMBOL:   return Syntax(new SymbolSyntax(name()));
+        case S_STRING:   return Syntax(new StringSyntax(str()));
+        case S_LIST: {
+            List *list = new List();
+            Syntax stx(list);
+            list->stxs.resize(count(), Syntax(nullptr));
+            for (auto &s : list->stxs) s = syntax();
+            return stx;
+        }
+    }
+    corrupt();
+}
+
+Expr ImageReader::expr(size_t *index) {
+    switch (byte()) {
+        case X_NULL:
+            if (index != nullptr) *index = NO_EXPR;
+            return Expr();
+        case X_REF: {
+            uint64_t n = uint();
+            if (n >= exprs.size()) corrupt();
+            if (index != nullptr) *index = size_t(n);
+            return exprs[n];   // 仍在解码中时为空, 由调用者登记修补
+        }
+        case X_NODE: {
+            size_t n = exprs.size();
+            exprs.push_back(Expr());
+            uint64_t t = uint();
+            if (t > E_GT_VAR) corrupt();
+            exprs[n] = Expr(node(ExprType(t)));
+            if (index != nullptr) *index = n;
+            return exprs[n];
+        }
+    }
+    corrupt();
+}
+
+ExprBase *ImageReader::node(ExprType t) {
+    if (isUnary(t)) return unaryNode(t, child());
+    if (isBinary(t)) {
+        Expr a = child();
+        return binaryNode(t, a, child());
+    }
+    if (isVariadic(t)) return variadicNode(t, exprList());
+
+    switch (t) {
+        case E_FIXNUM: {
+            int64_t n = sint();
+            if (n < INT32_MIN || n > INT32_MAX) corrupt();
+            return new Fixnum(int(n));
+        }
+        case E_BIGNUM: return new BignumExpr(bigint());
+        case E_RATIONAL: {
+            BigInt num = bigint(), den = bigint();
+            return new RationalNum(num, den);
+        }
+        case E_STRING: return new StringExpr(str());
+        case E_TRUE:   return new True();
+        case E_FALSE:  return new False();
+        case E_VOID:   return new MakeVoid();
+        case E_EXIT:   return new Exit();
+        case E_AND:    return new AndVar(exprList());
+        case E_OR:     return new OrVar(exprList());
+        case E_BEGIN:  return new Begin(exprList());
+        case E_QUOTE: {
+            std::unique_ptr<Quote> q(new Quote(syntax()));
+            if (byte()) q->value = std::make_shared<Value>(value());
+            return q.release();
+        }
+        case E_IF: {
+            Expr c = child(), conseq = child();
+            return new If(c, conseq, child());
+        }
+        case E_COND: {
+            std::vector<std::vector<Expr>> clauses(count());
+            for (auto &c : clauses) c = exprList();
+            return new Cond(clauses);
+        }
+        case E_VAR: {
+            Name x = name();
+            int depth = int(sint()), slot = int(sint());
+            bool global = byte() != 0;
+            return new Var(x, depth, slot, global, cell(x, global));
+        }
+        case E_APPLY: {
+            Expr rator = child();
+            return new Apply(rator, exprList());
+        }
+        case E_LAMBDA: {
+            std::vector<Name> xs = nameList();
+            Expr body = child();
+            FrameNames f = frame(), captured = frame();
+            if (f->size() < xs.size()) corrupt();
+            std::vector<Capture> cs;
+            for (Name x : *captured) {
+                int depth = int(sint()), slot = int(sint());
+                cs.push_back(Capture{x, depth, slot, byte() != 0});
+            }
+            Lambda *l = new Lambda(xs, body, std::vector<Name>(f->begin() + xs.size(), f->end()), cs);
+            l->frame = f; // 与由它创建的闭包共享
+            l->captureFrame = captured;
+            return l;
+        }
+        case E_DEFINE:
+        case E_SET: {
+            Name x = name();
+            Expr rhs = child();
+            int depth = int(sint()), slot = int(sint());
+            bool global = byte() != 0;
+            if (t == E_DEFINE) return new Define(x, rhs, depth, slot, global, cell(x, global));
+            return new Set(x, rhs, depth, slot, global, cell(x, global));
+        }
+        case E_DEFINE_SYNTAX: return new DefineSyntax(name());
+        case E_LET:
+        case E_LETREC: {
+            std::vector<std::pair<Name, Expr>> bind(count());
+            for (auto &kv : bind) {
+                kv.first = name();
+                kv.second = child();
+            }
+            Expr body = child();
+            FrameNames f = frame();
+            if (f->size() < bind.size()) corrupt();
+            std::vector<Name> locals(f->begin() + bind.size(), f->end());
+            if (t == E_LET) {
+                Let *l = new Let(bind, body, locals);
+                l->frame = f;
+                return l;
+            }
+            Letrec *l = new Letrec(bind, body, locals);
+            l->frame = f;
+            return l;
+        }
+        default:
+            corrupt();
+    }
+}
+
+} // namespace
+
+bool saveImage(const std::string &path, const Assoc &env) {
+    ImageWriter w;
+    w.env(env);
+    std::ofstream out(path, std::ios::binary);
+    out.write(w.out.data(), std::streamsize(w.out.size()));
+    return bool(out.flush());
+}
+
+bool Image::load(const std::string &path) {
+    std::ifstream in(path, std::ios::binary | std::ios::ate);
+    if (!in) return false;
+    std::streamoff size = in.tellg();
+    if (size < 0) return false;
+    data.resize(size_t(size));
+    in.seekg(0);
+    return bool(in.read(&data[0], size)); // 一次读入整个文件
+}
+
+std::string encodeTransfer(const Value &v) {
+    ImageWriter w(W_TRANSFER);
+    w.value(v);
+    w.referencedGlobals();
+    return std::move(w.out);
+}
+
+Value decodeTransfer(const std::string &data) {
+    ImageReader r(data);
+    Value v = r.value();
+    r.referencedGlobals();
+    r.finish();
+    return v;
+}
+
+Assoc Image::restore() const {
+    ImageReader r(data);
+    Assoc env = r.env();
+    r.finish();
+    if (env.get() == nullptr || !env->isGlobal) throw RuntimeError("Corrupted image");
+    return env;
+}
+
+std::string encodeForms(const std::vector<ParsedForm> &forms) {
+    ImageWriter w(W_FORMS);
+    w.parsedForms(forms);
+    return std::move(w.out);
+}
+
+std::vector<ParsedForm> decodeForms(const std::string &data, GlobalEnv *globals) {
+    ImageReader r(data, globals);
+    std::vector<ParsedForm> forms = r.parsedForms();
+    r.finish();
+    return forms;
+}
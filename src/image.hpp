@@ -0,0 +1,83 @@
+#ifndef IMAGE_HPP
+#define IMAGE_HPP
+
+/**
+ * @file image.hpp
+ * @brief Snapshots of the global environment
+ *
+ * An image holds a global environment together with everything reachable
+ * from it: the values bound there, the macros defined there, the closures
+ * with their parsed bodies and captured frames, and the quoted data cached
+ * in those bodies. Loading one
+ * gives a process the state of a finished prelude run without reading,
+ * parsing or evaluating the prelude again.
+ *
+ * The format is a compact pre-order encoding with back references, so shared
+ * structure stays shared (a closure and the lambda it came from keep one
+ * body) and cycles through frames and closures are restored as cycles. The
+ * whole file is read with one call and decoded in a single linear pass.
+ * Objects cannot be used in place, since they carry reference counts, vtables
+ * and pointers into this process; bytecode and materialised literals are not
+ * stored and are rebuilt on first use.
+ *
+ * Primitives are stored by name, symbols by spelling (and re-interned on
+ * load), so an image only depends on the interpreter version, not on the
+ * addresses of the process that wrote it.
+ */
+
+#include "Def.hpp"
+#include "value.hpp"
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+/// Writes env and everything reachable from it to path; false if the file cannot be written
+bool saveImage(const std::string &path, const Assoc &env);
+
+/**
+ * Encodes v for decodeTransfer on another thread, in the image format. The
+ * global environment of the closures in v is cut down to the variables their
+ * code refers to, directly or through the values of other such variables,
+ * and their macros are left out. Throws RuntimeError if v holds a future, or
+ * closures of more than one global environment.
+ */
+std::string encodeTransfer(const Value &v);
+/// Rebuilds an encodeTransfer()ed value in this thread's heap; throws RuntimeError if data is corrupt
+Value decodeTransfer(const std::string &data);
+
+/**
+ * @brief A top-level form of a source file as parsed, for the parse cache
+ *
+ * Parsing a form can change the macros of the global environment: a
+ * define-syntax adds one and a top-level define removes the macro of its
+ * name. The form carries these changes so that replaying it in place of
+ * parsing leaves the same macros behind (see parsecache.hpp).
+ */
+struct ParsedForm {
+    Expr expr;   ///< Null if the form failed to parse
+    std::vector<std::pair<Name, std::shared_ptr<const Macro>>> macros;   ///< A null macro is a removal
+};
+
+/// Encodes forms, which may have run since they were parsed: quoted data they built is left out
+std::string encodeForms(const std::vector<ParsedForm> &forms);
+/// Decodes encodeForms() data with its global variables in globals; throws RuntimeError if data is corrupt
+std::vector<ParsedForm> decodeForms(const std::string &data, GlobalEnv *globals);
+
+/**
+ * @brief Contents of an image file, decoded on demand
+ *
+ * Every restore() builds a fresh copy of the environment, so several scripts
+ * can start from the same image without seeing each other's changes.
+ */
+class Image {
+public:
+    bool load(const std::string &path);   ///< Reads the file; false if it cannot be read
+    Assoc restore() const;                ///< Throws RuntimeError if the image is corrupt
+    const std::string &bytes() const { return data; }
+
+private:
+    std::string data;
+};
+
+#endif // IMAGE_HPP
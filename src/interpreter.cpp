@@ -0,0 +1,71 @@
+/**
+ * @file interpreter.cpp
+ * @brief Interpreter: a global environment and an output around runToplevel
+ */
+
+#include "interpreter.hpp"
+#include "toplevel.hpp"
+#include "syntax.hpp"
+#include "RE.hpp"
+#include "gc.hpp"
+#include "parsecache.hpp"
+#include <fstream>
+#include <iterator>
+
+Interpreter::Interpreter(std::ostream &sink, bool vm)
+    : Interpreter(sink, globalEnv(), vm) {}
+
+Interpreter::Interpreter(std::ostream &sink, const Assoc &env, bool vm)
+    : out(sink), env(env), vm(vm), owner(std::this_thread::get_id()) {}
+
+Interpreter::~Interpreter() {
+    env = empty();
+    gcCollect(); // 全局环境和其中的闭包互相引用, 引用计数释放不了
+}
+
+void Interpreter::checkThread() const {
+    if (std::this_thread::get_id() != owner) throw RuntimeError("Interpreter used on another thread");
+}
+
+void Interpreter::eval(const char *source, size_t size) {
+    checkThread();
+    Reader reader(source, size);
+    GlobalEnv *globals = cacheState.empty() ? nullptr : globalsOf(env);
+    if (globals == nullptr) {
+        if (runToplevel(reader, out, env, false, vm)) exitCalled = true;
+        out.flush();
+        return;
+    }
+    std::string key = parsecache::next(cacheState, source, size);
+    cacheState.clear(); // 异常退出时状态未知
+    FormLog log;
+    log.replay = parsecache::load(cacheDir, key, globals, log.forms);
+    if (runToplevel(reader, out, env, false, vm, &log)) exitCalled = true;
+    if (!log.replay) parsecache::store(cacheDir, key, log.forms);
+    cacheState = key;
+    out.flush();
+}
+
+void Interpreter::useParseCache(const std::string &dir, const std::string &state) {
+    cacheDir = dir;
+    cacheState = state;
+}
+
+bool Interpreter::load(const std::string &path) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) return false;
+    std::string text((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    eval(text); // 整个文件一次读入
+    return true;
+}
+
+void Interpreter::repl(std::istream &in, bool prompt) {
+    checkThread();
+    cacheState.clear(); // 交互输入的形式不缓存
+    Reader reader(in);
+    std::ostream tied(&out);
+    std::ostream *previous = in.tie(&tied); // 等待输入前先输出缓冲的内容
+    if (runToplevel(reader, out, env, prompt, vm)) exitCalled = true;
+    in.tie(previous);
+    out.flush();
+}
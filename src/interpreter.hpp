@@ -0,0 +1,79 @@
+#ifndef INTERPRETER_HPP
+#define INTERPRETER_HPP
+
+/**
+ * @file interpreter.hpp
+ * @brief Embedding API: an interpreter with its own global environment and output
+ *
+ * An Interpreter evaluates top-level forms the way the command-line
+ * interpreter runs a script: every result is printed to its output, as is
+ * whatever display writes, and a form that fails prints RuntimeError and the
+ * next one runs. Its definitions live in its own global environment, so
+ * interpreters never see each other's bindings or macros.
+ *
+ * The runtime keeps no state across threads. The heap (the collector and the
+ * pools), the symbol table and the current output all belong to the calling
+ * thread, so interpreters on different threads run in parallel without any
+ * locking. The price is that an Interpreter, and every value it produced,
+ * must stay on the thread that created it; eval and load throw RuntimeError
+ * when called from another one. Interpreters created on the same thread share
+ * its heap, which is collected as a whole.
+ *
+ * A thread's symbols and pool chunks are kept until the process exits, so
+ * embedders should run interpreters on long-lived worker threads rather than
+ * on a new thread per request.
+ */
+
+#include "value.hpp"
+#include "output.hpp"
+#include <cstddef>
+#include <istream>
+#include <ostream>
+#include <string>
+#include <thread>
+
+class Interpreter {
+public:
+    /// Starts from an environment without definitions; vm selects the bytecode machine
+    explicit Interpreter(std::ostream &out, bool vm = false);
+    /// Starts from env, for example an Image::restore(), which it may share with others
+    Interpreter(std::ostream &out, const Assoc &env, bool vm = false);
+    ~Interpreter();   ///< Collects the garbage its environment left behind
+
+    Interpreter(const Interpreter &) = delete;
+    Interpreter &operator=(const Interpreter &) = delete;
+
+    /// Evaluates every form of source; the output is flushed when it returns
+    void eval(const char *source, size_t size);
+    void eval(const std::string &source) { eval(source.data(), source.size()); }
+    /// Evaluates the file at path like eval; false if it cannot be read
+    bool load(const std::string &path);
+    /// Reads forms from in as they are typed, printing "scm> " before each if prompt
+    void repl(std::istream &in, bool prompt);
+
+    /**
+     * Makes eval and load keep the parsed forms of their sources in dir and
+     * reuse them (see parsecache.hpp). state names the current state of the
+     * environment: "fresh" for one without definitions. The REPL and errors
+     * other than RuntimeError make it unknown, which stops the caching.
+     */
+    void useParseCache(const std::string &dir, const std::string &state);
+    /// The state of the environment for the parse cache, empty if it is unknown or not cached
+    const std::string &parseCacheState() const { return cacheState; }
+
+    bool exited() const { return exitCalled; }   ///< Whether a form called (exit)
+    Assoc &environment() { return env; }
+
+private:
+    Output out;
+    Assoc env;
+    bool vm;
+    bool exitCalled = false;
+    std::thread::id owner;
+    std::string cacheDir;
+    std::string cacheState;   // 为空时不使用缓存
+
+    void checkThread() const;
+};
+
+#endif // INTERPRETER_HPP
@@ -0,0 +1,340 @@
+/**
+ * @file macro.cpp
+ * @brief Pattern matching and template instantiation for syntax-rules
+ *
+ * Matching a pattern records what each pattern variable matched. A variable
+ * under an ellipsis gets one Match per repetition, nested once for each
+ * ellipsis it is under; the template walks those sequences the same way
+ * when it meets the ellipsis after a subtemplate.
+ */
+
+#include "macro.hpp"
+#include "value.hpp"
+#include "RE.hpp"
+#include <string>
+#include <unordered_map>
+
+using std::vector;
+
+namespace {
+
+// What a pattern variable matched: a form, or one Match per repetition
+struct Match {
+    Syntax stx;
+    vector<Match> seq;
+    bool repeated;
+    Match() : stx(nullptr), repeated(false) {}
+};
+
+typedef std::unordered_map<Name, Match> Bindings;
+
+Name dotName() {
+    static thread_local const Name x = intern(".");
+    return x;
+}
+
+Name wildcardName() {
+    static thread_local const Name x = intern("_");
+    return x;
+}
+
+bool isSymbol(const Syntax &stx, Name x) {
+    auto s = asSymbol(stx);
+    return s != nullptr && s->s == x;
+}
+
+bool contains(const vector<Name> &xs, Name x) {
+    for (Name y : xs) if (y == x) return true;
+    return false;
+}
+
+void addName(vector<Name> &xs, Name x) {
+    if (!contains(xs, x)) xs.push_back(x);
+}
+
+// Variables of pattern p
+void patternVars(const Syntax &p, Name ellipsis, const vector<Name> &literals, vector<Name> &out) {
+    if (auto s = asSymbol(p)) {
+        Name x = s->s;
+        if (x != ellipsis && x != wildcardName() && x != dotName() && !contains(literals, x)) addName(out, x);
+    } else if (auto l = asList(p)) {
+        for (auto &e : l->stxs) patternVars(e, ellipsis, literals, out);
+    }
+}
+
+// Identifiers the template t binds with lambda, define, let or letrec, apart
+// from pattern variables (those come from the macro use). Quoted data is
+// left alone.
+void templateBinders(const Syntax &t, Name ellipsis, const vector<Name> &vars, vector<Name> &out) {
+    static thread_local const Name QUOTE = intern("quote"), LAMBDA = intern("lambda"), DEFINE = intern("define"),
+                      LET = intern("let"), LETREC = intern("letrec");
+    auto l = asList(t);
+    if (l == nullptr || l->stxs.empty()) return;
+    auto &ts = l->stxs;
+    auto bind = [&](const Syntax &x) {
+        auto s = asSymbol(x);
+        if (s && s->s != ellipsis && s->s != dotName() && !contains(vars, s->s)) addName(out, s->s);
+    };
+    if (auto head = asSymbol(ts[0])) {
+        if (head->s == QUOTE) return;
+        if (ts.size() >= 2) {
+            if (head->s == LAMBDA) {
+                if (auto ps = asList(ts[1])) for (auto &p : ps->stxs) bind(p);
+            } else if (head->s == DEFINE) { // 函数名不改名, 只改参数
+                if (auto sig = asList(ts[1]))
+                    for (size_t i = 1; i < sig->stxs.size(); ++i) bind(sig->stxs[i]);
+            } else if (head->s == LET || head->s == LETREC) {
+                if (auto bs = asList(ts[1]))
+                    for (auto &b : bs->stxs)
+                        if (auto kv = asList(b)) if (!kv->stxs.empty()) bind(kv->stxs[0]);
+            }
+        }
+    }
+    for (auto &s : ts) templateBinders(s, ellipsis, vars, out);
+}
+
+bool sameDatum(const Syntax &a, const Syntax &b) {
+    if (a->s_type != b->s_type) return false;
+    switch (a->s_type) {
+        case S_NUMBER:   return static_cast<Number*>(a.get())->n == static_cast<Number*>(b.get())->n;
+        case S_BIGNUM:   return static_cast<BignumSyntax*>(a.get())->n == static_cast<BignumSyntax*>(b.get())->n;
+        case S_RATIONAL: {
+            auto x = static_cast<RationalSyntax*>(a.get()), y = static_cast<RationalSyntax*>(b.get());
+            return x->numerator == y->numerator && x->denominator == y->denominator;
+        }
+        case S_TRUE:
+        case S_FALSE:    return true;
+        case S_SYMBOL:   return static_cast<SymbolSyntax*>(a.get())->s == static_cast<SymbolSyntax*>(b.get())->s;
+        case S_STRING:   return static_cast<StringSyntax*>(a.get())->s == static_cast<StringSyntax*>(b.get())->s;
+        case S_LIST: {
+            auto &xs = static_cast<List*>(a.get())->stxs, &ys = static_cast<List*>(b.get())->stxs;
+            if (xs.size() != ys.size()) return false;
+            for (size_t i = 0; i < xs.size(); ++i) if (!sameDatum(xs[i], ys[i])) return false;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool match(const Macro &m, const Syntax &p, const Syntax &in, Bindings &b);
+
+Syntax listOf(vector<Syntax>::const_iterator first, vector<Syntax>::const_iterator last) {
+    List *l = new List();
+    Syntax stx(l);
+    l->stxs.assign(first, last);
+    return stx;
+}
+
+// Matches the patterns ps[first..] against the forms in[from..]. At most one
+// pattern may be followed by the ellipsis, and ". p" at the end matches the
+// forms left over.
+bool matchList(const Macro &m, const vector<Syntax> &ps, size_t first,
+               const vector<Syntax> &in, size_t from, Bindings &b) {
+    size_t end = ps.size();
+    const Syntax *tail = nullptr;
+    if (end - first >= 2 && isSymbol(ps[end - 2], dotName())) {
+        tail = &ps[end - 1];
+        end -= 2;
+    }
+    size_t n = in.size() - from;
+    size_t ell = end;
+    for (size_t i = first; i + 1 < end; ++i) {
+        if (isSymbol(ps[i + 1], m.ellipsis)) {
+            ell = i;
+            break;
+        }
+    }
+
+    if (ell == end) {
+        size_t fixed = end - first;
+        if (tail != nullptr ? n < fixed : n != fixed) return false;
+        for (size_t i = 0; i < fixed; ++i)
+            if (!match(m, ps[first + i], in[from + i], b)) return false;
+        return tail == nullptr || match(m, *tail, listOf(in.begin() + from + fixed, in.end()), b);
+    }
+
+    size_t before = ell - first, after = end - ell - 2;
+    if (n < before + after) return false;
+    size_t reps = n - before - after;
+    for (size_t i = 0; i < before; ++i)
+        if (!match(m, ps[first + i], in[from + i], b)) return false;
+
+    vector<Name> vars;
+    patternVars(ps[ell], m.ellipsis, m.literals, vars);
+    for (Name x : vars) b[x].repeated = true;
+    for (size_t r = 0; r < reps; ++r) {
+        Bindings one;
+        if (!match(m, ps[ell], in[from + before + r], one)) return false;
+        for (Name x : vars) b[x].seq.push_back(std::move(one[x]));
+    }
+
+    size_t rest = from + before + reps;
+    for (size_t i = 0; i < after; ++i)
+        if (!match(m, ps[ell + 2 + i], in[rest + i], b)) return false;
+    return tail == nullptr || match(m, *tail, listOf(in.end(), in.end()), b);
+}
+
+bool match(const Macro &m, const Syntax &p, const Syntax &in, Bindings &b) {
+    if (auto s = asSymbol(p)) {
+        if (s->s == wildcardName()) return true;
+        if (contains(m.literals, s->s)) { // 另一个宏展开出的别名也匹配
+            auto x = asSymbol(in);
+            return x != nullptr && unalias(x->s) == unalias(s->s);
+        }
+        b[s->s].stx = in;
+        return true;
+    }
+    if (auto pl = asList(p)) {
+        auto il = asList(in);
+        return il != nullptr && matchList(m, pl->stxs, 0, il->stxs, 0, b);
+    }
+    return sameDatum(p, in);
+}
+
+/// Builds one expansion: substitutes what the pattern variables matched, renames the binders and
+/// replaces the free identifiers by aliases
+class Expander {
+public:
+    Expander(const Macro &m, const SyntaxRule &rule) : m(m) {
+        for (Name x : rule.binders) renamed.emplace(x, gensym(x));
+    }
+    Syntax build(const Syntax &t, const Bindings &b, bool escaped, bool quoted) const;
+
+private:
+    const Macro &m;
+    std::unordered_map<Name, Name> renamed;
+    mutable std::unordered_map<Name, Name> aliases;   // 每个自由标识符在一次展开中只有一个别名
+
+    void repeat(const Syntax &t, const Bindings &b, size_t depth, bool quoted, vector<Syntax> &out) const;
+};
+
+// Pattern variables in t that are bound to sequences
+void repeatedVars(const Syntax &t, const Bindings &b, vector<Name> &out) {
+    if (auto s = asSymbol(t)) {
+        auto it = b.find(s->s);
+        if (it != b.end() && it->second.repeated) addName(out, s->s);
+    } else if (auto l = asList(t)) {
+        for (auto &e : l->stxs) repeatedVars(e, b, out);
+    }
+}
+
+Syntax Expander::build(const Syntax &t, const Bindings &b, bool escaped, bool quoted) const {
+    static thread_local const Name QUOTE = intern("quote");
+    if (auto s = asSymbol(t)) {
+        auto v = b.find(s->s);
+        if (v != b.end()) {
+            if (v->second.repeated) throw RuntimeError("Missing ellipsis after pattern variable " + s->s->s);
+            return v->second.stx;
+        }
+        auto r = renamed.find(s->s);
+        if (quoted) return t;
+        if (r != renamed.end()) return Syntax(new SymbolSyntax(r->second));
+        if (s->s == m.ellipsis || s->s == dotName() || s->s == wildcardName()) return t;
+        Name &a = aliases[s->s];
+        if (a == nullptr) a = alias(s->s);
+        return Syntax(new SymbolSyntax(a));
+    }
+    auto l = asList(t);
+    if (l == nullptr) return t;
+    auto &ts = l->stxs;
+    if (!escaped && ts.size() == 2 && isSymbol(ts[0], m.ellipsis)) return build(ts[1], b, true, quoted); // (... template)
+    bool quotes = !quoted && !ts.empty() && isSymbol(ts[0], QUOTE);
+
+    List *out = new List();
+    Syntax result(out);
+    for (size_t i = 0; i < ts.size(); ++i) {
+        if (i == 1 && quotes) quoted = true; // quote本身也换成别名, 被quote的部分不动
+        size_t depth = 0;
+        while (!escaped && i + depth + 1 < ts.size() && isSymbol(ts[i + depth + 1], m.ellipsis)) ++depth;
+        if (depth > 0) {
+            repeat(ts[i], b, depth, quoted, out->stxs);
+            i += depth;
+        } else if (i + 2 == ts.size() && isSymbol(ts[i], dotName())) { // (a . rest): rest为列表时接在后面
+            Syntax rest = build(ts[i + 1], b, escaped, quoted);
+            if (auto rl = asList(rest)) {
+                out->stxs.insert(out->stxs.end(), rl->stxs.begin(), rl->stxs.end());
+            } else {
+                out->stxs.push_back(ts[i]);
+                out->stxs.push_back(rest);
+            }
+            break;
+        } else {
+            out->stxs.push_back(build(ts[i], b, escaped, quoted));
+        }
+    }
+    return result;
+}
+
+// Instantiates t once per repetition of the variables it uses; with depth
+// ellipses the nested sequences are flattened into out.
+void Expander::repeat(const Syntax &t, const Bindings &b, size_t depth, bool quoted, vector<Syntax> &out) const {
+    vector<Name> vars;
+    repeatedVars(t, b, vars);
+    if (vars.empty()) throw RuntimeError("No pattern variable before ellipsis in template");
+    size_t n = b.at(vars[0]).seq.size();
+    for (Name x : vars)
+        if (b.at(x).seq.size() != n) throw RuntimeError("Pattern variables under an ellipsis matched different lengths");
+
+    for (size_t i = 0; i < n; ++i) {
+        Bindings inner = b;
+        for (Name x : vars) inner[x] = b.at(x).seq[i];
+        if (depth == 1) out.push_back(build(t, inner, false, quoted));
+        else repeat(t, inner, depth - 1, quoted, out);
+    }
+}
+
+} // namespace
+
+SyntaxRule::SyntaxRule(const Syntax &pattern, const Syntax &tmpl, Name ellipsis, const vector<Name> &literals)
+    : pattern(pattern), tmpl(tmpl) {
+    auto p = asList(pattern);
+    if (p == nullptr || p->stxs.empty()) throw RuntimeError("Invalid pattern in syntax-rules");
+    vector<Name> vars;
+    for (size_t i = 1; i < p->stxs.size(); ++i) patternVars(p->stxs[i], ellipsis, literals, vars);
+    templateBinders(tmpl, ellipsis, vars, binders);
+}
+
+Macro::Macro(Name ellipsis, const vector<Name> &literals, const vector<std::pair<Syntax, Syntax>> &rules)
+    : ellipsis(ellipsis), literals(literals) {
+    this->rules.reserve(rules.size());
+    for (auto &r : rules) this->rules.emplace_back(r.first, r.second, ellipsis, literals);
+}
+
+Syntax Macro::expand(List *form) const {
+    for (auto &rule : rules) {
+        Bindings b;
+        if (!matchList(*this, asList(rule.pattern)->stxs, 1, form->stxs, 1, b)) continue;
+        return Expander(*this, rule).build(rule.tmpl, b, false, false);
+    }
+    auto head = asSymbol(form->stxs[0]);
+    throw RuntimeError("No syntax-rules pattern matches this use of " + (head ? head->s->s : std::string("macro")));
+}
+
+std::shared_ptr<const Macro> parseSyntaxRules(const Syntax &spec) {
+    static thread_local const Name SYNTAX_RULES = intern("syntax-rules"), ELLIPSIS = intern("...");
+    auto l = asList(spec);
+    auto head = l != nullptr && !l->stxs.empty() ? asSymbol(l->stxs[0]) : nullptr;
+    if (head == nullptr || unalias(head->s) != SYNTAX_RULES)
+        throw RuntimeError("Expected syntax-rules in define-syntax");
+    auto &stxs = l->stxs;
+
+    size_t i = 1;
+    Name ellipsis = ELLIPSIS;
+    if (i < stxs.size() && asSymbol(stxs[i])) ellipsis = asSymbol(stxs[i++])->s; // (syntax-rules ::: (literal ...) ...)
+    auto lits = i < stxs.size() ? asList(stxs[i++]) : nullptr;
+    if (lits == nullptr) throw RuntimeError("Invalid literal list in syntax-rules");
+    vector<Name> literals;
+    for (auto &x : lits->stxs) {
+        auto s = asSymbol(x);
+        if (!s) throw RuntimeError("Invalid literal in syntax-rules");
+        literals.push_back(s->s);
+    }
+
+    vector<std::pair<Syntax, Syntax>> rules;
+    for (; i < stxs.size(); ++i) {
+        auto r = asList(stxs[i]);
+        if (r == nullptr || r->stxs.size() != 2) throw RuntimeError("Invalid rule in syntax-rules");
+        rules.push_back({r->stxs[0], r->stxs[1]});
+    }
+    return std::make_shared<const Macro>(ellipsis, literals, rules);
+}
@@ -0,0 +1,61 @@
+#ifndef MACRO_HPP
+#define MACRO_HPP
+
+/**
+ * @file macro.hpp
+ * @brief syntax-rules macros
+ *
+ * Macros are expanded on Syntax, before the parser turns it into Expr, so
+ * a macro use costs nothing at run time: what is evaluated is the ordinary
+ * Expr tree of its expansion. The parser keeps the expansion of every use
+ * in the List node of that use (see List::expansion), so a form the parser
+ * looks at more than once, such as a body item that is scanned for defines
+ * and then parsed, or an operand a template copies twice, is expanded only
+ * once.
+ *
+ * The expansion is hygienic for the identifiers of the template. Those it
+ * binds itself (lambda and define parameters, let and letrec variables) are
+ * replaced by fresh uninterned symbols in every expansion, so they cannot
+ * capture the identifiers of the code passed to the macro. Its other
+ * identifiers, outside quoted data, are replaced by aliases (see alias() in
+ * value.hpp): the parser looks an alias up as the identifier it stands for
+ * at top level, where the macro was defined, so a binding of the same name
+ * around the use does not capture it. With a template (helper),
+ * (let ((helper ...)) (m)) still calls the global helper, and a template
+ * using if works where the use site binds if. An alias that the expansion
+ * binds itself, passed to another macro as the variable of a let say, is an
+ * ordinary local variable there.
+ *
+ * Macros are defined with define-syntax at top level and belong to the
+ * GlobalEnv they were defined in.
+ */
+
+#include "Def.hpp"
+#include "syntax.hpp"
+#include <memory>
+#include <utility>
+#include <vector>
+
+/// One (pattern template) clause
+struct SyntaxRule {
+    Syntax pattern;
+    Syntax tmpl;
+    std::vector<Name> binders;   ///< Identifiers the template binds, renamed in every expansion
+    SyntaxRule(const Syntax &pattern, const Syntax &tmpl, Name ellipsis, const std::vector<Name> &literals);
+};
+
+struct Macro {
+    Name ellipsis;                 ///< "..." unless the syntax-rules form names another one
+    std::vector<Name> literals;
+    std::vector<SyntaxRule> rules;
+
+    Macro(Name ellipsis, const std::vector<Name> &literals,
+          const std::vector<std::pair<Syntax, Syntax>> &rules);
+    /// The expansion of form by the first rule that matches; throws RuntimeError if none does
+    Syntax expand(List *form) const;
+};
+
+/// Builds the macro of a (syntax-rules (literal ...) (pattern template) ...) form
+std::shared_ptr<const Macro> parseSyntaxRules(const Syntax &spec);
+
+#endif // MACRO_HPP
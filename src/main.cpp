@@ -3,87 +3,143 @@
 #include "expr.hpp"
 #include "value.hpp"
 #include "RE.hpp"
+#include "output.hpp"
+#include "image.hpp"
+#include "profile.hpp"
+#include "stats.hpp"
+#include "interpreter.hpp"
+#include "parsecache.hpp"
+#include <cstring>
+#include <exception>
+#include <fstream>
 #include <iostream>
+#include <iterator>
 #include <map>
 #include <vector>
 
-extern std::map<std::string, ExprType> primitives;
-extern std::map<std::string, ExprType> reserved_words;
+extern const std::map<std::string, ExprType> primitives;
+extern const std::map<std::string, ExprType> reserved_words;
 
-static bool isExplicitVoidCall(Expr expr) {
-    if (dynamic_cast<MakeVoid*>(expr.get())) {
-        return true;
-    }
-    if (auto apply_expr = dynamic_cast<Apply*>(expr.get())) {
-        if (auto var_expr = dynamic_cast<Var*>(apply_expr->rator.get())) {
-            if (var_expr->x == "void") return true;
-        }
-    }
-    if (auto begin_expr = dynamic_cast<Begin*>(expr.get())) {
-        if (!begin_expr->es.empty()) return isExplicitVoidCall(begin_expr->es.back());
+static bool use_vm = false; // --vm: 用字节码虚拟机代替树遍历求值
+static const char *parseCacheDir = nullptr; // --parse-cache: 解析结果缓存在此目录
+
+void REPL(Assoc &global_env){ // READ-EVAL-PRINT-LOOP
+    Interpreter interpreter(std::cout, global_env, use_vm);
+    #ifndef ONLINE_JUDGE
+        interpreter.repl(std::cin, true);
+    #else
+        interpreter.repl(std::cin, false);
+    #endif
+}
+
+// Runs one script in global_env. With outDir the output goes to
+// outDir/<name>.out, named after the script without its extension. state is
+// the parse cache state of global_env, updated to the state after the run.
+static bool runFile(const std::string &path, const char *outDir, Assoc &global_env, std::string &state) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) {
+        std::cerr << "cannot open " << path << "\n";
+        return false;
     }
-    if (auto if_expr = dynamic_cast<If*>(expr.get())) {
-        return isExplicitVoidCall(if_expr->conseq) || isExplicitVoidCall(if_expr->alter);
+    std::string text((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+
+    auto run = [&](std::ostream &out) {
+        Interpreter interpreter(out, global_env, use_vm);
+        if (parseCacheDir != nullptr && !state.empty()) interpreter.useParseCache(parseCacheDir, state);
+        interpreter.eval(text);
+        state = interpreter.parseCacheState();
+    };
+    if (outDir == nullptr) {
+        run(std::cout);
+        return true;
     }
-    if (auto cond_expr = dynamic_cast<Cond*>(expr.get())) {
-        for (const auto& clause : cond_expr->clauses) {
-            if (!clause.empty() && isExplicitVoidCall(clause.back())) return true;
-        }
+    std::string name = path.substr(path.find_last_of('/') + 1);
+    std::ofstream out(std::string(outDir) + "/" + name.substr(0, name.find_last_of('.')) + ".out");
+    if (!out) {
+        std::cerr << "cannot write output of " << path << " to " << outDir << "\n";
+        return false;
     }
-    return false;
+    run(out);
+    return true;
 }
 
-void REPL(){ // READ-EVAL-PRINT-LOOP
-    Assoc global_env = empty();
-    std::vector<std::pair<std::string,Expr>> pending_defines;
-
-    while (true){
-        #ifndef ONLINE_JUDGE
-            std::cout << "scm> ";
-        #endif
-
-        // READ
-        Syntax stx = readSyntax(std::cin);
-        try{
-            Expr expr = stx->parse(global_env);
+int main(int argc, char *argv[]) {
+    std::ios::sync_with_stdio(false); // 让cin带缓冲, Reader整块读取
+    std::vector<std::string> files;
+    const char *outDir = nullptr;
+    const char *imagePath = nullptr, *savePath = nullptr;
+    const char *foldedPath = nullptr;
+    bool printStats = false;   // --stats: 退出时把运行时计数器输出到stderr
+    for (int i = 1; i < argc; ++i) {
+        if (std::strcmp(argv[i], "--vm") == 0) use_vm = true;
+        else if (std::strcmp(argv[i], "-o") == 0 && i + 1 < argc) outDir = argv[++i];
+        else if (std::strcmp(argv[i], "--image") == 0 && i + 1 < argc) imagePath = argv[++i];
+        else if (std::strcmp(argv[i], "--save-image") == 0 && i + 1 < argc) savePath = argv[++i];
+        else if (std::strcmp(argv[i], "--parse-cache") == 0 && i + 1 < argc) parseCacheDir = argv[++i];
+        else if (std::strcmp(argv[i], "--profile-folded") == 0 && i + 1 < argc) foldedPath = argv[++i];
+        else if (std::strcmp(argv[i], "--stats") == 0) printStats = true;
+        else if (argv[i][0] != '-') files.push_back(argv[i]);
+        else {
+            std::cerr << "usage: " << argv[0]
+                      << " [--vm] [-o DIR] [--image IMAGE] [--save-image IMAGE] [--parse-cache DIR]"
+                      << " [--profile-folded FILE] [--stats] [FILE.scm...]\n";
+            return 1;
+        }
+    }
+#ifndef SCHEME_PROFILE
+    if (foldedPath != nullptr) {
+        std::cerr << "--profile-folded needs a build configured with -DSCHEME_PROFILE=ON\n";
+        return 1;
+    }
+#endif
 
-            if (auto define_expr = dynamic_cast<Define*>(expr.get())) { // 收集define
-                pending_defines.push_back({define_expr->var, define_expr->e});
-                continue;
-            }
-            if (!pending_defines.empty()) {
-                for (auto &def : pending_defines) {
-                    if (find(def.first, global_env).get() == nullptr) { // 不存在则创建绑定
-                        global_env = extend(def.first, VoidV(), global_env);
-                    }
-                }
+    // --image: 每次运行都从映像中的全局环境开始
+    Image image;
+    if (imagePath != nullptr && !image.load(imagePath)) {
+        std::cerr << "cannot read image " << imagePath << "\n";
+        return 1;
+    }
+    auto startEnv = [&]() { return imagePath != nullptr ? image.restore() : globalEnv(); };
+    // 解析缓存中起始环境的状态: 映像按内容区分
+    const std::string startState = imagePath == nullptr ? "fresh"
+        : parsecache::next("image", image.bytes().data(), image.bytes().size());
 
-                // EVAL
-                for (auto &def : pending_defines) {
-                    Value val = def.second->eval(global_env);
-                    modify(def.first, val, global_env);
+    try {
+        bool ok = true;
+        Assoc session = files.empty() || savePath != nullptr ? startEnv() : empty();
+        std::string sessionState = startState;
+        if (files.empty()) {
+            REPL(session);
+        } else {
+            // 不带提示符批量运行; 要保存映像时所有文件共用一个全局环境
+            for (auto &f : files) {
+                if (savePath != nullptr) {
+                    ok = runFile(f, outDir, session, sessionState) && ok;
+                } else {
+                    Assoc env = startEnv();
+                    std::string state = startState;
+                    ok = runFile(f, outDir, env, state) && ok;
                 }
-                pending_defines.clear();
-            }
-
-            Value val = expr->eval(global_env);
-            if (val->v_type == V_TERMINATE) break;
-
-            // PRINT
-            if (val->v_type != V_VOID || isExplicitVoidCall(expr)) {
-                val->show(std::cout);
-                std::cout << "\n";
-            } else {
-                std::cout << "\n";
             }
         }
-        catch (const RuntimeError &){
-            std::cout << "RuntimeError\n";
+        if (savePath != nullptr && !saveImage(savePath, session)) {
+            std::cerr << "cannot write image " << savePath << "\n";
+            ok = false;
+        }
+        if (printStats) stats::report(std::cerr);
+#ifdef SCHEME_PROFILE
+        profile::report(std::cerr);
+        if (foldedPath != nullptr && !profile::writeFolded(foldedPath)) {
+            std::cerr << "cannot write profile " << foldedPath << "\n";
+            ok = false;
         }
-    } // LOOP
+#endif
+        return ok ? 0 : 1;
+    } catch (const RuntimeError &e) { // 映像损坏
+        std::cerr << "fatal: " << e.message() << "\n";
+        return 2;
+    } catch (const std::exception &e) { // 栈上的Output析构时已输出缓冲的内容
+        std::cerr << "fatal: " << e.what() << "\n";
+        return 2;
+    }
 }
-
-int main(int argc, char *argv[]) {
-    REPL();
-    return 0;
-}
\ No newline at end of file
@@ -0,0 +1,86 @@
+/**
+ * @file output.cpp
+ * @brief Output buffer implementation
+ */
+
+#include "output.hpp"
+#include <cstring>
+#include <iostream>
+
+Output::Output(std::ostream &os, size_t capacity) : sink(os.rdbuf()), buf(capacity) {
+    setp(buf.data(), buf.data() + buf.size());
+}
+
+Output::~Output() {
+    flush();
+}
+
+void Output::drain() {
+    std::ptrdiff_t n = pptr() - pbase();
+    if (n > 0) sink->sputn(pbase(), n);
+    setp(buf.data(), buf.data() + buf.size());
+}
+
+void Output::flush() {
+    drain();
+    sink->pubsync();
+}
+
+void Output::write(const char *s, size_t n) {
+    if (size_t(epptr() - pptr()) < n) {
+        drain();
+        if (n >= buf.size()) { // 比整个缓冲区还大, 直接写出
+            sink->sputn(s, std::streamsize(n));
+            return;
+        }
+    }
+    std::memcpy(pptr(), s, n);
+    pbump(int(n));
+}
+
+void Output::writeInt(long long n) {
+    char digits[24];
+    char *end = digits + sizeof digits, *p = end;
+    unsigned long long u = n < 0 ? 0ull - (unsigned long long)n : (unsigned long long)n;
+    do { // 从低位往高位填
+        *--p = char('0' + u % 10);
+        u /= 10;
+    } while (u != 0);
+    if (n < 0) *--p = '-';
+    write(p, size_t(end - p));
+}
+
+int Output::overflow(int c) {
+    if (c != traits_type::eof()) put(char(c));
+    return traits_type::not_eof(c);
+}
+
+std::streamsize Output::xsputn(const char *s, std::streamsize n) {
+    write(s, size_t(n));
+    return n;
+}
+
+int Output::sync() {
+    flush();
+    return 0;
+}
+
+namespace {
+
+thread_local Output *current = nullptr;
+
+} // namespace
+
+Output &currentOutput() {
+    if (current == nullptr) {
+        static Output standard(std::cout); // 退出时析构并输出剩余内容
+        current = &standard;
+    }
+    return *current;
+}
+
+Output *setCurrentOutput(Output *out) {
+    Output *previous = current;
+    current = out;
+    return previous;
+}
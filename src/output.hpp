@@ -0,0 +1,60 @@
+#ifndef OUTPUT_HPP
+#define OUTPUT_HPP
+
+/**
+ * @file output.hpp
+ * @brief Buffered output for printed results and display
+ *
+ * Output collects everything the interpreter prints in one large buffer and
+ * hands it to the underlying stream only when the buffer is full, on
+ * flush() (or pubsync()), and when it is destroyed. It is also a
+ * std::streambuf, so a std::ostream can be put on top of it; the REPL ties
+ * such a stream to std::cin, which makes the Reader flush pending output
+ * before it waits for more input.
+ *
+ * The printer itself is Value::show(Output &).
+ */
+
+#include <cstddef>
+#include <streambuf>
+#include <ostream>
+#include <string>
+#include <vector>
+
+const size_t OUTPUT_BUFFER_SIZE = 1 << 20;
+
+class Output : public std::streambuf {
+public:
+    explicit Output(std::ostream &sink, size_t capacity = OUTPUT_BUFFER_SIZE);
+    ~Output() override;
+
+    void put(char c) {
+        if (pptr() == epptr()) drain();
+        *pptr() = c;
+        pbump(1);
+    }
+    void write(const char *s, size_t n);
+    void write(const std::string &s) { write(s.data(), s.size()); }
+    void writeInt(long long n);   ///< Decimal, formatted without going through iostreams
+
+    /// Passes the buffered text on and flushes the underlying stream
+    void flush();
+
+protected:
+    int overflow(int c) override;
+    std::streamsize xsputn(const char *s, std::streamsize n) override;
+    int sync() override;
+
+private:
+    std::streambuf *sink;
+    std::vector<char> buf;
+
+    void drain();   ///< Passes the buffered text on, without flushing the sink
+};
+
+/// Destination of display and of the results printed by the REPL, per thread
+Output &currentOutput();
+/// Makes out the current output until it is replaced again; returns the previous one
+Output *setCurrentOutput(Output *out);
+
+#endif // OUTPUT_HPP
@@ -0,0 +1,261 @@
+/**
+ * @file parallel.cpp
+ * @brief Tasks and the work-stealing pool
+ */
+
+#include "parallel.hpp"
+#include "image.hpp"
+#include "RE.hpp"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+/**
+ * @brief A call, or a run of calls of one procedure, for any thread to run
+ *
+ * Holds no Value, only encodings, so it can be shared between threads. The
+ * thread that runs it fills in the result fields and then sets done.
+ */
+struct Task {
+    std::shared_ptr<const std::string> fun;   ///< Encoded procedure, shared by the tasks of a parallel-map
+    std::string items;       ///< Encoded list of elements to call fun on, one by one; empty for a future
+    bool each = false;       ///< Call fun on every element of items, else once without arguments
+
+    std::string result;      ///< Encoded return value, the list of them if each
+    std::string printed;     ///< What the calls displayed
+    std::string error;
+    bool failed = false;
+    std::atomic<bool> done{false};
+};
+
+namespace parallel {
+
+namespace {
+
+typedef std::shared_ptr<Task> TaskRef;
+
+const size_t TASKS_PER_WORKER = 4;          // parallel-map把列表分成的份数, 按worker数计
+const size_t TASK_OUTPUT_BUFFER = 4096;
+
+thread_local int workerIndex = -1;          // 本线程是第几个worker, 其他线程为-1
+
+// 本线程最近一次parallel-map的过程, 同一次调用的任务只解码一次
+struct FunCache {
+    std::shared_ptr<const std::string> key;
+    Value fun;
+};
+thread_local FunCache *funCache = nullptr;   // 从不释放, 同intern表
+
+Value procedureOf(const Task &t) {
+    if (!t.each) return decodeTransfer(*t.fun);
+    if (funCache == nullptr) funCache = new FunCache();
+    if (funCache->key != t.fun) {
+        funCache->fun = decodeTransfer(*t.fun);
+        funCache->key = t.fun;
+    }
+    return funCache->fun;
+}
+
+// Runs t on this thread and in its heap
+void execute(Task &t) {
+    std::ostringstream printed;
+    {
+        Output out(printed, TASK_OUTPUT_BUFFER);
+        Output *previous = setCurrentOutput(&out);
+        try {
+            Value fun = procedureOf(t);
+            Value result = NullV();
+            if (t.each) {
+                Value items = decodeTransfer(t.items);
+                Pair *last = nullptr;
+                for (Value v = items; v.type() == V_PAIR; v = static_cast<Pair*>(v.get())->cdr) {
+                    Value r = PairV(applyProcedure(fun, {static_cast<Pair*>(v.get())->car}), NullV());
+                    if (last == nullptr) result = r;
+                    else last->cdr = r;
+                    last = static_cast<Pair*>(r.get());
+                }
+            } else {
+                result = applyProcedure(fun, {});
+            }
+            t.result = encodeTransfer(result);
+        } catch (const RuntimeError &e) {
+            t.failed = true;
+            t.error = e.message();
+        } catch (const std::exception &e) {
+            t.failed = true;
+            t.error = e.what();
+        }
+        setCurrentOutput(previous);
+    }
+    t.printed = printed.str();
+}
+
+class Pool {
+public:
+    explicit Pool(size_t n) {
+        for (size_t i = 0; i < n; ++i) queues.emplace_back(new Queue());
+        for (size_t i = 0; i < n; ++i) std::thread(&Pool::work, this, i).detach();
+    }
+
+    size_t size() const { return queues.size(); }
+
+    void push(const TaskRef &t) {
+        size_t i = workerIndex >= 0 ? size_t(workerIndex) : nextQueue++ % queues.size();
+        {
+            std::lock_guard<std::mutex> lock(queues[i]->m);
+            queues[i]->tasks.push_back(t);
+        }
+        {
+            std::lock_guard<std::mutex> lock(m);
+            ++queued;
+        }
+        changed.notify_one();
+    }
+
+    /// Returns once t is done, running queued tasks in the meantime
+    void wait(const Task &t) {
+        while (!t.done.load(std::memory_order_acquire)) {
+            TaskRef other = take();
+            if (other) {
+                run(*other);
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(m);
+            changed.wait(lock, [&] { return t.done.load(std::memory_order_acquire) || queued > 0; });
+        }
+    }
+
+private:
+    struct Queue {
+        std::mutex m;
+        std::deque<TaskRef> tasks;
+    };
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::atomic<size_t> nextQueue{0};
+    std::mutex m;
+    std::condition_variable changed;   // 有新任务, 或有任务完成
+    size_t queued = 0;                 // 各队列中的任务总数, 由m保护
+
+    // 先从本worker队列的尾部取, 再从其他队列的头部偷
+    TaskRef take() {
+        size_t n = queues.size();
+        size_t self = workerIndex >= 0 ? size_t(workerIndex) : 0;
+        TaskRef t;
+        for (size_t k = 0; k < n && !t; ++k) {
+            Queue &q = *queues[(self + k) % n];
+            std::lock_guard<std::mutex> lock(q.m);
+            if (q.tasks.empty()) continue;
+            if (k == 0 && workerIndex >= 0) {
+                t = q.tasks.back();
+                q.tasks.pop_back();
+            } else {
+                t = q.tasks.front();
+                q.tasks.pop_front();
+            }
+        }
+        if (t) {
+            std::lock_guard<std::mutex> lock(m);
+            --queued;
+        }
+        return t;
+    }
+
+    void run(Task &t) {
+        execute(t);
+        gcSafePoint(); // 回收任务留下的环
+        t.done.store(true, std::memory_order_release);
+        { std::lock_guard<std::mutex> lock(m); } // 等待者检查完条件后才会错过通知
+        changed.notify_all();
+    }
+
+    void work(size_t self) {
+        workerIndex = int(self);
+        while (true) {
+            TaskRef t = take();
+            if (t) {
+                run(*t);
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(m);
+            changed.wait(lock, [this] { return queued > 0; });
+        }
+    }
+};
+
+// 从不释放: 进程退出时worker仍在等待任务
+Pool &pool() {
+    static Pool *p = new Pool(std::max(1u, std::thread::hardware_concurrency()));
+    return *p;
+}
+
+// The value computed by t, once it is done; its output goes to the current output
+Value collect(Task &t) {
+    pool().wait(t);
+    currentOutput().write(t.printed);
+    t.printed.clear(); // 只输出一次
+    if (t.failed) throw RuntimeError(t.error);
+    return decodeTransfer(t.result);
+}
+
+} // namespace
+
+Value future(const Value &thunk) {
+    if (!isProcedure(thunk)) throw RuntimeError("Attempt to apply a non-procedure");
+    TaskRef t = std::make_shared<Task>();
+    t->fun = std::make_shared<const std::string>(encodeTransfer(thunk));
+    pool().push(t);
+    return FutureV(t);
+}
+
+Value touch(const Value &v) {
+    if (v.type() != V_FUTURE) throw RuntimeError("touch on non-future");
+    Future *f = static_cast<Future*>(v.get());
+    if (f->result.unbound()) f->result = collect(*f->task);
+    return f->result;
+}
+
+Value map(const Value &fun, const Value &list) {
+    if (!isProcedure(fun)) throw RuntimeError("Attempt to apply a non-procedure");
+    std::vector<Value> items;
+    Value v = list;
+    for (; v.type() == V_PAIR; v = static_cast<Pair*>(v.get())->cdr) items.push_back(static_cast<Pair*>(v.get())->car);
+    if (v.type() != V_NULL) throw RuntimeError("parallel-map on non-list");
+    if (items.empty()) return NullV();
+
+    Pool &p = pool();
+    auto encoded = std::make_shared<const std::string>(encodeTransfer(fun));
+    size_t parts = std::min(items.size(), p.size() * TASKS_PER_WORKER);
+    std::vector<TaskRef> tasks;
+    for (size_t k = 0; k < parts; ++k) {
+        size_t lo = items.size() * k / parts, hi = items.size() * (k + 1) / parts;
+        Value chunk = NullV();
+        for (size_t i = hi; i-- > lo;) chunk = PairV(items[i], chunk);
+        TaskRef t = std::make_shared<Task>();
+        t->fun = encoded;
+        t->items = encodeTransfer(chunk);
+        t->each = true;
+        p.push(t);
+        tasks.push_back(t);
+    }
+
+    // 按顺序取回各部分并连接起来
+    Value result = NullV();
+    Pair *last = nullptr;
+    for (auto &t : tasks) {
+        Value part = collect(*t);
+        if (part.type() != V_PAIR) continue;
+        if (last == nullptr) result = part;
+        else last->cdr = part;
+        last = static_cast<Pair*>(part.get());
+        while (last->cdr.type() == V_PAIR) last = static_cast<Pair*>(last->cdr.get());
+    }
+    return result;
+}
+
+} // namespace parallel
@@ -0,0 +1,41 @@
+#ifndef PARALLEL_HPP
+#define PARALLEL_HPP
+
+/**
+ * @file parallel.hpp
+ * @brief future, touch and parallel-map on a work-stealing thread pool
+ *
+ * (future thunk) starts calling thunk on a worker thread and returns a
+ * future, (touch f) waits for it and returns what thunk returned, and
+ * (parallel-map f list) calls f on every element of list, spread over the
+ * workers, and returns the list of the results in order.
+ *
+ * Every thread has a heap of its own (see gc.hpp), so a closure cannot be
+ * handed to a worker as it is. The procedure and the arguments of a task are
+ * encoded with encodeTransfer() on the calling thread and decoded into the
+ * heap of the thread that runs it; the result comes back the same way. The
+ * copy takes the global variables the code uses as they are when the task is
+ * created, and assignments on one side are not seen on the other, so the
+ * procedures are meant to be pure. What a task displays is kept and written
+ * to the current output when its result is touched, so the output is the
+ * same as if the calls had run one after the other. An error in a task is
+ * raised again by touch or parallel-map. Tasks run on the tree walker.
+ *
+ * The pool has one worker per hardware thread, started on first use, each
+ * with a deque of tasks: a worker takes its own tasks from the back and
+ * steals from the front of the others' when it runs out. A thread waiting
+ * for a task, a worker or an interpreter's, runs queued tasks meanwhile, so
+ * nested futures cannot deadlock the pool.
+ */
+
+#include "value.hpp"
+
+namespace parallel {
+
+Value future(const Value &thunk);
+Value touch(const Value &future);                  ///< Throws RuntimeError if the task failed
+Value map(const Value &fun, const Value &list);   ///< Throws RuntimeError if a call failed
+
+} // namespace parallel
+
+#endif // PARALLEL_HPP
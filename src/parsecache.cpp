@@ -0,0 +1,118 @@
+/**
+ * @file parsecache.cpp
+ * @brief Parse cache entries: keys and files
+ */
+
+#include "parsecache.hpp"
+#include "RE.hpp"
+#include <sys/stat.h>
+#include <unistd.h>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+
+namespace parsecache {
+
+namespace {
+
+// 两路独立的64位散列拼成128位的键, 不会碰巧撞上
+struct Digest {
+    uint64_t a = 0xcbf29ce484222325ull, b = 0x84222325cbf29ce4ull;
+
+    void add(const char *p, size_t n) {
+        for (size_t i = 0; i < n; ++i) {
+            unsigned char c = (unsigned char)p[i];
+            a = (a ^ c) * 0x100000001b3ull;              // FNV-1a
+            b = (b + c + 1) * 0x9e3779b97f4a7c15ull;
+            b ^= b >> 29;
+        }
+    }
+    void add(uint64_t n) {
+        char bytes[8];
+        for (int i = 0; i < 8; ++i) bytes[i] = char(n >> (8 * i));
+        add(bytes, 8);
+    }
+    std::string hex() const {
+        static const char digits[] = "0123456789abcdef";
+        std::string s;
+        for (uint64_t h : {a, b}) {
+            for (int i = 60; i >= 0; i -= 4) s.push_back(digits[(h >> i) & 15]);
+        }
+        return s;
+    }
+};
+
+std::atomic<unsigned> temporaries{0};   // 同一进程的多个线程也不共用临时文件
+
+std::string entryPath(const std::string &dir, const std::string &key) {
+    return dir + "/" + key + ".parsed";
+}
+
+// 条目开头是其余内容的散列, 用十六进制写出
+const size_t CHECK_SIZE = 32;
+
+std::string checksum(const char *p, size_t n) {
+    Digest d;
+    d.add(n);
+    d.add(p, n);
+    return d.hex();
+}
+
+} // namespace
+
+std::string next(const std::string &state, const char *source, size_t size) {
+    Digest d;
+    d.add(state.size());
+    d.add(state.data(), state.size());
+    d.add(size);
+    d.add(source, size);
+    return d.hex();
+}
+
+bool load(const std::string &dir, const std::string &key, GlobalEnv *globals, std::vector<ParsedForm> &forms) {
+    std::ifstream in(entryPath(dir, key), std::ios::binary);
+    if (!in) return false;
+    std::string data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    in.close();
+    try {
+        if (data.size() < CHECK_SIZE
+            || data.compare(0, CHECK_SIZE, checksum(data.data() + CHECK_SIZE, data.size() - CHECK_SIZE)) != 0)
+            throw RuntimeError("Corrupted parse cache entry");
+        forms = decodeForms(data.substr(CHECK_SIZE), globals);
+    } catch (const RuntimeError &) { // 其他版本写的或已损坏: 删除, 重新解析后再写入
+        forms.clear();
+        std::remove(entryPath(dir, key).c_str());
+        return false;
+    }
+    return true;
+}
+
+bool store(const std::string &dir, const std::string &key, const std::vector<ParsedForm> &forms) {
+    std::string data;
+    try {
+        std::string payload = encodeForms(forms);
+        data = checksum(payload.data(), payload.size()) + payload;
+    } catch (const RuntimeError &) {
+        return false;
+    }
+    mkdir(dir.c_str(), 0777); // 已存在时失败, 无妨
+    std::string path = entryPath(dir, key);
+    std::string tmp = path + ".tmp" + std::to_string(getpid()) + "-" + std::to_string(temporaries++);
+    {
+        std::ofstream out(tmp, std::ios::binary);
+        out.write(data.data(), std::streamsize(data.size()));
+        if (!out.flush()) {
+            std::remove(tmp.c_str());
+            return false;
+        }
+    }
+    if (std::rename(tmp.c_str(), path.c_str()) != 0) { // 同时运行的进程只会看到完整的文件
+        std::remove(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+} // namespace parsecache
@@ -0,0 +1,50 @@
+#ifndef PARSECACHE_HPP
+#define PARSECACHE_HPP
+
+/**
+ * @file parsecache.hpp
+ * @brief On-disk cache of the parsed forms of source files
+ *
+ * Most of the start-up time of running a source goes into reading and
+ * parsing it. The cache keeps the forms the parser produced for a source
+ * (see encodeForms()) in a file of the cache directory named after a hash
+ * of the source text and of the state of the environment it ran in, so a
+ * later run of the same text from the same state skips the reader and the
+ * parser altogether.
+ *
+ * The state is part of the key because parsing looks at the environment:
+ * whether a name such as car is a global variable or the primitive, and
+ * which macros exist. Both change only by running code, which is
+ * deterministic, so a state is named by how it came about: a fresh
+ * environment is "fresh", one restored from an image is named after the
+ * image's contents, and running a source in state s leads to the state
+ * next(s, source), which is also the key of that run's entry. Changing an
+ * environment any other way (the REPL, an embedder calling
+ * Interpreter::environment()) leaves its state unknown.
+ *
+ * An entry is written to a temporary file and renamed into place, so
+ * processes sharing the directory never read a partial one. It starts with a
+ * digest of the rest, checked before anything is decoded. An entry whose
+ * digest does not match, or that cannot be decoded (one written by another
+ * version, for instance), counts as a miss: it is deleted, and written again
+ * once the source is parsed.
+ */
+
+#include "image.hpp"
+#include <cstddef>
+#include <string>
+#include <vector>
+
+namespace parsecache {
+
+/// The state of an environment after source runs in one in state; a hex digest
+std::string next(const std::string &state, const char *source, size_t size);
+
+/// Reads the entry key of dir into forms, with global variables in globals; false on a miss
+bool load(const std::string &dir, const std::string &key, GlobalEnv *globals, std::vector<ParsedForm> &forms);
+/// Writes forms as the entry key of dir, creating dir if needed; false if it cannot be written
+bool store(const std::string &dir, const std::string &key, const std::vector<ParsedForm> &forms);
+
+} // namespace parsecache
+
+#endif // PARSECACHE_HPP
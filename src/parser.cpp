@@ -6,6 +6,29 @@
  * applications. Variable shadowing is honored: if a name is already bound in
  * the given environment, we parse it as a normal variable reference/call,
  * even if it looks like a primitive or a special form keyword.
+ *
+ * The parser also resolves every variable reference to a lexical address.
+ * Local bindings are tracked in a chain of Scopes that mirrors the runtime
+ * environment frame for frame, so Var/Set/Define know at parse time the
+ * (depth, slot) of their binding. Internal defines are scanned out when a
+ * body is entered and get slots in the same frame as the parameters/let
+ * variables. Everything else is a global and is resolved to its cell in the
+ * GlobalEnv at the end of the environment chain.
+ *
+ * This is also where closures are converted: a local of an enclosing frame
+ * that a lambda's body uses becomes one of the lambda's captures, addressed
+ * in the closure's own frame, and a captured variable that is assigned
+ * anywhere in its scope is marked to be shared through a Box.
+ *
+ * Calls of pure primitives on literal operands are folded to a literal, and
+ * `if` on a literal condition is reduced to the branch it selects.
+ *
+ * A use of a syntax-rules macro (see macro.hpp) is replaced by its expansion
+ * before anything else is decided about it, unless a local binding shadows
+ * the macro's name. The aliases an expansion puts in place of the free
+ * identifiers of a template are local variables where the expansion binds
+ * them itself; everywhere else they mean the identifier they stand for at
+ * top level, where the macro was defined, whatever the use site binds.
  */
 
 #include "RE.hpp"
@@ -13,19 +36,177 @@
 #include "syntax.hpp"
 #include "value.hpp"
 #include "expr.hpp"
+#include "macro.hpp"
+#include "profile.hpp"
 #include <map>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 using std::string;
 using std::vector;
 
-extern std::map<std::string, ExprType> primitives;
-extern std::map<std::string, ExprType> reserved_words;
+extern const std::map<std::string, ExprType> primitives;
+extern const std::map<std::string, ExprType> reserved_words;
+
+typedef std::unordered_map<Name, ExprType> NameTable;
+
+static NameTable internAll(const std::map<string, ExprType> &words) {
+    NameTable t;
+    for (auto &kv : words) t.emplace(intern(kv.first), kv.second);
+    return t;
+}
+
+// primitives and reserved_words keyed by interned name
+static const NameTable &primitiveNames() {
+    static thread_local const NameTable t = internAll(primitives);   // 名字是每个线程自己的符号
+    return t;
+}
+static const NameTable &reservedNames() {
+    static thread_local const NameTable t = internAll(reserved_words);
+    return t;
+}
+
+/**
+ * @brief What the parser learns about one local variable
+ *
+ * Shared by the slot that binds the variable and the capture slots that copy
+ * it, so an assignment anywhere is seen where the closures are decided on.
+ */
+struct Binding {
+    bool assigned = false;   ///< By set!, an internal define or letrec, after its frame was made
+    vector<std::pair<Expr, size_t>> captures;   ///< Lambdas capturing it and the index in their captures
+};
 
-static Expr parseSyntax(const Syntax &stx, Assoc &env);
+/**
+ * @brief Compile-time mirror of one runtime environment frame
+ *
+ * Every lambda/let/letrec creates one frame whose slots are `names`. A lambda
+ * also has a capture Scope ending the chain, the frame of its closure (see
+ * Lambda): a variable bound in `outer`, around the lambda, is added to it the
+ * first time the body uses it.
+ */
+struct Scope {
+    vector<Name> names;
+    vector<std::shared_ptr<Binding>> bindings;   // 与names对应, 用到时才创建
+    Scope *parent;
+    Scope *outer = nullptr;       // 捕获帧: lambda所在的Scope
+    vector<Capture> captures;     // 捕获帧: 各槽位从outer中的哪里复制
+    explicit Scope(Scope *p) : parent(p) {}
+
+    const std::shared_ptr<Binding> &binding(size_t i) {
+        if (bindings.size() < names.size()) bindings.resize(names.size());
+        if (!bindings[i]) bindings[i] = std::make_shared<Binding>();
+        return bindings[i];
+    }
+};
+
+static Expr parseSyntax(const Syntax &stx, Assoc &env, Scope *sc);
+static Expr parseList(List *l, Assoc &env, Scope *sc);
+
+// Finds the frame depth and slot of x, adding it to the captures of the
+// lambdas it is free in; when x is not lexically bound, returns nullptr and
+// `depth` is the number of local frames in scope.
+static std::shared_ptr<Binding> resolve(Name x, Scope *sc, int &depth, int &slot) {
+    depth = 0;
+    slot = 0;
+    for (Scope *s = sc; s != nullptr; s = s->parent, ++depth) {
+        for (size_t i = s->names.size(); i-- > 0;) { // 同一帧中靠后的槽位遮蔽靠前的
+            if (s->names[i] == x) {
+                slot = int(i);
+                return s->binding(i);
+            }
+        }
+        if (s->outer == nullptr) continue;
+        int d, k;
+        std::shared_ptr<Binding> b = resolve(x, s->outer, d, k);
+        if (!b) continue; // 全局变量
+        s->names.push_back(x);
+        s->bindings.resize(s->names.size());
+        s->bindings.back() = b;
+        s->captures.push_back(Capture{x, d, k, false});
+        slot = int(s->names.size() - 1);
+        return b;
+    }
+    return nullptr;
+}
 
-Expr Syntax::parse(Assoc &env) {
+// Whether x is lexically bound, without capturing it
+static bool isLocal(Name x, const Scope *sc) {
+    for (const Scope *s = sc; s != nullptr; s = s->parent) {
+        for (Name n : s->names) if (n == x) return true;
+        if (s->outer != nullptr) return isLocal(x, s->outer);
+    }
+    return false;
+}
+
+static bool isBound(Name x, Assoc &env, Scope *sc) {
+    return isLocal(x, sc) || !find(x, env).unbound();
+}
+
+// The name x is looked up by and the scope it is looked up in: an alias that
+// nothing in sc binds stands for its original at top level
+static Name lookupName(Name x, Scope *&sc) {
+    while (x->original != nullptr && !isLocal(x, sc)) {
+        x = x->original;
+        sc = nullptr;
+    }
+    return x;
+}
+
+// The cell of global x in the top-level environment env ends in
+static Value *globalCell(Name x, Assoc &env) {
+    GlobalEnv *globals = globalsOf(env);
+    return globals != nullptr ? globals->cell(x) : nullptr;
+}
+
+// The macro x names in this scope, nullptr if there is none
+static std::shared_ptr<const Macro> macroOf(Name x, Assoc &env, Scope *sc) {
+    x = lookupName(x, sc);
+    GlobalEnv *globals = globalsOf(env);
+    if (globals == nullptr || globals->macros.empty() || isLocal(x, sc)) return nullptr;
+    auto it = globals->macros.find(x);
+    return it != globals->macros.end() ? it->second : nullptr;
+}
+
+// The expansion of l if it is a macro use, else a null Syntax. It is kept in
+// l, so a form that is looked at again is not expanded again.
+static Syntax expansionOf(List *l, Assoc &env, Scope *sc) {
+    auto head = l->stxs.empty() ? nullptr : asSymbol(l->stxs[0]);
+    if (head == nullptr) return Syntax(nullptr);
+    std::shared_ptr<const Macro> m = macroOf(head->s, env, sc);
+    if (!m) return Syntax(nullptr);
+    if (l->expandedBy != m) {
+        l->expansion = m->expand(l);
+        l->expandedBy = m;
+    }
+    return l->expansion;
+}
+
+const int MAX_EXPANSION_DEPTH = 1000;
+
+// Counts the expansions being parsed inside each other, so a macro that
+// keeps expanding into itself fails instead of exhausting the stack
+struct ExpansionDepth {
+    static thread_local int depth;
+    ExpansionDepth() {
+        if (++depth > MAX_EXPANSION_DEPTH) {
+            --depth;
+            throw RuntimeError("Macro expansion too deep");
+        }
+    }
+    ~ExpansionDepth() { --depth; }
+};
+thread_local int ExpansionDepth::depth = 0;
+
+static Expr makeVar(Name x, Assoc &env, Scope *sc) {
+    int depth, slot;
+    if (resolve(x, sc, depth, slot)) return Expr(new Var(x, depth, slot, false));
+    x = unalias(x);
+    return Expr(new Var(x, depth, slot, true, globalCell(x, env)));
+}
+
+Expr Syntax::parse(Assoc &) {
     throw RuntimeError("Unimplemented parse method");
 }
 
@@ -34,14 +215,18 @@ Expr Number::parse(Assoc &env) {
     return Expr(new Fixnum(n));
 }
 
+Expr BignumSyntax::parse(Assoc &env) {
+    (void)env;
+    return Expr(new BignumExpr(n));
+}
+
 Expr RationalSyntax::parse(Assoc &env) {
     (void)env;
     return Expr(new RationalNum(numerator, denominator));
 }
 
 Expr SymbolSyntax::parse(Assoc &env) {
-    (void)env;
-    return Expr(new Var(s));
+    return makeVar(s, env, nullptr);
 }
 
 Expr StringSyntax::parse(Assoc &env) {
@@ -59,169 +244,398 @@ Expr FalseSyntax::parse(Assoc &env) {
     return Expr(new False());
 }
 
-static Expr parseSyntax(const Syntax &stx, Assoc &env) {
-    if (auto n = dynamic_cast<Number*>(stx.get()))         return Expr(new Fixnum(n->n));
-    if (auto r = dynamic_cast<RationalSyntax*>(stx.get())) return Expr(new RationalNum(r->numerator, r->denominator));
-    if (auto t = dynamic_cast<TrueSyntax*>(stx.get()))      return Expr(new True());
-    if (auto f = dynamic_cast<FalseSyntax*>(stx.get()))     return Expr(new False());
-    if (auto s = dynamic_cast<StringSyntax*>(stx.get()))    return Expr(new StringExpr(s->s));
-    if (auto v = dynamic_cast<SymbolSyntax*>(stx.get()))    return Expr(new Var(v->s));
-    if (auto l = dynamic_cast<List*>(stx.get()))            return l->parse(env);
+static Expr parseSyntax(const Syntax &stx, Assoc &env, Scope *sc) {
+    SyntaxBase *b = stx.get();
+    switch (b->s_type) {
+        case S_NUMBER:   return Expr(new Fixnum(static_cast<Number*>(b)->n));
+        case S_BIGNUM:   return Expr(new BignumExpr(static_cast<BignumSyntax*>(b)->n));
+        case S_RATIONAL: {
+            auto r = static_cast<RationalSyntax*>(b);
+            return Expr(new RationalNum(r->numerator, r->denominator));
+        }
+        case S_TRUE:     return Expr(new True());
+        case S_FALSE:    return Expr(new False());
+        case S_STRING:   return Expr(new StringExpr(static_cast<StringSyntax*>(b)->s));
+        case S_SYMBOL:   return makeVar(static_cast<SymbolSyntax*>(b)->s, env, sc);
+        case S_LIST:     return parseList(static_cast<List*>(b), env, sc);
+    }
     throw RuntimeError("Unknown syntax node");
 }
 
-static vector<Expr> parseFromIndex(const vector<Syntax> &items, size_t start, Assoc &env) {
+static vector<Expr> parseFromIndex(const vector<Syntax> &items, size_t start, Assoc &env, Scope *sc) {
     vector<Expr> out;
     out.reserve(items.size() - start);
-    for (size_t i = start; i < items.size(); ++i) out.push_back(parseSyntax(items[i], env));
+    for (size_t i = start; i < items.size(); ++i) out.push_back(parseSyntax(items[i], env, sc));
     return out;
 }
 
-static Assoc extendWithPlaceholders(const vector<string> &names, Assoc env) { // 扩展环境(占位符)
-    Assoc tmp = env;
-    for (const auto &nm : names) {
-        tmp = extend(nm, VoidV(), tmp);
+static Expr parseBody(const vector<Syntax> &items, size_t start, Assoc &env, Scope *sc) {
+    vector<Expr> bodies = parseFromIndex(items, start, env, sc);
+    return bodies.size() == 1 ? bodies[0] : Expr(new Begin(bodies));
+}
+
+static void addName(vector<Name> &names, Name x) {
+    for (auto &nm : names) if (nm == x) return;
+    names.push_back(x);
+}
+
+// 扫描内部define: 直接位于body中的define (以及begin/if/cond内的define)
+static void scanDefines(const vector<Syntax> &items, size_t start, Assoc &env, Scope *sc,
+                        vector<Name> &out) {
+    for (size_t i = start; i < items.size(); ++i) {
+        auto l = asList(items[i]);
+        if (!l || l->stxs.empty()) continue;
+        Syntax expanded = expansionOf(l, env, sc);
+        if (expanded.get() != nullptr) { // 宏展开后可能是define
+            ExpansionDepth guard;
+            scanDefines(vector<Syntax>(1, expanded), 0, env, sc, out);
+            continue;
+        }
+        auto head = asSymbol(l->stxs[0]);
+        if (!head) continue;
+        Scope *headScope = sc;
+        Name op = lookupName(head->s, headScope);
+        if (isBound(op, env, headScope)) continue;
+        auto form = reservedNames().find(op);
+        if (form == reservedNames().end()) continue;
+        if (form->second == E_DEFINE && l->stxs.size() >= 2) {
+            Syntax target = l->stxs[1];
+            if (auto sig = asList(target)) {
+                if (sig->stxs.empty()) continue;
+                target = sig->stxs[0];
+            }
+            if (auto name = asSymbol(target)) addName(out, name->s);
+        } else if (form->second == E_BEGIN || form->second == E_IF) {
+            scanDefines(l->stxs, 1, env, sc, out);
+        } else if (form->second == E_COND) {
+            for (size_t j = 1; j < l->stxs.size(); ++j)
+                if (auto cl = asList(l->stxs[j])) scanDefines(cl->stxs, 0, env, sc, out);
+        }
+    }
+}
+
+// Opens the frame of a binding construct: `names` followed by the body's defines.
+static void enterBody(Scope &inner, const vector<Name> &names,
+                      const vector<Syntax> &items, size_t start, Assoc &env) {
+    inner.names = names;
+    vector<Name> defs;
+    scanDefines(items, start, env, &inner, defs);
+    for (auto &d : defs) addName(inner.names, d);
+}
+
+// Slots appended to the frame after its declared variables
+static vector<Name> bodyLocals(const Scope &inner, size_t declared) {
+    return vector<Name>(inner.names.begin() + declared, inner.names.end());
+}
+
+// Called once the body of a frame is parsed: every closure capturing one of
+// its variables that is assigned somewhere shares it through a Box.
+static void closeScope(Scope &sc) {
+    for (auto &b : sc.bindings) {
+        if (!b || !b->assigned) continue;
+        for (auto &c : b->captures) static_cast<Lambda*>(c.first.get())->captures[c.second].boxed = true;
+    }
+}
+
+// A lambda over items[start..]: its frame holds params and the body's
+// defines, its closure the variables of sc the body uses
+static Expr makeLambda(const vector<Name> &params, const vector<Syntax> &items, size_t start,
+                       Assoc &env, Scope *sc) {
+    Scope closure(nullptr);
+    closure.outer = sc;
+    Scope inner(&closure);
+    enterBody(inner, params, items, start, env);
+    Expr body = parseBody(items, start, env, &inner);
+    Expr lam(new Lambda(params, body, bodyLocals(inner, params.size()), closure.captures));
+    for (size_t i = 0; i < closure.captures.size(); ++i) closure.bindings[i]->captures.push_back({lam, i});
+    closeScope(inner);
+    return lam;
+}
+
+// A define inside a body assigns a slot of the innermost frame; defines the
+// scan did not see (unusual positions) get a fresh slot appended here.
+static Expr makeDefine(Name x, const Expr &rhs, Assoc &env, Scope *sc) {
+    if (rhs->e_type == E_LAMBDA) PROFILE_LABEL(static_cast<Lambda*>(rhs.get())->e.get(), x);
+    if (sc == nullptr) {
+        x = unalias(x);
+        if (GlobalEnv *globals = globalsOf(env)) globals->macros.erase(x);
+        return Expr(new Define(x, rhs, 0, 0, true, globalCell(x, env)));
+    }
+    size_t i = sc->names.size();
+    for (size_t k = sc->names.size(); k-- > 0;) {
+        if (sc->names[k] == x) {
+            i = k;
+            break;
+        }
+    }
+    if (i == sc->names.size()) sc->names.push_back(x);
+    sc->binding(i)->assigned = true;
+    return Expr(new Define(x, rhs, 0, int(i), false));
+}
+
+static bool isLiteral(const Expr &e) {
+    switch (e->e_type) {
+        case E_FIXNUM: case E_BIGNUM: case E_RATIONAL: case E_STRING:
+        case E_TRUE: case E_FALSE: case E_QUOTE:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Operands of a primitive node, nullptr for nodes that are not safe to fold
+static const vector<Expr> *foldableOperands(ExprBase *e, vector<Expr> &buf) {
+    switch (e->e_type) {
+        case E_NOT: case E_BOOLQ: case E_INTQ: case E_NULLQ: case E_PAIRQ:
+        case E_PROCQ: case E_SYMBOLQ: case E_LISTQ: case E_STRINGQ:
+            buf.push_back(static_cast<Unary*>(e)->rand);
+            return &buf;
+        case E_PLUS: case E_MINUS: case E_MUL: case E_DIV: case E_MODULO: case E_EXPT:
+        case E_LT: case E_LE: case E_EQ: case E_GE: case E_GT:
+            buf.push_back(static_cast<Binary*>(e)->rand1);
+            buf.push_back(static_cast<Binary*>(e)->rand2);
+            return &buf;
+        case E_PLUS_VAR: case E_MINUS_VAR: case E_MUL_VAR: case E_DIV_VAR:
+        case E_LT_VAR: case E_LE_VAR: case E_EQ_VAR: case E_GE_VAR: case E_GT_VAR:
+            return &static_cast<Variadic*>(e)->rands;
+        default: // cons/list分配新对象, display有副作用
+            return nullptr;
+    }
+}
+
+// Evaluates e now if it is a pure primitive on literals. Errors such as a
+// division by zero are left for run time, when the call is actually reached.
+static Expr foldConstant(const Expr &e) {
+    vector<Expr> buf;
+    const vector<Expr> *ops = foldableOperands(e.get(), buf);
+    if (ops == nullptr) return e;
+    for (auto &op : *ops) if (!isLiteral(op)) return e;
+
+    Value v(nullptr);
+    try {
+        Assoc env = empty();
+        v = e->eval(env);
+    } catch (const RuntimeError &) {
+        return e;
+    }
+    switch (v.type()) {
+        case V_INT:  return Expr(new Fixnum(v.fixnum()));
+        case V_BIGNUM: return Expr(new BignumExpr(static_cast<Bignum*>(v.get())->n));
+        case V_BOOL: return isFalse(v) ? Expr(new False()) : Expr(new True());
+        case V_RATIONAL: {
+            auto r = static_cast<Rational*>(v.get());
+            return Expr(new RationalNum(r->numerator, r->denominator));
+        }
+        default: return e;
     }
-    return tmp;
+}
+
+// Node for a call of primitive t with operands ps
+static Expr primitiveExpr(const string &op, ExprType t, const vector<Expr> &ps) {
+    switch (t) {
+        case E_PLUS:
+            if (ps.size() == 2) return Expr(new Plus(ps[0], ps[1]));
+            return Expr(new PlusVar(ps));
+        case E_MINUS:
+            if (ps.size() == 2) return Expr(new Minus(ps[0], ps[1]));
+            if (ps.empty()) throw RuntimeError("Wrong number of arguments for -");
+            return Expr(new MinusVar(ps));
+        case E_MUL:
+            if (ps.size() == 2) return Expr(new Mult(ps[0], ps[1]));
+            return Expr(new MultVar(ps));
+        case E_DIV:
+            if (ps.size() == 2) return Expr(new Div(ps[0], ps[1]));
+            if (ps.empty()) throw RuntimeError("Wrong number of arguments for /");
+            return Expr(new DivVar(ps));
+        case E_MODULO:
+            if (ps.size() != 2) throw RuntimeError("Wrong number of arguments for modulo");
+            return Expr(new Modulo(ps[0], ps[1]));
+        case E_EXPT:
+            if (ps.size() != 2) throw RuntimeError("Wrong number of arguments for expt");
+            return Expr(new Expt(ps[0], ps[1]));
+
+        case E_LT:
+            if (ps.size() < 2) throw RuntimeError("Wrong number of arguments for <");
+            if (ps.size() == 2) return Expr(new Less(ps[0], ps[1]));
+            return Expr(new LessVar(ps));
+        case E_LE:
+            if (ps.size() < 2) throw RuntimeError("Wrong number of arguments for <=");
+            if (ps.size() == 2) return Expr(new LessEq(ps[0], ps[1]));
+            return Expr(new LessEqVar(ps));
+        case E_EQ:
+            if (ps.size() < 2) throw RuntimeError("Wrong number of arguments for =");
+            if (ps.size() == 2) return Expr(new Equal(ps[0], ps[1]));
+            return Expr(new EqualVar(ps));
+        case E_GE:
+            if (ps.size() < 2) throw RuntimeError("Wrong number of arguments for >=");
+            if (ps.size() == 2) return Expr(new GreaterEq(ps[0], ps[1]));
+            return Expr(new GreaterEqVar(ps));
+        case E_GT:
+            if (ps.size() < 2) throw RuntimeError("Wrong number of arguments for >");
+            if (ps.size() == 2) return Expr(new Greater(ps[0], ps[1]));
+            return Expr(new GreaterVar(ps));
+
+        case E_LIST:
+            return Expr(new ListFunc(ps));
+        case E_CONS:
+            if (ps.size() != 2) throw RuntimeError("Wrong number of arguments for cons");
+            return Expr(new Cons(ps[0], ps[1]));
+        case E_CAR:
+            if (ps.size() != 1) throw RuntimeError("Wrong number of arguments for car");
+            return Expr(new Car(ps[0]));
+        case E_CDR:
+            if (ps.size() != 1) throw RuntimeError("Wrong number of arguments for cdr");
+            return Expr(new Cdr(ps[0]));
+        case E_SETCAR:
+            if (ps.size() != 2) throw RuntimeError("Wrong number of arguments for set-car!");
+            return Expr(new SetCar(ps[0], ps[1]));
+        case E_SETCDR:
+            if (ps.size() != 2) throw RuntimeError("Wrong number of arguments for set-cdr!");
+            return Expr(new SetCdr(ps[0], ps[1]));
+
+        case E_MAKE_VECTOR:
+            if (ps.size() != 1 && ps.size() != 2) throw RuntimeError("Wrong number of arguments for make-vector");
+            return Expr(new MakeVector(ps));
+        case E_VECTOR:
+            return Expr(new VectorFunc(ps));
+        case E_VECTOR_LENGTH:
+            if (ps.size() != 1) throw RuntimeError("Wrong number of arguments for vector-length");
+            return Expr(new VectorLength(ps[0]));
+        case E_VECTOR_REF:
+            if (ps.size() != 2) throw RuntimeError("Wrong number of arguments for vector-ref");
+            return Expr(new VectorRef(ps[0], ps[1]));
+        case E_VECTOR_SET:
+            if (ps.size() != 3) throw RuntimeError("Wrong number of arguments for vector-set!");
+            return Expr(new VectorSet(ps));
+        case E_VECTOR_TO_LIST:
+            if (ps.size() != 1) throw RuntimeError("Wrong number of arguments for vector->list");
+            return Expr(new VectorToList(ps[0]));
+        case E_LIST_TO_VECTOR:
+            if (ps.size() != 1) throw RuntimeError("Wrong number of arguments for list->vector");
+            return Expr(new ListToVector(ps[0]));
+
+        case E_MAKE_HASH_TABLE:
+            if (!ps.empty()) throw RuntimeError("Wrong number of arguments for make-hash-table");
+            return Expr(new MakeHashTable(ps));
+        case E_HASH_REF:
+            if (ps.size() != 2 && ps.size() != 3) throw RuntimeError("Wrong number of arguments for hash-ref");
+            return Expr(new HashRef(ps));
+        case E_HASH_SET:
+            if (ps.size() != 3) throw RuntimeError("Wrong number of arguments for hash-set!");
+            return Expr(new HashSet(ps));
+        case E_HASH_COUNT:
+            if (ps.size() != 1) throw RuntimeError("Wrong number of arguments for hash-count");
+            return Expr(new HashCount(ps[0]));
+
+        case E_AND:
+            return Expr(new AndVar(ps));
+        case E_OR:
+            return Expr(new OrVar(ps));
+        case E_NOT:
+            if (ps.size() != 1) throw RuntimeError("Wrong number of arguments for not");
+            return Expr(new Not(ps[0]));
+
+        case E_EQQ:
+            if (ps.size() != 2) throw RuntimeError("Wrong number of arguments for eq?");
+            return Expr(new IsEq(ps[0], ps[1]));
+        case E_BOOLQ:
+            if (ps.size() != 1) throw RuntimeError("Wrong number of arguments for boolean?");
+            return Expr(new IsBoolean(ps[0]));
+        case E_INTQ:
+            if (ps.size() != 1) throw RuntimeError("Wrong number of arguments for number?");
+            return Expr(new IsFixnum(ps[0]));
+        case E_NULLQ:
+            if (ps.size() != 1) throw RuntimeError("Wrong number of arguments for null?");
+            return Expr(new IsNull(ps[0]));
+        case E_PAIRQ:
+            if (ps.size() != 1) throw RuntimeError("Wrong number of arguments for pair?");
+            return Expr(new IsPair(ps[0]));
+        case E_PROCQ:
+            if (ps.size() != 1) throw RuntimeError("Wrong number of arguments for procedure?");
+            return Expr(new IsProcedure(ps[0]));
+        case E_SYMBOLQ:
+            if (ps.size() != 1) throw RuntimeError("Wrong number of arguments for symbol?");
+            return Expr(new IsSymbol(ps[0]));
+        case E_LISTQ:
+            if (ps.size() != 1) throw RuntimeError("Wrong number of arguments for list?");
+            return Expr(new IsList(ps[0]));
+        case E_STRINGQ:
+            if (ps.size() != 1) throw RuntimeError("Wrong number of arguments for string?");
+            return Expr(new IsString(ps[0]));
+        case E_VECTORQ:
+            if (ps.size() != 1) throw RuntimeError("Wrong number of arguments for vector?");
+            return Expr(new IsVector(ps[0]));
+
+        case E_DISPLAY:
+            if (ps.size() != 1) throw RuntimeError("Wrong number of arguments for display");
+            return Expr(new Display(ps[0]));
+
+        case E_FUTURE:
+            if (ps.size() != 1) throw RuntimeError("Wrong number of arguments for future");
+            return Expr(new MakeFuture(ps[0]));
+        case E_TOUCH:
+            if (ps.size() != 1) throw RuntimeError("Wrong number of arguments for touch");
+            return Expr(new Touch(ps[0]));
+        case E_PARALLEL_MAP:
+            if (ps.size() != 2) throw RuntimeError("Wrong number of arguments for parallel-map");
+            return Expr(new ParallelMap(ps[0], ps[1]));
+
+        case E_RUNTIME_STATS:
+            if (!ps.empty()) throw RuntimeError("Wrong number of arguments for runtime-stats");
+            return Expr(new RuntimeStats(ps));
+
+        case E_VOID:
+            if (!ps.empty()) throw RuntimeError("Wrong number of arguments for void");
+            return Expr(new MakeVoid());
+        case E_EXIT:
+            if (!ps.empty()) throw RuntimeError("Wrong number of arguments for exit");
+            return Expr(new Exit());
+    }
+    throw RuntimeError("Unknown primitive: " + op);
 }
 
 Expr List::parse(Assoc &env) {
+    return parseList(this, env, nullptr);
+}
+
+static Expr parseList(List *l, Assoc &env, Scope *sc) {
+    vector<Syntax> &stxs = l->stxs;
+
     if (stxs.empty()) {
         return Expr(new Quote(Syntax(new List())));
     }
 
-    auto symHead = dynamic_cast<SymbolSyntax*>(stxs[0].get());
+    auto symHead = asSymbol(stxs[0]);
     if (!symHead) {
-        vector<Expr> args = parseFromIndex(stxs, 1, env);
-        return Expr(new Apply(parseSyntax(stxs[0], env), args)); // 操作符=第一个元素的parsing
+        vector<Expr> args = parseFromIndex(stxs, 1, env, sc);
+        return Expr(new Apply(parseSyntax(stxs[0], env, sc), args)); // 操作符=第一个元素的parsing
+    }
+
+    Syntax expanded = expansionOf(l, env, sc);
+    if (expanded.get() != nullptr) {
+        ExpansionDepth guard;
+        return parseSyntax(expanded, env, sc);
     }
 
-    const string op = symHead->s;
+    Scope *opScope = sc;
+    const Name op = lookupName(symHead->s, opScope);
 
-    if (find(op, env).get() != nullptr) {
-        vector<Expr> args = parseFromIndex(stxs, 1, env);
-        return Expr(new Apply(Expr(new Var(op)), args));
+    if (isBound(op, env, opScope)) {
+        vector<Expr> args = parseFromIndex(stxs, 1, env, sc);
+        return Expr(new Apply(makeVar(symHead->s, env, sc), args));
     }
 
-    if (primitives.count(op)) {
-        vector<Expr> ps = parseFromIndex(stxs, 1, env);
-        ExprType t = primitives[op];
-
-        switch (t) {
-            case E_PLUS:
-                if (ps.size() == 2) return Expr(new Plus(ps[0], ps[1]));
-                return Expr(new PlusVar(ps));
-            case E_MINUS:
-                if (ps.size() == 2) return Expr(new Minus(ps[0], ps[1]));
-                if (ps.empty()) throw RuntimeError("Wrong number of arguments for -");
-                return Expr(new MinusVar(ps));
-            case E_MUL:
-                if (ps.size() == 2) return Expr(new Mult(ps[0], ps[1]));
-                return Expr(new MultVar(ps));
-            case E_DIV:
-                if (ps.size() == 2) return Expr(new Div(ps[0], ps[1]));
-                if (ps.empty()) throw RuntimeError("Wrong number of arguments for /");
-                return Expr(new DivVar(ps));
-            case E_MODULO:
-                if (ps.size() != 2) throw RuntimeError("Wrong number of arguments for modulo");
-                return Expr(new Modulo(ps[0], ps[1]));
-            case E_EXPT:
-                if (ps.size() != 2) throw RuntimeError("Wrong number of arguments for expt");
-                return Expr(new Expt(ps[0], ps[1]));
-
-            case E_LT:
-                if (ps.size() < 2) throw RuntimeError("Wrong number of arguments for <");
-                if (ps.size() == 2) return Expr(new Less(ps[0], ps[1]));
-                return Expr(new LessVar(ps));
-            case E_LE:
-                if (ps.size() < 2) throw RuntimeError("Wrong number of arguments for <=");
-                if (ps.size() == 2) return Expr(new LessEq(ps[0], ps[1]));
-                return Expr(new LessEqVar(ps));
-            case E_EQ:
-                if (ps.size() < 2) throw RuntimeError("Wrong number of arguments for =");
-                if (ps.size() == 2) return Expr(new Equal(ps[0], ps[1]));
-                return Expr(new EqualVar(ps));
-            case E_GE:
-                if (ps.size() < 2) throw RuntimeError("Wrong number of arguments for >=");
-                if (ps.size() == 2) return Expr(new GreaterEq(ps[0], ps[1]));
-                return Expr(new GreaterEqVar(ps));
-            case E_GT:
-                if (ps.size() < 2) throw RuntimeError("Wrong number of arguments for >");
-                if (ps.size() == 2) return Expr(new Greater(ps[0], ps[1]));
-                return Expr(new GreaterVar(ps));
-
-            case E_LIST:
-                return Expr(new ListFunc(ps));
-            case E_CONS:
-                if (ps.size() != 2) throw RuntimeError("Wrong number of arguments for cons");
-                return Expr(new Cons(ps[0], ps[1]));
-            case E_CAR:
-                if (ps.size() != 1) throw RuntimeError("Wrong number of arguments for car");
-                return Expr(new Car(ps[0]));
-            case E_CDR:
-                if (ps.size() != 1) throw RuntimeError("Wrong number of arguments for cdr");
-                return Expr(new Cdr(ps[0]));
-            case E_SETCAR:
-                if (ps.size() != 2) throw RuntimeError("Wrong number of arguments for set-car!");
-                return Expr(new SetCar(ps[0], ps[1]));
-            case E_SETCDR:
-                if (ps.size() != 2) throw RuntimeError("Wrong number of arguments for set-cdr!");
-                return Expr(new SetCdr(ps[0], ps[1]));
-
-            case E_AND:
-                return Expr(new AndVar(ps));
-            case E_OR:
-                return Expr(new OrVar(ps));
-            case E_NOT:
-                if (ps.size() != 1) throw RuntimeError("Wrong number of arguments for not");
-                return Expr(new Not(ps[0]));
-
-            case E_EQQ:
-                if (ps.size() != 2) throw RuntimeError("Wrong number of arguments for eq?");
-                return Expr(new IsEq(ps[0], ps[1]));
-            case E_BOOLQ:
-                if (ps.size() != 1) throw RuntimeError("Wrong number of arguments for boolean?");
-                return Expr(new IsBoolean(ps[0]));
-            case E_INTQ:
-                if (ps.size() != 1) throw RuntimeError("Wrong number of arguments for number?");
-                return Expr(new IsFixnum(ps[0]));
-            case E_NULLQ:
-                if (ps.size() != 1) throw RuntimeError("Wrong number of arguments for null?");
-                return Expr(new IsNull(ps[0]));
-            case E_PAIRQ:
-                if (ps.size() != 1) throw RuntimeError("Wrong number of arguments for pair?");
-                return Expr(new IsPair(ps[0]));
-            case E_PROCQ:
-                if (ps.size() != 1) throw RuntimeError("Wrong number of arguments for procedure?");
-                return Expr(new IsProcedure(ps[0]));
-            case E_SYMBOLQ:
-                if (ps.size() != 1) throw RuntimeError("Wrong number of arguments for symbol?");
-                return Expr(new IsSymbol(ps[0]));
-            case E_LISTQ:
-                if (ps.size() != 1) throw RuntimeError("Wrong number of arguments for list?");
-                return Expr(new IsList(ps[0]));
-            case E_STRINGQ:
-                if (ps.size() != 1) throw RuntimeError("Wrong number of arguments for string?");
-                return Expr(new IsString(ps[0]));
-
-            case E_DISPLAY:
-                if (ps.size() != 1) throw RuntimeError("Wrong number of arguments for display");
-                return Expr(new Display(ps[0]));
-
-            case E_VOID:
-                if (!ps.empty()) throw RuntimeError("Wrong number of arguments for void");
-                return Expr(new MakeVoid());
-            case E_EXIT:
-                if (!ps.empty()) throw RuntimeError("Wrong number of arguments for exit");
-                return Expr(new Exit());
-        }
-        throw RuntimeError("Unknown primitive: " + op);
+    auto prim = primitiveNames().find(op);
+    if (prim != primitiveNames().end()) {
+        vector<Expr> ps = parseFromIndex(stxs, 1, env, sc);
+        return foldConstant(primitiveExpr(op->s, prim->second, ps));
     }
 
-    if (reserved_words.count(op)) {
-        switch (reserved_words[op]) {
+    auto reserved = reservedNames().find(op);
+    if (reserved != reservedNames().end()) {
+        switch (reserved->second) {
             case E_BEGIN: {
-                vector<Expr> seq = parseFromIndex(stxs, 1, env);
+                vector<Expr> seq = parseFromIndex(stxs, 1, env, sc);
                 return Expr(new Begin(seq));
             }
             case E_QUOTE: {
@@ -230,147 +644,168 @@ Expr List::parse(Assoc &env) {
             }
             case E_IF: {
                 if (stxs.size() != 4) throw RuntimeError("Wrong number of arguments for if");
-                Expr c = parseSyntax(stxs[1], env);
-                Expr t = parseSyntax(stxs[2], env);
-                Expr f = parseSyntax(stxs[3], env);
+                Expr c = parseSyntax(stxs[1], env, sc);
+                Expr t = parseSyntax(stxs[2], env, sc);
+                Expr f = parseSyntax(stxs[3], env, sc);
+                if (isLiteral(c) && c->e_type != E_QUOTE) { // 条件为常量: 只保留被选中的分支 ('#f也是假, 不在此处理)
+                    Expr taken = c->e_type == E_FALSE ? f : t;
+                    if (taken->e_type != E_DEFINE) return taken;
+                }
                 return Expr(new If(c, t, f));
             }
             case E_COND: {
                 if (stxs.size() < 2) throw RuntimeError("No clauses for cond");
                 vector<vector<Expr>> clauses;
                 for (size_t i = 1; i < stxs.size(); ++i) {
-                    auto sub = dynamic_cast<List*>(stxs[i].get());
+                    auto sub = asList(stxs[i]);
                     if (!sub) throw RuntimeError("Wrong clause in cond");
                     vector<Expr> one;
                     one.reserve(sub->stxs.size());
-                    for (auto &s : sub->stxs) one.push_back(parseSyntax(s, env));
+                    for (auto &s : sub->stxs) one.push_back(parseSyntax(s, env, sc));
                     clauses.push_back(one);
                 }
                 return Expr(new Cond(clauses));
             }
             case E_LAMBDA: {
                 if (stxs.size() < 3) throw RuntimeError("Wrong number of arguments for lambda");
-                auto paramsList = dynamic_cast<List*>(stxs[1].get());
+                auto paramsList = asList(stxs[1]);
                 if (!paramsList) throw RuntimeError("Invalid parameter list in lambda");
 
-                vector<string> params;
+                vector<Name> params;
                 params.reserve(paramsList->stxs.size());
                 for (auto &p : paramsList->stxs) {
-                    auto s = dynamic_cast<SymbolSyntax*>(p.get());
+                    auto s = asSymbol(p);
                     if (!s) throw RuntimeError("Invalid parameter");
                     params.push_back(s->s);
                 }
 
                 // 先绑定
-                Assoc bodyEnv = extendWithPlaceholders(params, env);
-                vector<Expr> bodies = parseFromIndex(stxs, 2, bodyEnv);
-                Expr body = bodies.size() == 1 ? bodies[0] : Expr(new Begin(bodies));
-                return Expr(new Lambda(params, body));
+                return makeLambda(params, stxs, 2, env, sc);
             }
             case E_DEFINE: {
                 if (stxs.size() < 3) throw RuntimeError("Wrong number of arguments for define");
 
-                if (auto sig = dynamic_cast<List*>(stxs[1].get())) {
+                if (auto sig = asList(stxs[1])) {
                     if (sig->stxs.empty()) throw RuntimeError("Invalid function signature in define");
-                    auto nameSym = dynamic_cast<SymbolSyntax*>(sig->stxs[0].get());
+                    auto nameSym = asSymbol(sig->stxs[0]);
                     if (!nameSym) throw RuntimeError("Invalid function name in define");
 
-                    string fname = nameSym->s;
-                    vector<string> params;
+                    Name fname = sc ? nameSym->s : unalias(nameSym->s);
+                    vector<Name> params;
                     for (size_t i = 1; i < sig->stxs.size(); ++i) {
-                        auto s = dynamic_cast<SymbolSyntax*>(sig->stxs[i].get());
+                        auto s = asSymbol(sig->stxs[i]);
                         if (!s) throw RuntimeError("Invalid parameter in define");
                         params.push_back(s->s);
                     }
 
-                    // 先绑定
-                    Assoc bodyEnv = extendWithPlaceholders(params, env);
-                    bodyEnv = extend(fname, VoidV(), bodyEnv);
-
-                    vector<Expr> bodies = parseFromIndex(stxs, 2, bodyEnv);
-                    Expr body = bodies.size() == 1 ? bodies[0] : Expr(new Begin(bodies));
-                    Expr lam = Expr(new Lambda(params, body));
-                    return Expr(new Define(fname, lam));
+                    // 先绑定; 顶层函数名在函数体内视为已绑定的全局变量
+                    Assoc bodyEnv = sc ? env : extend(fname, VoidV(), env);
+                    Expr lam = makeLambda(params, stxs, 2, bodyEnv, sc);
+                    return makeDefine(fname, lam, env, sc);
                 }
 
                 // 定义变量
-                auto nameSym = dynamic_cast<SymbolSyntax*>(stxs[1].get());
+                auto nameSym = asSymbol(stxs[1]);
                 if (!nameSym) throw RuntimeError("Invalid variable name in define");
 
-                vector<Expr> rhsParts = parseFromIndex(stxs, 2, env);
-                Expr rhs = rhsParts.size() == 1 ? rhsParts[0] : Expr(new Begin(rhsParts));
-                return Expr(new Define(nameSym->s, rhs));
+                Expr rhs = parseBody(stxs, 2, env, sc);
+                return makeDefine(nameSym->s, rhs, env, sc);
+            }
+            case E_DEFINE_SYNTAX: {
+                if (stxs.size() != 3) throw RuntimeError("Wrong number of arguments for define-syntax");
+                auto nameSym = asSymbol(stxs[1]);
+                if (!nameSym) throw RuntimeError("Invalid macro name in define-syntax");
+                GlobalEnv *globals = globalsOf(env);
+                if (sc != nullptr || globals == nullptr) throw RuntimeError("define-syntax is only allowed at top level");
+                // 立即生效: 同一个顶层form中后面的部分就可以使用
+                Name x = unalias(nameSym->s);
+                globals->macros[x] = parseSyntaxRules(stxs[2]);
+                return Expr(new DefineSyntax(x));
             }
             case E_LET: {
                 if (stxs.size() < 3) throw RuntimeError("Wrong number of arguments for let");
-                auto binds = dynamic_cast<List*>(stxs[1].get());
+                auto binds = asList(stxs[1]);
                 if (!binds) throw RuntimeError("Invalid binding list in let");
 
-                vector<std::pair<string, Expr>> pairs;
-                vector<string> names;
+                vector<std::pair<Name, Expr>> pairs;
+                vector<Name> names;
                 pairs.reserve(binds->stxs.size());
                 names.reserve(binds->stxs.size());
 
                 // 在外部环境里parse rhs
                 for (auto &b : binds->stxs) {
-                    auto kv = dynamic_cast<List*>(b.get());
+                    auto kv = asList(b);
                     if (!kv || kv->stxs.size() != 2) throw RuntimeError("Wrong binding in let");
-                    auto keySym = dynamic_cast<SymbolSyntax*>(kv->stxs[0].get());
+                    auto keySym = asSymbol(kv->stxs[0]);
                     if (!keySym) throw RuntimeError("Invalid let variable");
                     names.push_back(keySym->s);
-                    pairs.push_back({keySym->s, parseSyntax(kv->stxs[1], env)});
+                    pairs.push_back({keySym->s, parseSyntax(kv->stxs[1], env, sc)});
+                    if (pairs.back().second->e_type == E_LAMBDA)
+                        PROFILE_LABEL(static_cast<Lambda*>(pairs.back().second.get())->e.get(), keySym->s);
                 }
 
                 // 占位符绑定
-                Assoc bodyEnv = extendWithPlaceholders(names, env);
-                vector<Expr> bodies = parseFromIndex(stxs, 2, bodyEnv);
-                Expr body = bodies.size() == 1 ? bodies[0] : Expr(new Begin(bodies));
-                return Expr(new Let(pairs, body));
+                Scope inner(sc);
+                enterBody(inner, names, stxs, 2, env);
+                Expr body = parseBody(stxs, 2, env, &inner);
+                Expr let(new Let(pairs, body, bodyLocals(inner, names.size())));
+                closeScope(inner);
+                return let;
             }
             case E_LETREC: {
                 if (stxs.size() < 3) throw RuntimeError("Wrong number of arguments for letrec");
-                auto binds = dynamic_cast<List*>(stxs[1].get());
+                auto binds = asList(stxs[1]);
                 if (!binds) throw RuntimeError("Invalid binding list in letrec");
 
-                vector<std::pair<string, Expr>> pairs;
-                vector<string> names;
+                vector<std::pair<Name, Expr>> pairs;
+                vector<Name> names;
                 pairs.reserve(binds->stxs.size());
                 names.reserve(binds->stxs.size());
 
                 // 环境(占位符)
-                Assoc preEnv = env;
                 for (auto &b : binds->stxs) {
-                    auto kv = dynamic_cast<List*>(b.get());
+                    auto kv = asList(b);
                     if (!kv || kv->stxs.size() != 2) throw RuntimeError("Wrong binding in letrec");
-                    auto keySym = dynamic_cast<SymbolSyntax*>(kv->stxs[0].get());
+                    auto keySym = asSymbol(kv->stxs[0]);
                     if (!keySym) throw RuntimeError("Invalid letrec variable");
                     names.push_back(keySym->s);
-                    preEnv = extend(keySym->s, VoidV(), preEnv);
                 }
+                Scope inner(sc);
+                enterBody(inner, names, stxs, 2, env);
+                for (size_t i = 0; i < names.size(); ++i) inner.binding(i)->assigned = true; // 闭包创建之后才赋值
 
                 // 在占位符环境中parse rhs
                 for (size_t i = 0; i < binds->stxs.size(); ++i) {
-                    auto kv = dynamic_cast<List*>(binds->stxs[i].get());
-                    auto keySym = dynamic_cast<SymbolSyntax*>(kv->stxs[0].get());
-                    pairs.push_back({keySym->s, parseSyntax(kv->stxs[1], preEnv)});
+                    auto kv = asList(binds->stxs[i]);
+                    auto keySym = asSymbol(kv->stxs[0]);
+                    pairs.push_back({keySym->s, parseSyntax(kv->stxs[1], env, &inner)});
+                    if (pairs.back().second->e_type == E_LAMBDA)
+                        PROFILE_LABEL(static_cast<Lambda*>(pairs.back().second.get())->e.get(), keySym->s);
                 }
 
                 // 在占位符符环境中parse body
-                vector<Expr> bodies = parseFromIndex(stxs, 2, preEnv);
-                Expr body = bodies.size() == 1 ? bodies[0] : Expr(new Begin(bodies));
-                return Expr(new Letrec(pairs, body));
+                Expr body = parseBody(stxs, 2, env, &inner);
+                Expr letrec(new Letrec(pairs, body, bodyLocals(inner, names.size())));
+                closeScope(inner);
+                return letrec;
             }
             case E_SET: {
                 if (stxs.size() != 3) throw RuntimeError("Wrong number of arguments for set!");
-                auto nameSym = dynamic_cast<SymbolSyntax*>(stxs[1].get());
+                auto nameSym = asSymbol(stxs[1]);
                 if (!nameSym) throw RuntimeError("Invalid variable name in set!");
-                Expr rhs = parseSyntax(stxs[2], env);
-                return Expr(new Set(nameSym->s, rhs));
+                Expr rhs = parseSyntax(stxs[2], env, sc);
+                int depth, slot;
+                if (auto b = resolve(nameSym->s, sc, depth, slot)) {
+                    b->assigned = true;
+                    return Expr(new Set(nameSym->s, rhs, depth, slot, false));
+                }
+                Name x = unalias(nameSym->s);
+                return Expr(new Set(x, rhs, depth, slot, true, globalCell(x, env)));
             }
         }
-        throw RuntimeError("Unknown reserved word: " + op);
+        throw RuntimeError("Unknown reserved word: " + op->s);
     }
 
-    vector<Expr> args = parseFromIndex(stxs, 1, env);
-    return Expr(new Apply(Expr(new Var(op)), args));
+    vector<Expr> args = parseFromIndex(stxs, 1, env, sc);
+    return Expr(new Apply(makeVar(symHead->s, env, sc), args));
 }
\ No newline at end of file
@@ -0,0 +1,31 @@
+/**
+ * @file pool.cpp
+ * @brief Chunk allocation for the size-class pools
+ */
+
+#include "pool.hpp"
+
+namespace {
+
+const size_t POOL_CHUNK_SIZE = 64 * 1024;
+
+} // namespace
+
+// 零初始化, 不依赖静态构造顺序: 静态Value在其他文件的初始化/析构中也会用到
+thread_local PoolCell *poolFreeLists[POOL_CLASSES];
+
+void *poolRefill(size_t sizeClass) {
+    size_t cellSize = (sizeClass + 1) * POOL_GRAIN;
+    size_t count = POOL_CHUNK_SIZE / cellSize;
+    char *chunk = static_cast<char*>(::operator new(count * cellSize));
+
+    // 第一个单元直接返回, 其余按地址顺序串成空闲链表
+    PoolCell *head = nullptr;
+    for (size_t i = count; i-- > 1;) {
+        PoolCell *cell = reinterpret_cast<PoolCell*>(chunk + i * cellSize);
+        cell->next = head;
+        head = cell;
+    }
+    poolFreeLists[sizeClass] = head;
+    return chunk;
+}
@@ -0,0 +1,60 @@
+#ifndef POOL_HPP
+#define POOL_HPP
+
+/**
+ * @file pool.hpp
+ * @brief Size-class pool allocator for small heap objects
+ *
+ * Pairs, frames, closures and the other small objects are allocated and
+ * freed at a very high rate. Instead of going through malloc for each one,
+ * objects up to POOL_MAX_SIZE bytes are rounded up to a multiple of
+ * POOL_GRAIN and carved out of large chunks, one free list per size class.
+ * Freed cells go back on their class's free list; chunks are never returned.
+ *
+ * Consecutive allocations of one class come out of the same chunk, so a list
+ * built with cons occupies contiguous memory. GcObject routes its operator
+ * new/delete here, so the allocator sits below both reference counting and
+ * the collector.
+ */
+
+#include <cstddef>
+#include <new>
+
+const size_t POOL_GRAIN = 16;
+const size_t POOL_MAX_SIZE = 256;
+const size_t POOL_CLASSES = POOL_MAX_SIZE / POOL_GRAIN;
+
+struct PoolCell {
+    PoolCell *next;
+};
+
+extern thread_local PoolCell *poolFreeLists[POOL_CLASSES];   ///< Per thread, like the collector's registry
+
+void *poolRefill(size_t sizeClass);   ///< Carves a new chunk for the class and allocates from it
+
+inline size_t poolSizeClass(size_t n) {
+    return (n - 1) / POOL_GRAIN;
+}
+
+inline void *poolAlloc(size_t n) {
+    if (n > POOL_MAX_SIZE) return ::operator new(n);
+    size_t c = poolSizeClass(n);
+    PoolCell *cell = poolFreeLists[c];
+    if (cell == nullptr) return poolRefill(c);
+    poolFreeLists[c] = cell->next;
+    return cell;
+}
+
+/// n must be the size that was passed to poolAlloc
+inline void poolFree(void *p, size_t n) {
+    if (n > POOL_MAX_SIZE) {
+        ::operator delete(p);
+        return;
+    }
+    PoolCell *cell = static_cast<PoolCell*>(p);
+    size_t c = poolSizeClass(n);
+    cell->next = poolFreeLists[c];
+    poolFreeLists[c] = cell;
+}
+
+#endif // POOL_HPP
@@ -0,0 +1,263 @@
+/**
+ * @file profile.cpp
+ * @brief Shadow call stack, call tree and report of the profiler
+ *
+ * Every procedure gets an entry the first time it is called, keyed by its
+ * body. The entry keeps the body alive, so the address cannot be reused by
+ * another lambda while the process runs. Calls are also recorded in a call
+ * tree: a node per distinct path of procedures from the top level, holding
+ * the exclusive time spent there, from which the folded stacks are written.
+ *
+ * Recursive calls count their time once towards the inclusive time of the
+ * procedure: it is added when the outermost active call ends.
+ */
+
+#include "profile.hpp"
+
+#ifdef SCHEME_PROFILE
+
+#include "expr.hpp"
+#include "value.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include <unordered_map>
+#include <vector>
+
+extern const std::map<std::string, ExprType> primitives;
+extern const std::map<std::string, ExprType> reserved_words;
+
+namespace profile {
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+const size_t TOP = 0;   // 调用树的根和过程表的第0项: 顶层代码
+
+struct ProcStats {
+    Expr body;            // 保持函数体存活, 地址不会被别的lambda复用
+    std::string name;
+    uint64_t calls = 0;
+    uint64_t allocations = 0;
+    uint64_t inclusive = 0, exclusive = 0;   // 纳秒
+    int active = 0;       // 正在进行的调用数, 递归时大于1
+};
+
+struct TreeNode {
+    size_t proc;
+    size_t parent;
+    uint64_t self = 0;    // 纳秒
+    std::unordered_map<size_t, size_t> children;
+    TreeNode(size_t proc, size_t parent) : proc(proc), parent(parent) {}
+};
+
+struct Frame {
+    size_t proc;
+    size_t node;
+    Clock::time_point start;
+    uint64_t children;    // 被调用者花费的纳秒
+};
+
+struct State {
+    std::vector<ProcStats> procs;
+    std::unordered_map<const ExprBase*, size_t> ids;
+    std::unordered_map<const ExprBase*, Name> labels;
+    std::vector<TreeNode> tree;
+    std::vector<Frame> stack;
+    uint64_t nodes[E_GT_VAR + 1] = {};
+    uint64_t topAllocations = 0;
+    Clock::time_point started = Clock::now();
+
+    State() {
+        procs.emplace_back();
+        procs[TOP].name = "<toplevel>";
+        tree.emplace_back(TOP, TOP);
+    }
+};
+
+// 从不释放: 静态对象析构时仍可能分配或释放对象. 只统计本线程的调用
+State &state() {
+    static thread_local State *s = new State();
+    return *s;
+}
+
+std::string anonymousName(Procedure *proc) {
+    std::string s = "(lambda (";
+    for (size_t i = 0; i < proc->arity; ++i) {
+        if (i > 0) s += ' ';
+        s += (*proc->frame)[i]->s;
+    }
+    return s + "))";
+}
+
+size_t procId(Procedure *proc) {
+    State &s = state();
+    const ExprBase *body = proc->e.get();
+    auto it = s.ids.find(body);
+    if (it != s.ids.end()) return it->second;
+    size_t id = s.procs.size();
+    s.procs.emplace_back();
+    ProcStats &p = s.procs.back();
+    p.body = proc->e;
+    auto l = s.labels.find(body);
+    p.name = l != s.labels.end() ? l->second->s : anonymousName(proc);
+    s.ids.emplace(body, id);
+    return id;
+}
+
+uint64_t nanos(Clock::duration d) {
+    return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(d).count());
+}
+
+void leave() {
+    State &s = state();
+    Frame f = s.stack.back();
+    s.stack.pop_back();
+    uint64_t elapsed = nanos(Clock::now() - f.start);
+    uint64_t self = elapsed >= f.children ? elapsed - f.children : 0;
+    ProcStats &p = s.procs[f.proc];
+    if (--p.active == 0) p.inclusive += elapsed;
+    p.exclusive += self;
+    s.tree[f.node].self += self;
+    if (!s.stack.empty()) s.stack.back().children += elapsed;
+}
+
+std::string exprTypeName(ExprType t) {
+    static const std::vector<std::string> names = [] {
+        std::vector<std::string> n(E_GT_VAR + 1);
+        for (auto &kv : primitives) n[kv.second] = kv.first;
+        for (auto &kv : reserved_words) n[kv.second] = kv.first;
+        n[E_FIXNUM] = "<fixnum>";
+        n[E_BIGNUM] = "<bignum>";
+        n[E_RATIONAL] = "<rational>";
+        n[E_STRING] = "<string>";
+        n[E_TRUE] = "#t";
+        n[E_FALSE] = "#f";
+        n[E_VAR] = "<variable>";
+        n[E_APPLY] = "<call>";
+        n[E_PLUS_VAR] = "+ (variadic)";
+        n[E_MINUS_VAR] = "- (variadic)";
+        n[E_MUL_VAR] = "* (variadic)";
+        n[E_DIV_VAR] = "/ (variadic)";
+        n[E_LT_VAR] = "< (variadic)";
+        n[E_LE_VAR] = "<= (variadic)";
+        n[E_EQ_VAR] = "= (variadic)";
+        n[E_GE_VAR] = ">= (variadic)";
+        n[E_GT_VAR] = "> (variadic)";
+        return n;
+    }();
+    return names[t];
+}
+
+double millis(uint64_t ns) {
+    return double(ns) / 1e6;
+}
+
+void foldedPaths(const State &s, size_t node, std::string path, std::ostream &out) {
+    const TreeNode &n = s.tree[node];
+    path += s.procs[n.proc].name;
+    if (n.self >= 1000) out << path << ' ' << n.self / 1000 << '\n';
+    for (auto &kv : n.children) foldedPaths(s, kv.second, path + ";", out);
+}
+
+} // namespace
+
+void enter(Procedure *proc) {
+    State &s = state();
+    size_t id = procId(proc);
+    ProcStats &p = s.procs[id];
+    ++p.calls;
+    ++p.active;
+
+    size_t parent = s.stack.empty() ? TOP : s.stack.back().node;
+    auto it = s.tree[parent].children.find(id);
+    size_t node;
+    if (it != s.tree[parent].children.end()) {
+        node = it->second;
+    } else {
+        node = s.tree.size();
+        s.tree[parent].children.emplace(id, node);
+        s.tree.emplace_back(id, parent);
+    }
+    s.stack.push_back(Frame{id, node, Clock::now(), 0});
+}
+
+void tailCall(Procedure *proc) {
+    if (!state().stack.empty()) leave();
+    enter(proc);
+}
+
+size_t depth() {
+    return state().stack.size();
+}
+
+void unwind(size_t d) {
+    while (state().stack.size() > d) leave();
+}
+
+void node(ExprType t) {
+    ++state().nodes[t];
+}
+
+void allocation() {
+    State &s = state();
+    if (s.stack.empty()) ++s.topAllocations;
+    else ++s.procs[s.stack.back().proc].allocations;
+}
+
+void label(const ExprBase *body, Name name) {
+    state().labels[body] = name;
+}
+
+void report(std::ostream &os) {
+    State &s = state();
+    unwind(0);
+    uint64_t total = nanos(Clock::now() - s.started);
+    uint64_t inProcs = 0;
+    for (size_t i = 1; i < s.procs.size(); ++i) inProcs += s.procs[i].exclusive;
+    s.procs[TOP].calls = 1;
+    s.procs[TOP].allocations = s.topAllocations;
+    s.procs[TOP].inclusive = total;
+    s.procs[TOP].exclusive = total >= inProcs ? total - inProcs : 0;
+
+    std::vector<size_t> order;
+    for (size_t i = 0; i < s.procs.size(); ++i) order.push_back(i);
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        return s.procs[a].exclusive > s.procs[b].exclusive;
+    });
+
+    os << "\n--- profile: procedures, by exclusive time ---\n"
+       << std::setw(12) << "calls" << std::setw(12) << "incl ms" << std::setw(12) << "excl ms"
+       << std::setw(12) << "allocs" << "  name\n";
+    os << std::fixed << std::setprecision(2);
+    for (size_t i : order) {
+        const ProcStats &p = s.procs[i];
+        os << std::setw(12) << p.calls << std::setw(12) << millis(p.inclusive)
+           << std::setw(12) << millis(p.exclusive) << std::setw(12) << p.allocations
+           << "  " << p.name << '\n';
+    }
+
+    os << "--- profile: evaluated nodes (tree walker) ---\n";
+    std::vector<size_t> types;
+    for (size_t t = 0; t <= E_GT_VAR; ++t) if (s.nodes[t] != 0) types.push_back(t);
+    std::sort(types.begin(), types.end(), [&](size_t a, size_t b) { return s.nodes[a] > s.nodes[b]; });
+    for (size_t t : types) os << std::setw(12) << s.nodes[t] << "  " << exprTypeName(ExprType(t)) << '\n';
+    os.unsetf(std::ios::floatfield);
+}
+
+bool writeFolded(const std::string &path) {
+    State &s = state();
+    unwind(0);
+    std::ofstream out(path);
+    if (!out) return false;
+    foldedPaths(s, TOP, "", out);
+    return bool(out.flush());
+}
+
+} // namespace profile
+
+#endif // SCHEME_PROFILE
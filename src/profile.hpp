@@ -0,0 +1,85 @@
+#ifndef PROFILE_HPP
+#define PROFILE_HPP
+
+/**
+ * @file profile.hpp
+ * @brief Counting profiler for Scheme procedures and Expr node types
+ *
+ * Built only when the project is configured with -DSCHEME_PROFILE=ON; in a
+ * normal build every PROFILE_* hook expands to nothing.
+ *
+ * The evaluator and the VM report every procedure call they make, and the
+ * profiler keeps a shadow call stack of them. It records, per procedure,
+ * the number of calls, the inclusive and exclusive time, and the managed
+ * objects allocated while the procedure itself was running. A tail call
+ * replaces the caller on the shadow stack, just as it replaces it at run
+ * time. It also counts how often each ExprType is evaluated by the tree
+ * walker.
+ *
+ * A procedure is named after the define or let/letrec variable its lambda
+ * was bound to, otherwise it is shown as (lambda (params)). All closures of
+ * one lambda are counted together.
+ *
+ * The report goes to stderr when the interpreter exits. The call tree can
+ * also be written as folded stacks (the input of flamegraph.pl), weighted by
+ * exclusive microseconds.
+ */
+
+#include "Def.hpp"
+#include <cstddef>
+#include <ostream>
+#include <string>
+
+#ifdef SCHEME_PROFILE
+
+struct ExprBase;
+struct Procedure;
+
+namespace profile {
+
+void enter(Procedure *);         ///< A call of proc begins
+void tailCall(Procedure *);      ///< The running procedure tail-calls proc
+size_t depth();                  ///< Height of the shadow stack
+void unwind(size_t depth);       ///< Ends the calls above depth, on return or when an error unwinds them
+void node(ExprType);             ///< The tree walker evaluates a node of this type
+void allocation();               ///< A managed object is allocated
+void label(const ExprBase *body, Name name);   ///< Procedures with this body are called name
+
+void report(std::ostream &);
+bool writeFolded(const std::string &path);     ///< False if the file cannot be written
+
+/// Ends, when it goes out of scope, the calls made since it was created
+struct Scope {
+    size_t base;
+    Scope() : base(depth()) {}
+    ~Scope() { unwind(base); }
+    /// The call this scope belongs to runs proc, first or after a tail call
+    void call(Procedure *proc) {
+        if (depth() > base) tailCall(proc);
+        else enter(proc);
+    }
+};
+
+} // namespace profile
+
+#define PROFILE_SCOPE() profile::Scope profileScope_
+#define PROFILE_CALL(proc) profileScope_.call(proc)
+#define PROFILE_ENTER(proc) profile::enter(proc)
+#define PROFILE_RETURN() profile::unwind(profile::depth() - 1)
+#define PROFILE_NODE(type) profile::node(type)
+#define PROFILE_ALLOCATION() profile::allocation()
+#define PROFILE_LABEL(body, name) profile::label(body, name)
+
+#else
+
+#define PROFILE_SCOPE() ((void)0)
+#define PROFILE_CALL(proc) ((void)0)
+#define PROFILE_ENTER(proc) ((void)0)
+#define PROFILE_RETURN() ((void)0)
+#define PROFILE_NODE(type) ((void)0)
+#define PROFILE_ALLOCATION() ((void)0)
+#define PROFILE_LABEL(body, name) ((void)0)
+
+#endif // SCHEME_PROFILE
+
+#endif // PROFILE_HPP
@@ -0,0 +1,84 @@
+/**
+ * @file stats.cpp
+ * @brief Runtime counters and their reports
+ */
+
+#include "stats.hpp"
+#include "value.hpp"
+#include <string>
+
+namespace stats {
+
+thread_local Counters counters;
+
+namespace {
+
+// 在堆上分配的值类型, 按报告顺序
+const struct {
+    ValueType type;
+    const char *name;
+} HEAP_TYPES[] = {
+    {V_PAIR, "pair"}, {V_PROC, "procedure"}, {V_BOX, "box"}, {V_VECTOR, "vector"},
+    {V_HASH_TABLE, "hash-table"}, {V_STRING, "string"}, {V_SYM, "symbol"},
+    {V_BIGNUM, "bignum"}, {V_RATIONAL, "rational"}, {V_PRIM, "primitive"}, {V_FUTURE, "future"},
+};
+
+// Smallest depth counted in bucket k
+uint64_t bucketStart(size_t k) {
+    return k == 0 ? 0 : uint64_t(1) << (k - 1);
+}
+
+Value count(uint64_t n) {
+    return IntegerV(BigInt((long long)n));
+}
+
+Value entry(const std::string &key, const Value &v) {
+    return PairV(SymbolV(key), v);
+}
+
+} // namespace
+
+Value snapshot() {
+    Counters c = counters; // 构造结果时的分配不计入
+    Value allocated = NullV();
+    for (size_t i = sizeof HEAP_TYPES / sizeof HEAP_TYPES[0]; i-- > 0;)
+        allocated = PairV(entry(HEAP_TYPES[i].name, count(c.allocated[HEAP_TYPES[i].type])), allocated);
+    Value depths = NullV();
+    for (size_t k = LOOKUP_BUCKETS; k-- > 0;)
+        depths = PairV(PairV(count(bucketStart(k)), count(c.lookupDepths[k])), depths);
+
+    Value result = NullV();
+    result = PairV(entry("errors", count(c.errors)), result);
+    result = PairV(entry("max-depth", count(c.maxDepth)), result);
+    result = PairV(entry("calls", count(c.calls)), result);
+    result = PairV(entry("global-lookups", count(c.globalLookups)), result);
+    result = PairV(PairV(SymbolV("lookup-depths"), depths), result);
+    result = PairV(entry("frames", count(c.frames)), result);
+    result = PairV(PairV(SymbolV("allocated"), allocated), result);
+    return result;
+}
+
+void report(std::ostream &os) {
+    os << "runtime stats:\n  allocated:";
+    bool any = false;
+    for (auto &t : HEAP_TYPES) {
+        if (counters.allocated[t.type] == 0) continue;
+        os << (any ? ", " : " ") << t.name << " " << counters.allocated[t.type];
+        any = true;
+    }
+    os << (any ? "\n" : " none\n");
+    os << "  frames: " << counters.frames << "\n  lookup depths:";
+    for (size_t k = 0; k < LOOKUP_BUCKETS; ++k) {
+        uint64_t lo = bucketStart(k), hi = bucketStart(k + 1) - 1;
+        os << (k == 0 ? " " : ", ") << lo;
+        if (k + 1 == LOOKUP_BUCKETS) os << "+";
+        else if (hi > lo) os << "-" << hi;
+        os << ": " << counters.lookupDepths[k];
+    }
+    os << "\n  global lookups: " << counters.globalLookups
+       << "\n  calls: " << counters.calls
+       << "\n  max depth: " << counters.maxDepth
+       << "\n  errors: " << counters.errors << "\n";
+}
+
+} // namespace stats
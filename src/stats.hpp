@@ -0,0 +1,82 @@
+#ifndef STATS_HPP
+#define STATS_HPP
+
+/**
+ * @file stats.hpp
+ * @brief Always-on runtime counters, read with (runtime-stats) or --stats
+ *
+ * Unlike the profiler (profile.hpp) these are kept in every build: each one
+ * is an increment of a thread-local integer on a path that does the work
+ * anyway. They count
+ *
+ * - the heap values allocated, by type (fixnums, booleans, '() and the other
+ *   immediate values allocate nothing and are not counted),
+ * - the environment frames created by extend,
+ * - the variable reads and writes of running code: for lexical variables the
+ *   number of frames skipped to reach the slot, as a histogram whose buckets
+ *   are 0, 1, 2-3, 4-7, ... and 64 or more, and for globals the number of
+ *   cells read or written, the callees cached at call sites included,
+ * - the procedure calls of the tree walker and the VM, tail calls included,
+ *   and the deepest nesting of calls that are not tail calls,
+ * - the RuntimeErrors that reached the top level and were printed; those
+ *   caught on the way, such as by constant folding, are not counted.
+ *
+ * Like the heap, the counters belong to the thread (see interpreter.hpp): the
+ * tasks of future and parallel-map count on their workers. They are never
+ * reset, so a long-running session sees its totals.
+ */
+
+#include "Def.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+
+struct Value;
+
+namespace stats {
+
+const size_t LOOKUP_BUCKETS = 8;
+
+struct Counters {
+    uint64_t allocated[V_TERMINATE + 1];
+    uint64_t frames;
+    uint64_t lookupDepths[LOOKUP_BUCKETS];
+    uint64_t globalLookups;
+    uint64_t calls;
+    uint64_t depth;      ///< Non-tail calls running now
+    uint64_t maxDepth;
+    uint64_t errors;
+};
+
+extern thread_local Counters counters;   // 零初始化, 不需要构造
+
+inline void enterCall() {
+    if (++counters.depth > counters.maxDepth) counters.maxDepth = counters.depth;
+}
+inline void leaveCall() { --counters.depth; }
+
+/// Restores the call depth when it goes out of scope, also when an error unwinds the calls
+struct DepthScope {
+    uint64_t base;
+    DepthScope() : base(counters.depth) {}
+    ~DepthScope() { counters.depth = base; }
+};
+
+/// A lexical variable reached depth frames out
+inline void lookupDepth(int depth) {
+    size_t k = 0;
+    while (depth >> k != 0 && k + 1 < LOOKUP_BUCKETS) ++k; // 0, 1, 2-3, 4-7, ...
+    ++counters.lookupDepths[k];
+}
+
+/**
+ * The counters as an association list:
+ * ((allocated (pair . n) ...) (frames . n) (lookup-depths (0 . n) (1 . n) (2 . n) ...)
+ *  (global-lookups . n) (calls . n) (max-depth . n) (errors . n))
+ */
+Value snapshot();
+void report(std::ostream &);
+
+} // namespace stats
+
+#endif // STATS_HPP
@@ -1,4 +1,6 @@
 #include "syntax.hpp"
+#include "value.hpp"
+#include <algorithm>
 #include <cstring>
 #include <vector>
 
@@ -7,35 +9,43 @@ SyntaxBase* Syntax::operator->() const { return ptr.get(); }
 SyntaxBase& Syntax::operator*() { return *ptr; }
 SyntaxBase* Syntax::get() const { return ptr.get(); }
 
-Number::Number(int n) : n(n) {}
+Number::Number(int n) : SyntaxBase(S_NUMBER), n(n) {}
 void Number::show(std::ostream &os) {
   os << "the-number-" << n;
 }
 
-RationalSyntax::RationalSyntax(int num, int den) : numerator(num), denominator(den) {}
+BignumSyntax::BignumSyntax(const BigInt &n) : SyntaxBase(S_BIGNUM), n(n) {}
+void BignumSyntax::show(std::ostream &os) {
+  os << "the-number-" << n.toString();
+}
+
+RationalSyntax::RationalSyntax(const BigInt &num, const BigInt &den) : SyntaxBase(S_RATIONAL), numerator(num), denominator(den) {}
 void RationalSyntax::show(std::ostream &os) {
-  os << numerator << "/" << denominator;
+  os << numerator.toString() << "/" << denominator.toString();
 }
 
+TrueSyntax::TrueSyntax() : SyntaxBase(S_TRUE) {}
 void TrueSyntax::show(std::ostream &os) {
   os << "#t";
 }
 
+FalseSyntax::FalseSyntax() : SyntaxBase(S_FALSE) {}
 void FalseSyntax::show(std::ostream &os) {
   os << "#f";
 }
 
-SymbolSyntax::SymbolSyntax(const std::string &s1) : s(s1) {}
+SymbolSyntax::SymbolSyntax(const std::string &s1) : SyntaxBase(S_SYMBOL), s(intern(s1)) {}
+SymbolSyntax::SymbolSyntax(Name x) : SyntaxBase(S_SYMBOL), s(x) {}
 void SymbolSyntax::show(std::ostream &os) {
-    os << s;
+    os << s->s;
 }
 
-StringSyntax::StringSyntax(const std::string &s1) : s(s1) {}
+StringSyntax::StringSyntax(const std::string &s1) : SyntaxBase(S_STRING), s(s1) {}
 void StringSyntax::show(std::ostream &os) {
     os << "\"" << s << "\"";
 }
 
-List::List() {}
+List::List() : SyntaxBase(S_LIST), expansion(nullptr) {}
 void List::show(std::ostream &os) {
     os << '(';
     for (auto stx : stxs) {
@@ -45,104 +55,118 @@ void List::show(std::ostream &os) {
     os << ')';
 }
 
-std::istream &readSpace(std::istream &is) {
+namespace {
+
+const size_t READ_CHUNK = 64 * 1024;
+const size_t NO_MARK = size_t(-1);
+
+bool isDelimiter(int c) {
+  return c == '(' || c == ')' || c == '[' || c == ']' ||
+         c == ';' || // 添加分号作为分隔符
+         isspace(c) || c == EOF;
+}
+
+// Integer of any size in s[0, n): an optional sign followed by digits
+bool parseInteger(const char *s, size_t n, BigInt &result) {
+  size_t i = (n > 0 && (s[0] == '+' || s[0] == '-')) ? 1 : 0;
+  if (i == n) return false; // Single '+' or '-' are not numbers
+  for (size_t k = i; k < n; ++k)
+    if (s[k] < '0' || s[k] > '9') return false;
+
+  if (n - i <= 18) { // 放得进int64, 不经过字符串
+    long long v = 0;
+    for (size_t k = i; k < n; ++k) v = v * 10 + (s[k] - '0');
+    result = BigInt(s[0] == '-' ? -v : v);
+    return true;
+  }
+  return BigInt::parse(std::string(s, n), result);
+}
+
+// numerator/denominator with a positive denominator
+bool parseRational(const char *s, size_t n, BigInt &numerator, BigInt &denominator) {
+  const char *slash = static_cast<const char*>(memchr(s, '/', n));
+  if (slash == nullptr || slash == s || slash == s + n - 1) {
+    return false; // No slash or slash at beginning/end
+  }
+  size_t num_len = slash - s;
+  if (!parseInteger(s, num_len, numerator)) return false;
+  if (!parseInteger(slash + 1, n - num_len - 1, denominator)) return false;
+  return !denominator.negative() && !denominator.isZero();
+}
+
+} // namespace
+
+Reader::Reader(std::istream &is)
+  : in(&is), chunk(READ_CHUNK), data(chunk.data()), pos(0), lim(0), mark(NO_MARK) {}
+
+Reader::Reader(const char *d, size_t size)
+  : in(nullptr), data(d), pos(0), lim(size), mark(NO_MARK) {}
+
+bool Reader::refill() {
+  if (in == nullptr) return false;
+  std::streambuf *sb = in->rdbuf();
+  if (in->tie()) in->tie()->flush(); // 阻塞读取前先输出提示符
+
+  // 保留正在扫描的token, 丢弃其余已读内容
+  size_t keep = mark == NO_MARK ? lim : mark;
+  if (keep > 0) {
+    std::copy(chunk.begin() + keep, chunk.begin() + lim, chunk.begin());
+    lim -= keep;
+    pos -= keep;
+    if (mark != NO_MARK) mark = 0;
+  }
+
+  if (sb->sgetc() == EOF) return false; // 等待输入
+  std::streamsize avail = sb->in_avail();
+  size_t want = avail > 0 ? size_t(avail) : 1;
+  if (chunk.size() - lim < want) chunk.resize(std::max(chunk.size() * 2, lim + want));
+  data = chunk.data();
+  lim += size_t(sb->sgetn(&chunk[lim], std::streamsize(want)));
+  return pos < lim;
+}
+
+void Reader::skipSpace() {
   while (true) {
     // 跳过空白字符
-    while (isspace(is.peek()))
-      is.get();
+    while (isspace(peek()))
+      ++pos;
     
     // 检查是否是注释
-    if (is.peek() == ';') {
+    if (peek() == ';') {
       // 跳过注释直到行末
-      while (is.peek() != '\n' && is.peek() != EOF)
-        is.get();
+      while (peek() != '\n' && peek() != EOF)
+        ++pos;
       // 继续循环以跳过注释后的空白字符
     } else {
       // 没有更多空白字符或注释，退出循环
       break;
     }
   }
-  return is;
 }
 
-Syntax readList(std::istream &is);
-
-// Helper function to try parsing as integer or rational
-bool tryParseNumber(const std::string &s, int &result) {
-  bool neg = false;
-  int n = 0;
-  int i = 0;
-  
-  // Single '+' or '-' are not numbers
-  if (s.size() == 1 && (s[0] == '+' || s[0] == '-'))
-    return false;
-  
-  // Handle sign
-  if (s[0] == '-') {
-    i += 1;
-    neg = true;
-  } else if (s[0] == '+') {
-    i += 1;
-  }
-  
-  // Check if all remaining characters are digits
-  for (; i < s.size(); i++) {
-    if ('0' <= s[i] && s[i] <= '9') {
-      n = n * 10 + s[i] - '0';
-    } else {
-      return false;
-    }
-  }
-  
-  // Apply sign
-  result = neg ? -n : n;
-  return true;
+bool Reader::atEnd() {
+  skipSpace();
+  return peek() == EOF;
 }
 
-// Helper function to try parsing as rational number
-bool tryParseRational(const std::string &s, int &numerator, int &denominator) {
-  size_t slash_pos = s.find('/');
-  if (slash_pos == std::string::npos || slash_pos == 0 || slash_pos == s.size() - 1) {
-    return false; // No slash or slash at beginning/end
-  }
-  
-  std::string num_str = s.substr(0, slash_pos);
-  std::string den_str = s.substr(slash_pos + 1);
-  
-  // Parse numerator (can be negative)
-  if (!tryParseNumber(num_str, numerator)) {
-    return false;
-  }
-  
-  // Parse denominator (must be positive)
-  if (!tryParseNumber(den_str, denominator) || denominator <= 0) {
-    return false;
-  }
-  
-  return true;
-}
-
-// Helper function to create identifier/symbol syntax
-Syntax createIdentifierSyntax(const std::string &s) {
-  if (s == "#t")
-    return Syntax(new TrueSyntax());
-  if (s == "#f")
-    return Syntax(new FalseSyntax());
-  return Syntax(new SymbolSyntax(s));
+Syntax Reader::read() {
+  skipSpace(); // 跳过空白再读取语法项
+  return readItem();
 }
 
 // no leading space
-Syntax readItem(std::istream &is) {
-  if (is.peek() == '(' || is.peek() == '[') {
-    is.get();
-    return readList(is);
+Syntax Reader::readItem() {
+  int c = peek();
+  if (c == '(' || c == '[') {
+    ++pos;
+    return readList();
   }
 
-  if (is.peek() == '\'')
-  {
-    is.get();
+  if (c == '\'') {
+    ++pos;
     // 读取单引号后的语法元素
-    Syntax quoted_syntax = readItem(is);
+    skipSpace();
+    Syntax quoted_syntax = readItem();
     
     // 创建 (quote <syntax>) 的列表结构
     List *quote_list = new List();
@@ -153,75 +177,77 @@ Syntax readItem(std::istream &is) {
   }
 
   // 处理字符串字面量
-  if (is.peek() == '"') {
-    is.get(); // 消费开始的双引号
-    std::string str;
-    while (is.peek() != '"' && is.peek() != EOF) {
-      char c = is.get();
-      if (c == '\\') {
-        // 处理转义字符
-        char next = is.get();
-        switch (next) {
-          case 'n': str.push_back('\n'); break;
-          case 't': str.push_back('\t'); break;
-          case 'r': str.push_back('\r'); break;
-          case '\\': str.push_back('\\'); break;
-          case '"': str.push_back('"'); break;
-          default: str.push_back(next); break;
-        }
-      } else {
-        str.push_back(c); // 普通字符
+  if (c == '"') {
+    ++pos; // 消费开始的双引号
+    return readString();
+  }
+  return readAtom();
+}
+
+Syntax Reader::readList() {
+  List *stx = new List();
+  Syntax result(stx);
+  while (true) {
+    skipSpace();
+    int c = peek();
+    if (c == ')' || c == ']' || c == EOF) break;
+    stx->stxs.push_back(readItem());
+  }
+  if (peek() != EOF) ++pos; // ')'
+  return result;
+}
+
+Syntax Reader::readString() {
+  std::string str;
+  while (peek() != '"' && peek() != EOF) {
+    char c = data[pos++];
+    if (c == '\\' && peek() != EOF) {
+      // 处理转义字符
+      char next = data[pos++];
+      switch (next) {
+        case 'n': str.push_back('\n'); break;
+        case 't': str.push_back('\t'); break;
+        case 'r': str.push_back('\r'); break;
+        case '\\': str.push_back('\\'); break;
+        case '"': str.push_back('"'); break;
+        default: str.push_back(next); break;
       }
+    } else {
+      str.push_back(c); // 普通字符
     }
-    if (is.peek() == '"') {
-      is.get(); // 消费结束的双引号
-    }
-    return Syntax(new StringSyntax(str));
   }
-  
-  // Read token
-  std::string s;
-  do {
-    int c = is.peek();
-    if (c == '(' || c == ')' ||
-        c == '[' || c == ']' || 
-        c == ';' ||  // 添加分号作为分隔符
-        isspace(c) ||
-        c == EOF)
-      break;
-    is.get();
-    s.push_back(c);
-  } while (true);
-  
+  if (peek() == '"') {
+    ++pos; // 消费结束的双引号
+  }
+  return Syntax(new StringSyntax(str));
+}
+
+Syntax Reader::readAtom() {
+  // Scan the token in place
+  mark = pos;
+  while (!isDelimiter(peek())) ++pos;
+  const char *tok = data + mark;
+  size_t len = pos - mark;
+  mark = NO_MARK;
+  if (len == 0 && peek() != EOF) ++pos; // 多余的右括号, 读作空符号
+
   // Try parsing as rational first
-  int numerator, denominator;
-  if (tryParseRational(s, numerator, denominator)) {
+  BigInt numerator, denominator;
+  if (parseRational(tok, len, numerator, denominator)) {
     return Syntax(new RationalSyntax(numerator, denominator));
   }
   
   // Try parsing as integer
-  int number_value;
-  if (tryParseNumber(s, number_value)) {
-    return Syntax(new Number(number_value));
+  BigInt number_value;
+  if (parseInteger(tok, len, number_value)) {
+    if (number_value.fitsInt()) return Syntax(new Number(number_value.toInt()));
+    return Syntax(new BignumSyntax(number_value));
   }
   
   // Not a number, treat as identifier/symbol
-  return createIdentifierSyntax(s);
-}
-
-Syntax readList(std::istream &is) {
-    List *stx = new List();
-    while (readSpace(is).peek() != ')' && readSpace(is).peek() != ')')
-        stx->stxs.push_back(readItem(is));
-    is.get(); // ')'
-    return Syntax(stx);
-}
-
-Syntax readSyntax(std::istream &is) {
-  return readItem(readSpace(is)); // 跳过空白再读取语法项
+  if (len == 2 && tok[0] == '#' && tok[1] == 't')
+    return Syntax(new TrueSyntax());
+  if (len == 2 && tok[0] == '#' && tok[1] == 'f')
+    return Syntax(new FalseSyntax());
+  return Syntax(new SymbolSyntax(std::string(tok, len)));
 }
-
-std::istream &operator>>(std::istream &is, Syntax &stx) {
-  stx = readSyntax(is);
-  return is;
-}
\ No newline at end of file
@@ -5,8 +5,11 @@
 #include <memory>
 #include <vector>
 #include "Def.hpp"
+#include "bigint.hpp"
 
 struct SyntaxBase {
+    SyntaxType s_type;
+    SyntaxBase(SyntaxType st) : s_type(st) {}
     virtual Expr parse(Assoc &) = 0;
     virtual void show(std::ostream &) = 0;
     virtual ~SyntaxBase() = default;
@@ -28,29 +31,38 @@ struct Number : SyntaxBase {
     virtual void show(std::ostream &) override;
 };
 
+// Integer literal outside the fixnum range
+struct BignumSyntax : SyntaxBase {
+    BigInt n;
+    BignumSyntax(const BigInt &);
+    virtual Expr parse(Assoc &) override;
+    virtual void show(std::ostream &) override;
+};
+
 struct RationalSyntax : SyntaxBase {
-    int numerator;
-    int denominator;
-    RationalSyntax(int num, int den);
+    BigInt numerator;
+    BigInt denominator;
+    RationalSyntax(const BigInt &num, const BigInt &den);
     virtual Expr parse(Assoc &) override;
     virtual void show(std::ostream &) override;
 };
 
 struct TrueSyntax : SyntaxBase {
-    // This will not match
+    TrueSyntax();
     virtual Expr parse(Assoc &) override;
     virtual void show(std::ostream &) override;
 };
 
 struct FalseSyntax : SyntaxBase {
-    // FalseSyntax();
+    FalseSyntax();
     virtual Expr parse(Assoc &) override;
     virtual void show(std::ostream &) override;
 };
 
 struct SymbolSyntax : SyntaxBase {
-    std::string s;
+    Name s;   ///< Interned by the reader
     SymbolSyntax(const std::string &);
+    SymbolSyntax(Name);
     virtual Expr parse(Assoc &) override;
     virtual void show(std::ostream &) override;
 };
@@ -64,12 +76,55 @@ struct StringSyntax : SyntaxBase {
 
 struct List : SyntaxBase {
     std::vector<Syntax> stxs;
+    Syntax expansion;                          ///< When this is a macro use: what it expands to
+    std::shared_ptr<const Macro> expandedBy;   ///< The macro that produced expansion
     List();
     virtual Expr parse(Assoc &) override;
     virtual void show(std::ostream &) override;
 };
 
-Syntax readSyntax(std::istream &);
+// Tag-checked downcasts, nullptr when the node is of another kind
+inline List *asList(const Syntax &stx) {
+    return stx->s_type == S_LIST ? static_cast<List*>(stx.get()) : nullptr;
+}
+inline SymbolSyntax *asSymbol(const Syntax &stx) {
+    return stx->s_type == S_SYMBOL ? static_cast<SymbolSyntax*>(stx.get()) : nullptr;
+}
 
-std::istream &operator>>(std::istream &, Syntax);
+/**
+ * @brief Buffered reader
+ *
+ * Reads from a stream in chunks, or from a buffer already in memory, and
+ * scans tokens in place: an atom is only copied when it becomes a symbol or
+ * string, and numbers are converted straight from the buffer. A token that
+ * crosses a chunk boundary is kept by moving it to the front of the buffer
+ * before the next chunk is appended.
+ *
+ * When reading a stream, a refill takes what the stream buffer already
+ * holds (at least one character), so interactive input is consumed a line
+ * at a time and a datum is returned as soon as it is complete.
+ */
+class Reader {
+public:
+    explicit Reader(std::istream &);
+    Reader(const char *data, size_t size);   ///< data must outlive the reader
+
+    bool atEnd();      ///< Skips whitespace and comments; true when no datum is left
+    Syntax read();     ///< Next datum
+
+private:
+    std::istream *in;            ///< nullptr for an in-memory buffer
+    std::vector<char> chunk;     ///< Storage when reading a stream
+    const char *data;
+    size_t pos, lim;             ///< Unread input is data[pos, lim)
+    size_t mark;                 ///< Start of the token being scanned, kept across refills
+
+    bool refill();
+    int peek() { return pos < lim || refill() ? (unsigned char)data[pos] : EOF; }
+    void skipSpace();
+    Syntax readItem();
+    Syntax readList();
+    Syntax readString();
+    Syntax readAtom();
+};
 #endif
\ No newline at end of file
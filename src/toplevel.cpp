@@ -0,0 +1,160 @@
+/**
+ * @file toplevel.cpp
+ * @brief Top-level loop: consecutive defines are bound together, results printed
+ */
+
+#include "toplevel.hpp"
+#include "expr.hpp"
+#include "RE.hpp"
+#include "stats.hpp"
+#include "vm.hpp"
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+static bool isExplicitVoidCall(Expr expr) {
+    switch (expr->e_type) {
+        case E_VOID:
+            return true;
+        case E_APPLY: {
+            ExprBase *rator = static_cast<Apply*>(expr.get())->rator.get();
+            return rator->e_type == E_VAR && static_cast<Var*>(rator)->x == intern("void");
+        }
+        case E_BEGIN: {
+            auto begin_expr = static_cast<Begin*>(expr.get());
+            return !begin_expr->es.empty() && isExplicitVoidCall(begin_expr->es.back());
+        }
+        case E_IF: {
+            auto if_expr = static_cast<If*>(expr.get());
+            return isExplicitVoidCall(if_expr->conseq) || isExplicitVoidCall(if_expr->alter);
+        }
+        case E_COND:
+            for (const auto& clause : static_cast<Cond*>(expr.get())->clauses) {
+                if (!clause.empty() && isExplicitVoidCall(clause.back())) return true;
+            }
+            return false;
+        default:
+            return false;
+    }
+}
+
+static Value evaluate(const Expr &expr, Assoc &env, bool vm) {
+    return vm ? vmEval(expr, env) : expr->eval(env);
+}
+
+typedef std::vector<Expr> Defines;
+
+// Binds a run of consecutive top-level defines together, so they can refer
+// to each other
+static void defineAll(Defines &pending_defines, Assoc &global_env, bool vm) {
+    if (pending_defines.empty()) return;
+    for (auto &def : pending_defines) { // 不存在则创建绑定
+        static_cast<Define*>(def.get())->bind();
+    }
+
+    // EVAL
+    for (auto &def : pending_defines) {
+        auto define_expr = static_cast<Define*>(def.get());
+        Value val = evaluate(define_expr->e, global_env, vm);
+        ++stats::counters.globalLookups;
+        assignGlobal(define_expr->cell, val);
+    }
+    pending_defines.clear();
+}
+
+typedef std::unordered_map<Name, std::shared_ptr<const Macro>> Macros;
+
+// Appends to f the changes from the macros before to those of globals
+static void recordMacroChanges(const Macros &before, GlobalEnv *globals, ParsedForm &f) {
+    for (auto &kv : before) {
+        if (globals->macros.count(kv.first) == 0) f.macros.emplace_back(kv.first, nullptr);
+    }
+    for (auto &kv : globals->macros) {
+        auto it = before.find(kv.first);
+        if (it == before.end() || it->second != kv.second) f.macros.push_back(kv);
+    }
+}
+
+// Parses stx, appending the form to log if there is one
+static Expr parseForm(const Syntax &stx, Assoc &env, FormLog *log) {
+    GlobalEnv *globals = log != nullptr ? globalsOf(env) : nullptr;
+    if (globals == nullptr) return stx->parse(env);
+    Macros before = globals->macros;
+    log->forms.emplace_back();
+    try {
+        log->forms.back().expr = stx->parse(env);
+    } catch (const RuntimeError &) {
+        recordMacroChanges(before, globals, log->forms.back()); // 出错前定义的宏仍然有效
+        throw;
+    }
+    recordMacroChanges(before, globals, log->forms.back());
+    return log->forms.back().expr;
+}
+
+// Takes the place of parsing f: its macro changes, then its form
+static Expr replayForm(const ParsedForm &f, Assoc &env) {
+    GlobalEnv *globals = globalsOf(env);
+    for (auto &kv : f.macros) {
+        if (kv.second) globals->macros[kv.first] = kv.second;
+        else globals->macros.erase(kv.first);
+    }
+    if (f.expr.get() == nullptr) throw RuntimeError("Syntax error"); // 解析时就出错的形式
+    return f.expr;
+}
+
+// An error that reached the top level: it is printed and counted
+static void reportError(Output &out) {
+    ++stats::counters.errors;
+    out.write("RuntimeError\n", 13);
+}
+
+bool runToplevel(Reader &reader, Output &out, Assoc &global_env, bool prompt, bool vm, FormLog *log) {
+    Output *previous = setCurrentOutput(&out);
+    Defines pending_defines;
+    bool exited = false;
+    bool replay = log != nullptr && log->replay;
+    size_t replayed = 0;
+
+    while (true){
+        if (prompt) out.write("scm> ", 5);
+
+        // READ
+        if (replay ? replayed == log->forms.size() : reader.atEnd()) {
+            try{ // 输入以define结尾时它们也要生效, 比如保存映像前
+                defineAll(pending_defines, global_env, vm);
+            }
+            catch (const RuntimeError &){
+                reportError(out);
+            }
+            break;
+        }
+        Syntax stx = replay ? Syntax(nullptr) : reader.read();
+        try{
+            Expr expr = replay ? replayForm(log->forms[replayed++], global_env) : parseForm(stx, global_env, log);
+
+            if (expr->e_type == E_DEFINE) { // 收集define
+                pending_defines.push_back(expr);
+                continue;
+            }
+            if (expr->e_type == E_DEFINE_SYNTAX) continue; // 宏在parse时已定义, 不输出
+            defineAll(pending_defines, global_env, vm);
+
+            Value val = evaluate(expr, global_env, vm);
+            if (val.type() == V_TERMINATE) {
+                exited = true;
+                break;
+            }
+
+            // PRINT
+            if (val.type() != V_VOID || isExplicitVoidCall(expr)) {
+                val.show(out);
+            }
+            out.put('\n');
+        }
+        catch (const RuntimeError &){
+            reportError(out);
+        }
+    } // LOOP
+    setCurrentOutput(previous);
+    return exited;
+}
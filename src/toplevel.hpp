@@ -0,0 +1,36 @@
+#ifndef TOPLEVEL_HPP
+#define TOPLEVEL_HPP
+
+/**
+ * @file toplevel.hpp
+ * @brief The read-eval-print loop behind Interpreter
+ */
+
+#include "syntax.hpp"
+#include "value.hpp"
+#include "output.hpp"
+#include "image.hpp"
+#include <vector>
+
+/**
+ * @brief Parsed top-level forms of an input, for the parse cache
+ *
+ * When recording, runToplevel appends every form it parses; when replaying
+ * it runs these forms instead of reading and parsing the input, applying
+ * their macro changes as parsing would have.
+ */
+struct FormLog {
+    std::vector<ParsedForm> forms;
+    bool replay = false;
+};
+
+/**
+ * Reads and evaluates top-level forms in env until (exit) or the end of the
+ * input, printing each result (and whatever display writes) to out. prompt
+ * says whether to print "scm> " first; vm runs the forms on the bytecode
+ * machine instead of the tree walker. With a log the forms are recorded in
+ * it or replayed from it. Returns whether (exit) ended it.
+ */
+bool runToplevel(Reader &reader, Output &out, Assoc &env, bool prompt, bool vm, FormLog *log = nullptr);
+
+#endif // TOPLEVEL_HPP
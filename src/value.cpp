@@ -7,183 +7,317 @@
  */
 
 #include "value.hpp"
+#include "RE.hpp"
+#include "stats.hpp"
+#include <stdexcept>
+#include <unordered_map>
 
 // ============================================================================
 // Base ValueBase Implementation
 // ============================================================================
 
-ValueBase::ValueBase(ValueType vt) : v_type(vt) {}
-
-void ValueBase::showCdr(std::ostream &os) {
-    os << " . ";
-    show(os);
-    os << ')';
+ValueBase::ValueBase(ValueType vt) : v_type(vt) {
+    ++stats::counters.allocated[vt];
 }
 
+
 // ============================================================================
-// Value Smart Pointer Implementation
+// Tagged Value Implementation
 // ============================================================================
 
-Value::Value(ValueBase *ptr) : ptr(ptr) {}
-
-ValueBase* Value::operator->() const { 
-    return ptr.get(); 
+Value::Value(ValueBase *ptr) : bits(reinterpret_cast<uint64_t>(ptr)) {
+    retain();
 }
 
-ValueBase& Value::operator*() { 
-    return *ptr; 
+// Immediates and non-pair heap values
+static void showAtom(Output &out, const Value &v) {
+    if (v.isHeap()) {
+        v->show(out);
+        return;
+    }
+    if (v.isFixnum()) {
+        out.writeInt(v.fixnum());
+        return;
+    }
+    switch (v.bits >> 2) {
+        case K_FALSE:     out.write("#f", 2); break;
+        case K_TRUE:      out.write("#t", 2); break;
+        case K_NULL:      out.write("()", 2); break;
+        case K_VOID:      out.write("#<void>", 7); break;
+        case K_TERMINATE: out.write("()", 2); break;
+    }
 }
 
-ValueBase* Value::get() const { 
-    return ptr.get(); 
+void Value::show(Output &out) const {
+    // 每个尚未打印完的列表在栈上保存其剩余部分, 向量保存下一个元素的下标
+    struct Rest {
+        const Value *list;
+        const Vector *vec;
+        size_t next;
+    };
+    std::vector<Rest> rests;
+    const Value *cur = this;
+    while (true) {
+        while (true) { // 进入列表和非空向量, 先打印第一个元素
+            if (cur->type() == V_PAIR) {
+                Pair *p = static_cast<Pair*>(cur->get());
+                out.put('(');
+                rests.push_back({&p->cdr, nullptr, 0});
+                cur = &p->car;
+            } else if (cur->type() == V_VECTOR && !static_cast<Vector*>(cur->get())->elems.empty()) {
+                Vector *v = static_cast<Vector*>(cur->get());
+                out.write("#(", 2);
+                rests.push_back({nullptr, v, 1});
+                cur = &v->elems[0];
+            } else {
+                break;
+            }
+        }
+        showAtom(out, *cur);
+
+        // 回到外层, 直到找到下一个要打印的元素
+        cur = nullptr;
+        while (!rests.empty()) {
+            Rest &r = rests.back();
+            if (r.vec != nullptr) {
+                if (r.next < r.vec->elems.size()) {
+                    out.put(' ');
+                    cur = &r.vec->elems[r.next++];
+                    break;
+                }
+                rests.pop_back();
+                out.put(')');
+                continue;
+            }
+            const Value *rest = r.list;
+            if (rest->type() == V_PAIR) {
+                Pair *p = static_cast<Pair*>(rest->get());
+                out.put(' ');
+                r.list = &p->cdr;
+                cur = &p->car;
+                break;
+            }
+            rests.pop_back();
+            if (rest->type() != V_NULL) { // 点对
+                out.write(" . ", 3);
+                showAtom(out, *rest);
+            }
+            out.put(')');
+        }
+        if (cur == nullptr) return;
+    }
 }
 
-void Value::show(std::ostream &os) {
-    ptr->show(os);
+void Value::show(std::ostream &os) const {
+    Output out(os, 4096);
+    show(out);
 }
 
 // ============================================================================
 // Environment (Association List) Implementation
 // ============================================================================
 
-AssocList::AssocList(const std::string &x, const Value &v, Assoc &next)
-    : x(x), v(v), next(next) {}
+AssocList::AssocList(const FrameNames &names, std::vector<Value> &&values, const Assoc &next)
+    : names(names), values(std::move(values)), next(next), isGlobal(false) {}
+
+void AssocList::trace(GcVisit visit) {
+    for (auto &v : values) gcVisit(v, visit);
+    if (next.get() != nullptr) visit(next.get());
+}
+
+void AssocList::clearRefs() {
+    values.clear();
+    next = Assoc(nullptr);
+}
+
+thread_local uint64_t globalEpoch = 1;
 
-Assoc::Assoc(AssocList *x) : ptr(x) {}
+static const FrameNames &noNames() {
+    static const FrameNames names = std::make_shared<const std::vector<Name>>();
+    return names;
+}
 
-AssocList* Assoc::operator->() const { 
-    return ptr.get(); 
+GlobalEnv::GlobalEnv() : AssocList(noNames(), std::vector<Value>(), empty()) {
+    isGlobal = true;
 }
 
-AssocList& Assoc::operator*() { 
-    return *ptr; 
+GlobalEnv::~GlobalEnv() {
+    ++globalEpoch;
 }
 
-AssocList* Assoc::get() const { 
-    return ptr.get(); 
+Value *GlobalEnv::cell(Name x) {
+    return &cells[x];
+}
+
+void GlobalEnv::trace(GcVisit visit) {
+    for (auto &kv : cells) gcVisit(kv.second, visit);
+}
+
+void GlobalEnv::clearRefs() {
+    ++globalEpoch;
+    for (auto &kv : cells) kv.second = Value(); // 单元本身保留: Var等仍指向它们
+}
+
+Assoc::Assoc(AssocList *x) : ptr(x) {
+    retain();
 }
 
 Assoc empty() {
     return Assoc(nullptr);
 }
 
-Assoc extend(const std::string &x, const Value &v, Assoc &lst) {
-    return Assoc(new AssocList(x, v, lst));
+Assoc globalEnv() {
+    return Assoc(new GlobalEnv());
+}
+
+GlobalEnv *globalsOf(const Assoc &l) {
+    AssocList *i = l.get();
+    if (i == nullptr) return nullptr;
+    while (i->next.get() != nullptr) i = i->next.get();
+    return i->isGlobal ? static_cast<GlobalEnv*>(i) : nullptr;
 }
 
-void modify(const std::string &x, const Value &v, Assoc &lst) {
-    for (auto i = lst; i.get() != nullptr; i = i->next) {
-        if (x == i->x) {
-            i->v = v;
-            return;
+const Assoc &outermost(const Assoc &l) {
+    const Assoc *i = &l;
+    while (i->get() != nullptr && (*i)->next.get() != nullptr) i = &(*i)->next;
+    return *i;
+}
+
+Assoc extend(Name x, const Value &v, Assoc &lst) {
+    std::vector<Value> values(1, v);
+    return extend(std::make_shared<const std::vector<Name>>(1, x), std::move(values), lst);
+}
+
+Assoc extend(const FrameNames &names, std::vector<Value> &&values, const Assoc &lst) {
+    ++stats::counters.frames;
+    return Assoc(new AssocList(names, std::move(values), lst));
+}
+
+// Later slots of a frame shadow earlier ones with the same name
+static Value *lookup(Name x, const Assoc &lst) {
+    for (AssocList *i = lst.get(); i != nullptr; i = i->next.get()) {
+        if (i->isGlobal) {
+            auto &cells = static_cast<GlobalEnv*>(i)->cells;
+            auto it = cells.find(x);
+            return it == cells.end() || it->second.unbound() ? nullptr : &it->second;
+        }
+        const std::vector<Name> &names = *i->names;
+        for (size_t k = names.size(); k-- > 0;) {
+            if (x == names[k]) return &i->values[k];
         }
     }
+    return nullptr;
 }
 
-Value find(const std::string &x, Assoc &l) {
-    for (auto i = l; i.get() != nullptr; i = i->next) {
-        if (x == i->x) {
-            return i->v;
-        }
+Value find(Name x, const Assoc &l) {
+    Value *slot = lookup(x, l);
+    return slot != nullptr ? *slot : Value(nullptr);
+}
+
+const Assoc &skip(int depth, const Assoc &l) {
+    const Assoc *i = &l;
+    for (; depth > 0; --depth) {
+        if (i->get() == nullptr) throw RuntimeError("Corrupted lexical address");
+        i = &(*i)->next;
     }
-    return Value(nullptr);
+    return *i;
+}
+
+Value &locate(int depth, int slot, const Assoc &l) {
+    stats::lookupDepth(depth);
+    AssocList *frame = skip(depth, l).get();
+    if (frame == nullptr || size_t(slot) >= frame->values.size()) throw RuntimeError("Corrupted lexical address");
+    return frame->values[slot];
 }
 
 // ============================================================================
 // Simple Value Types Implementation
 // ============================================================================
 
-// Void
-Void::Void() : ValueBase(V_VOID) {}
+// Bignum
+Bignum::Bignum(const BigInt &n) : ValueBase(V_BIGNUM), n(n) {}
 
-void Void::show(std::ostream &os) {
-    os << "#<void>";
+void Bignum::show(Output &out) {
+    out.write(n.toString());
 }
 
-Value VoidV() {
-    return Value(new Void());
+Value IntegerV(const BigInt &n) {
+    if (n.fitsInt()) return IntegerV(n.toInt()); // 降级为fixnum
+    return Value(new Bignum(n));
 }
 
-// Integer
-Integer::Integer(int n) : ValueBase(V_INT), n(n) {}
-
-void Integer::show(std::ostream &os) {
-    os << n;
-}
-
-Value IntegerV(int n) {
-    return Value(new Integer(n));
+BigInt toBigInt(const Value &v) {
+    if (v.isFixnum()) return BigInt(v.fixnum());
+    return static_cast<Bignum*>(v.get())->n;
 }
 
 // Rational
-// Helper function to calculate greatest common divisor
-static int gcd(int a, int b) {
-    if (a < 0) a = -a;
-    if (b < 0) b = -b;
-    while (b != 0) {
-        int temp = b;
-        b = a % b;
-        a = temp;
-    }
-    return a;
-}
+Rational::Rational(const BigInt &num, const BigInt &den)
+    : ValueBase(V_RATIONAL), numerator(num), denominator(den) {}
 
-Rational::Rational(int num, int den) : ValueBase(V_RATIONAL) {
-    if (den == 0) {
-        throw std::runtime_error("Division by zero");
-    }
-    
-    // Simplify the fraction
-    int g = gcd(num, den);
-    numerator = num / g;
-    denominator = den / g;
-    
-    // Ensure denominator is positive
-    if (denominator < 0) {
-        numerator = -numerator;
-        denominator = -denominator;
-    }
+void Rational::show(Output &out) {
+    out.write(numerator.toString());
+    out.put('/');
+    out.write(denominator.toString());
 }
 
-void Rational::show(std::ostream &os) {
-    if (denominator == 1) {
-        os << numerator;
-    } else {
-        os << numerator << "/" << denominator;
-    }
+Value RationalV(int num, int den) {
+    return RationalV(BigInt(num), BigInt(den));
 }
 
-Value RationalV(int num, int den) {
-    return Value(new Rational(num, den));
+Value RationalV(const BigInt &num, const BigInt &den) {
+    if (den.isZero()) throw RuntimeError("Division by zero");
+    BigInt g = BigInt::gcd(num, den), n, d, rem;
+    BigInt::divMod(num, g, n, rem);
+    BigInt::divMod(den, g, d, rem);
+    if (d.negative()) { // 分母保持为正
+        n = -n;
+        d = -d;
+    }
+    if (d == BigInt(1)) return IntegerV(n);
+    return Value(new Rational(n, d));
 }
 
-// Boolean
-Boolean::Boolean(bool b) : ValueBase(V_BOOL), b(b) {}
+// Symbol
+Symbol::Symbol(const std::string &s) : ValueBase(V_SYM), s(s) {}
 
-void Boolean::show(std::ostream &os) {
-    os << (b ? "#t" : "#f");
+void Symbol::show(Output &out) {
+    out.write(s);
 }
 
-Value BooleanV(bool b) {
-    return Value(new Boolean(b));
+Name intern(const std::string &s) {
+    // 从不释放: 符号是永久对象, 静态对象析构时也可能仍在使用. 每个线程一张表,
+    // 符号和其他Value一样属于创建它的线程
+    static thread_local std::unordered_map<std::string, Value> *table = new std::unordered_map<std::string, Value>();
+    auto it = table->find(s);
+    if (it == table->end()) it = table->emplace(s, Value(new Symbol(s))).first;
+    return static_cast<Symbol*>(it->second.get());
 }
 
-// Symbol
-Symbol::Symbol(const std::string &s) : ValueBase(V_SYM), s(s) {}
+Name gensym(Name x) {
+    // 同样从不释放, 但不进入intern表
+    static thread_local std::vector<Value> *made = new std::vector<Value>();
+    made->push_back(Value(new Symbol(x->s)));
+    return static_cast<Symbol*>(made->back().get());
+}
 
-void Symbol::show(std::ostream &os) {
-    os << s;
+Name alias(Name x) {
+    Name a = gensym(x);
+    a->original = x;
+    return a;
 }
 
 Value SymbolV(const std::string &s) {
-    return Value(new Symbol(s));
+    return SymbolV(intern(s));
 }
 
 // String
 String::String(const std::string &s) : ValueBase(V_STRING), s(s) {}
 
-void String::show(std::ostream &os) {
-    os << "\"" << s << "\"";
+void String::show(Output &out) {
+    out.put('"');
+    out.write(s);
+    out.put('"');
 }
 
 Value StringV(const std::string &s) {
@@ -191,74 +325,215 @@ Value StringV(const std::string &s) {
 }
 
 // ============================================================================
-// Special Value Types Implementation
+// Composite Value Types Implementation
 // ============================================================================
 
-// Null
-Null::Null() : ValueBase(V_NULL) {}
+// Pair
+Pair::Pair(const Value &car, const Value &cdr) 
+    : ValueBase(V_PAIR), car(car), cdr(cdr) {}
 
-void Null::show(std::ostream &os) {
-    os << "()";
+void Pair::show(Output &out) {
+    Value(this).show(out);
 }
 
-void Null::showCdr(std::ostream &os) {
-    os << ')';
+void Pair::trace(GcVisit visit) {
+    gcVisit(car, visit);
+    gcVisit(cdr, visit);
 }
 
-Value NullV() {
-    return Value(new Null());
+void Pair::clearRefs() {
+    car = NullV();
+    cdr = NullV();
+}
+
+Value PairV(const Value &car, const Value &cdr) {
+    return Value(new Pair(car, cdr));
 }
 
-// Terminate
-Terminate::Terminate() : ValueBase(V_TERMINATE) {}
+// Vector
+Vector::Vector(std::vector<Value> &&elems) : ValueBase(V_VECTOR), elems(std::move(elems)) {}
 
-void Terminate::show(std::ostream &os) {
-    os << "()";
+void Vector::show(Output &out) {
+    if (elems.empty()) out.write("#()", 3);
+    else Value(this).show(out);
 }
 
-Value TerminateV() {
-    return Value(new Terminate());
+void Vector::trace(GcVisit visit) {
+    for (auto &v : elems) gcVisit(v, visit);
 }
 
-// ============================================================================
-// Composite Value Types Implementation
-// ============================================================================
+void Vector::clearRefs() {
+    elems.clear();
+}
 
-// Pair
-Pair::Pair(const Value &car, const Value &cdr) 
-    : ValueBase(V_PAIR), car(car), cdr(cdr) {}
+Value VectorV(std::vector<Value> &&elems) {
+    return Value(new Vector(std::move(elems)));
+}
 
-void Pair::show(std::ostream &os) {
-    os << '(' << car;
-    cdr->showCdr(os);
+// HashTable
+HashTable::HashTable() : ValueBase(V_HASH_TABLE), count(0) {}
+
+static size_t hashKey(const Value &k) {
+    uint64_t h;
+    switch (k.type()) {
+        case V_BIGNUM:   h = static_cast<Bignum*>(k.get())->n.hash(); break;
+        case V_RATIONAL: {
+            Rational *r = static_cast<Rational*>(k.get());
+            h = r->numerator.hash() * 31 + r->denominator.hash();
+            break;
+        }
+        default:         h = k.bits; break;
+    }
+    h *= 0x9E3779B97F4A7C15ull; // 指针和定长数的低位变化少, 取乘积的高位
+    return size_t(h ^ (h >> 32));
+}
+
+static bool sameKey(const Value &a, const Value &b) {
+    if (a == b) return true;
+    if (!a.isHeap() || !b.isHeap() || a.type() != b.type()) return false;
+    switch (a.type()) {
+        case V_BIGNUM:   return static_cast<Bignum*>(a.get())->n == static_cast<Bignum*>(b.get())->n;
+        case V_RATIONAL: {
+            Rational *x = static_cast<Rational*>(a.get()), *y = static_cast<Rational*>(b.get());
+            return x->numerator == y->numerator && x->denominator == y->denominator;
+        }
+        default:         return false;
+    }
 }
 
-void Pair::showCdr(std::ostream &os) {
-    os << ' ' << car;
-    cdr->showCdr(os);
+size_t HashTable::probe(const Value &key) const {
+    size_t mask = slots.size() - 1;
+    size_t i = hashKey(key) & mask;
+    while (!slots[i].key.unbound() && !sameKey(slots[i].key, key)) i = (i + 1) & mask;
+    return i;
 }
 
-Value PairV(const Value &car, const Value &cdr) {
-    return Value(new Pair(car, cdr));
+Value *HashTable::find(const Value &key) {
+    if (slots.empty()) return nullptr;
+    Slot &s = slots[probe(key)];
+    return s.key.unbound() ? nullptr : &s.value;
+}
+
+void HashTable::set(const Value &key, const Value &value) {
+    if (2 * (count + 1) > slots.size()) { // 扩容一倍并重新插入
+        std::vector<Slot> old;
+        old.swap(slots);
+        slots.resize(old.empty() ? 8 : 2 * old.size());
+        for (auto &s : old) {
+            if (!s.key.unbound()) slots[probe(s.key)] = std::move(s);
+        }
+    }
+    Slot &s = slots[probe(key)];
+    if (s.key.unbound()) {
+        s.key = key;
+        ++count;
+    }
+    s.value = value;
+}
+
+void HashTable::show(Output &out) {
+    out.write("#<hash-table>", 13);
+}
+
+void HashTable::trace(GcVisit visit) {
+    for (auto &s : slots) {
+        gcVisit(s.key, visit);
+        gcVisit(s.value, visit);
+    }
+}
+
+void HashTable::clearRefs() {
+    slots.clear();
+    count = 0;
+}
+
+Value HashTableV() {
+    return Value(new HashTable());
 }
 
 // Procedure
-Procedure::Procedure(const std::vector<std::string> &xs, const Expr &e, const Assoc &env)
-    : ValueBase(V_PROC), parameters(xs), e(e), env(env) {}
+Procedure::Procedure(const FrameNames &frame, size_t arity, const Expr &e, const Assoc &env)
+    : ValueBase(V_PROC), frame(frame), arity(arity), e(e), env(env) {}
+
+void Procedure::show(Output &out) {
+    out.write("#<procedure>", 12);
+}
+
+void Procedure::trace(GcVisit visit) {
+    if (env.get() != nullptr) visit(env.get());
+}
+
+void Procedure::clearRefs() {
+    env = empty();
+}
+
+Value ProcedureV(const std::vector<Name> &xs, const Expr &e, const Assoc &env) {
+    return ProcedureV(std::make_shared<const std::vector<Name>>(xs), xs.size(), e, env);
+}
+
+Value ProcedureV(const FrameNames &frame, size_t arity, const Expr &e, const Assoc &env) {
+    return Value(new Procedure(frame, arity, e, env));
+}
+
+// Box
+Box::Box(const Value &v) : ValueBase(V_BOX), v(v) {}
+
+void Box::show(Output &out) {
+    v.show(out);
+}
+
+void Box::trace(GcVisit visit) {
+    gcVisit(v, visit);
+}
+
+void Box::clearRefs() {
+    v = Value(nullptr);
+}
+
+Value BoxV(const Value &v) {
+    return Value(new Box(v));
+}
+
+// Primitive
+Primitive::Primitive(Fn fn, int arity) : ValueBase(V_PRIM), fn(fn), arity(arity) {}
+
+void Primitive::show(Output &out) {
+    out.write("#<procedure>", 12);
+}
+
+Value PrimitiveV(Primitive::Fn fn, int arity) {
+    return Value(new Primitive(fn, arity));
+}
+
+// Future
+Future::Future(const std::shared_ptr<Task> &task) : ValueBase(V_FUTURE), task(task) {}
+
+void Future::show(Output &out) {
+    out.write("#<future>", 9);
+}
+
+void Future::trace(GcVisit visit) {
+    gcVisit(result, visit);
+}
+
+void Future::clearRefs() {
+    result = Value(nullptr);
+}
 
-void Procedure::show(std::ostream &os) {
-    os << "#<procedure>";
+Value FutureV(const std::shared_ptr<Task> &task) {
+    return Value(new Future(task));
 }
 
-Value ProcedureV(const std::vector<std::string> &xs, const Expr &e, const Assoc &env) {
-    return Value(new Procedure(xs, e, env));
+Value applyPrimitive(Primitive *prim, const std::vector<Value> &args) {
+    if (prim->arity >= 0 && args.size() != size_t(prim->arity)) throw RuntimeError("Wrong number of arguments");
+    return prim->fn(args);
 }
 
 // ============================================================================
 // Utility Functions Implementation
 // ============================================================================
 
-std::ostream &operator<<(std::ostream &os, Value &v) {
-    v->show(os);
+std::ostream &operator<<(std::ostream &os, const Value &v) {
+    v.show(os);
     return os;
 }
@@ -11,8 +11,13 @@
 
 #include "Def.hpp"
 #include "expr.hpp"
+#include "bigint.hpp"
+#include "gc.hpp"
+#include "output.hpp"
 #include <memory>
 #include <cstring>
+#include <cstdint>
+#include <unordered_map>
 #include <vector>
 
 // ============================================================================
@@ -20,112 +25,224 @@
 // ============================================================================
 
 /**
- * @brief Base class for all values in the Scheme interpreter
+ * @brief Base class for all heap-allocated values in the Scheme interpreter
  */
-struct ValueBase {
+struct ValueBase : GcObject {
     ValueType v_type;
     ValueBase(ValueType);
-    virtual void show(std::ostream &) = 0;
-    virtual void showCdr(std::ostream &);
-    virtual ~ValueBase() = default;
+    virtual void show(Output &) = 0;   ///< Pairs and vectors are printed by Value::show instead
 };
 
 /**
- * @brief Smart pointer wrapper for ValueBase objects
+ * @brief Tagged value word
+ *
+ * Fixnums and the constants #t, #f, (), #<void> and the exit marker live
+ * inline in the word and never allocate; every other value is a heap
+ * ValueBase with an intrusive (non-atomic) reference count, backed up by the
+ * collector in gc.hpp for cycles.
+ *
+ * Low two bits: 00 heap pointer (all-zero is the "no value" sentinel that
+ * find() returns), 01 fixnum, 10 constant.
  */
 struct Value {
-    std::shared_ptr<ValueBase> ptr;
-    Value(ValueBase *);
-    void show(std::ostream &);
-    ValueBase* operator->() const;
-    ValueBase& operator*();
-    ValueBase* get() const;
+    uint64_t bits;
+
+    Value(ValueBase * = nullptr);
+    Value(const Value &o) : bits(o.bits) { retain(); }
+    Value(Value &&o) noexcept : bits(o.bits) { o.bits = 0; }
+    Value &operator=(Value o) noexcept { std::swap(bits, o.bits); return *this; }
+    ~Value() { release(); }
+
+    static Value fixnumV(int n) { return Value((uint64_t)(int64_t)n << 2 | 1); }
+    static Value constantV(int k) { return Value((uint64_t)k << 2 | 2); }
+
+    bool isHeap() const { return (bits & 3) == 0 && bits != 0; }
+    bool isFixnum() const { return (bits & 3) == 1; }
+    bool unbound() const { return bits == 0; }
+    ValueType type() const;
+    int fixnum() const { return (int)((int64_t)bits >> 2); }
+
+    void show(Output &) const;   ///< Iterative, so long or deep lists and vectors cannot overflow the C++ stack
+    void show(std::ostream &) const;
+    ValueBase* operator->() const { return get(); }
+    ValueBase& operator*() const { return *get(); }
+    ValueBase* get() const { return isHeap() ? reinterpret_cast<ValueBase *>(bits) : nullptr; }
+    bool operator==(const Value &o) const { return bits == o.bits; }
+
+private:
+    explicit Value(uint64_t b) : bits(b) {}
+    void retain() const { if (isHeap()) ++get()->refs; }
+    void release() const { if (isHeap() && --get()->refs == 0) gcFree(get()); }
 };
 
+// Visits the heap object v refers to, if any (for GcObject::trace)
+inline void gcVisit(const Value &v, GcVisit visit) {
+    if (v.isHeap()) visit(v.get());
+}
+
+// Payloads of the inline constants
+enum { K_FALSE, K_TRUE, K_NULL, K_VOID, K_TERMINATE };
+
+inline ValueType Value::type() const {
+    static const ValueType constants[] = {V_BOOL, V_BOOL, V_NULL, V_VOID, V_TERMINATE};
+    switch (bits & 3) {
+        case 0:  return get()->v_type;
+        case 1:  return V_INT;
+        default: return constants[bits >> 2];
+    }
+}
+
 // ============================================================================
 // Environment (Association Lists)
 // ============================================================================
 
 /**
  * @brief Smart pointer wrapper for AssocList (Environment)
+ *
+ * Counts references intrusively like Value.
  */
 struct Assoc {
-    std::shared_ptr<AssocList> ptr;
+    AssocList *ptr;
     Assoc(AssocList *);
-    AssocList* operator->() const;
-    AssocList& operator*();
-    AssocList* get() const;
+    Assoc(const Assoc &o) : ptr(o.ptr) { retain(); }
+    Assoc(Assoc &&o) noexcept : ptr(o.ptr) { o.ptr = nullptr; }
+    Assoc &operator=(Assoc o) noexcept { std::swap(ptr, o.ptr); return *this; }
+    ~Assoc() { release(); }
+    AssocList* operator->() const { return ptr; }
+    AssocList& operator*() { return *ptr; }
+    AssocList* get() const { return ptr; }
+
+private:
+    inline void retain() const;
+    inline void release() const;
+};
+
+/**
+ * @brief Environment frame
+ *
+ * One frame holds all the bindings introduced by a procedure call, let or
+ * letrec in a contiguous array; the slot names are shared with the Expr that
+ * declared the frame. The last frame of a chain is normally the GlobalEnv.
+ */
+struct AssocList : GcObject {
+    FrameNames names;           ///< Slot names
+    std::vector<Value> values;  ///< Slot values, parallel to names
+    Assoc next;                 ///< Enclosing frame
+    bool isGlobal;              ///< This is a GlobalEnv
+    AssocList(const FrameNames &, std::vector<Value> &&, const Assoc &);
+    virtual void trace(GcVisit) override;
+    virtual void clearRefs() override;
 };
 
 /**
- * @brief Association list node for variable bindings
+ * @brief Top-level environment
+ *
+ * Holds the top-level definitions in a hash table of cells instead of frame
+ * slots. Cells never move (the table is node based) and are never removed,
+ * so the parser resolves every global variable to its cell once, and
+ * Var/Define/Set read and write the cell directly. A cell is created, unbound,
+ * when a name is first referenced; it is bound by the first define.
+ *
+ * The syntax-rules macros defined at top level live here too; a top-level
+ * define of the same name removes the macro.
  */
-struct AssocList {
-    std::string x;      ///< Variable name
-    Value v;            ///< Variable value
-    Assoc next;         ///< Next binding in the chain
-    AssocList(const std::string &, const Value &, Assoc &);
+struct GlobalEnv : AssocList {
+    std::unordered_map<Name, Value> cells;
+    std::unordered_map<Name, std::shared_ptr<const Macro>> macros;
+    GlobalEnv();
+    ~GlobalEnv() override;
+    Value *cell(Name);   ///< The cell of x, created unbound if there is none
+    virtual void trace(GcVisit) override;
+    virtual void clearRefs() override;
 };
 
+inline void Assoc::retain() const { if (ptr != nullptr) ++ptr->refs; }
+inline void Assoc::release() const { if (ptr != nullptr && --ptr->refs == 0) gcFree(ptr); }
+
 // Environment operations
 Assoc empty();
-Assoc extend(const std::string&, const Value &, Assoc &);
-void modify(const std::string&, const Value &, Assoc &);
-Value find(const std::string &, Assoc &);
+Assoc globalEnv();                    ///< A new top-level environment without definitions
+GlobalEnv *globalsOf(const Assoc &);  ///< The top-level environment ending the chain, nullptr if none
+const Assoc &outermost(const Assoc &);  ///< The last frame of the chain, normally the GlobalEnv
+Assoc extend(Name, const Value &, Assoc &);
+Assoc extend(const FrameNames &, std::vector<Value> &&, const Assoc &);
+Value find(Name, const Assoc &);
+
+// Lexically addressed access (see Var): no name comparisons.
+const Assoc &skip(int depth, const Assoc &);
+Value &locate(int depth, int slot, const Assoc &);
+
+// ============================================================================
+// Immediate Values
+// ============================================================================
+
+inline Value VoidV() { return Value::constantV(K_VOID); }
+inline Value IntegerV(int n) { return Value::fixnumV(n); }
+inline Value BooleanV(bool b) { return Value::constantV(b ? K_TRUE : K_FALSE); }
+inline Value NullV() { return Value::constantV(K_NULL); }
+inline Value TerminateV() { return Value::constantV(K_TERMINATE); }
+
+/// Everything except #f counts as true
+inline bool isFalse(const Value &v) { return v == BooleanV(false); }
 
 // ============================================================================
 // Simple Value Types
 // ============================================================================
 
 /**
- * @brief Void value (represents no meaningful return value)
+ * @brief Integer value that does not fit in a fixnum
+ *
+ * IntegerV(const BigInt &) keeps the representation canonical: an integer
+ * is a Bignum exactly when it is outside the int range.
  */
-struct Void : ValueBase {
-    Void();
-    virtual void show(std::ostream &) override;
+struct Bignum : ValueBase {
+    BigInt n;
+    Bignum(const BigInt &);
+    virtual void show(Output &) override;
 };
-Value VoidV();
+Value IntegerV(const BigInt &);   ///< A fixnum whenever it fits
 
-/**
- * @brief Integer value
- */
-struct Integer : ValueBase {
-    int n;
-    Integer(int);
-    virtual void show(std::ostream &) override;
-};
-Value IntegerV(int);
+inline bool isInteger(const Value &v) { return v.isFixnum() || v.type() == V_BIGNUM; }
+BigInt toBigInt(const Value &);   ///< v must satisfy isInteger
 
 /**
  * @brief Rational number value
+ *
+ * Always in lowest terms with a denominator greater than 1; whole numbers
+ * are integers.
  */
 struct Rational : ValueBase {
-    int numerator;
-    int denominator;
-    Rational(int, int);
-    virtual void show(std::ostream &) override;
-};
-Value RationalV(int, int);
-
-/**
- * @brief Boolean value
- */
-struct Boolean : ValueBase {
-    bool b;
-    Boolean(bool);
-    virtual void show(std::ostream &) override;
+    BigInt numerator;
+    BigInt denominator;
+    Rational(const BigInt &, const BigInt &);
+    virtual void show(Output &) override;
 };
-Value BooleanV(bool);
+Value RationalV(int, int);   ///< Normalised; a whole number becomes an integer
+Value RationalV(const BigInt &, const BigInt &);
 
 /**
  * @brief Symbol value
+ *
+ * Symbols are interned: there is one Symbol per spelling, created by intern()
+ * and never freed, and it doubles as the Name of identifiers with that
+ * spelling. eq? on symbols is therefore a pointer comparison.
  */
 struct Symbol : ValueBase {
     std::string s;
+    Symbol *original = nullptr;   ///< The identifier an alias stands for, nullptr for other symbols
     Symbol(const std::string &);
-    virtual void show(std::ostream &) override;
+    virtual void show(Output &) override;
 };
+Name intern(const std::string &);
+Name gensym(Name);   ///< A new uninterned symbol spelled like x, not eq? to any other
+Name alias(Name);    ///< A gensym of x that stands for x where nothing binds the alias itself
+/// The identifier x stands for once all its aliases are taken off
+inline Name unalias(Name x) {
+    while (x->original != nullptr) x = x->original;
+    return x;
+}
 Value SymbolV(const std::string &);
+inline Value SymbolV(Name n) { return Value(n); }
 
 /**
  * @brief String value
@@ -133,65 +250,173 @@ Value SymbolV(const std::string &);
 struct String : ValueBase {
     std::string s;
     String(const std::string &);
-    virtual void show(std::ostream &) override;
+    virtual void show(Output &) override;
 };
 Value StringV(const std::string &);
 
 // ============================================================================
-// Special Value Types
+// Composite Value Types
 // ============================================================================
 
 /**
- * @brief Null value (empty list)
+ * @brief Pair value (cons cell)
  */
-struct Null : ValueBase {
-    Null();
-    virtual void show(std::ostream &) override;
-    virtual void showCdr(std::ostream &) override;
+struct Pair : ValueBase {
+    Value car;  ///< First element
+    Value cdr;  ///< Second element
+    Pair(const Value &, const Value &);
+    virtual void show(Output &) override;
+    virtual void trace(GcVisit) override;
+    virtual void clearRefs() override;
 };
-Value NullV();
+Value PairV(const Value &, const Value &);
 
 /**
- * @brief Termination signal value
+ * @brief Vector value
+ *
+ * The elements are stored inline in one contiguous array, so vector-ref and
+ * vector-set! take constant time and an element costs one word instead of a
+ * pair.
  */
-struct Terminate : ValueBase {
-    Terminate();
-    virtual void show(std::ostream &) override;
+struct Vector : ValueBase {
+    std::vector<Value> elems;
+    Vector(std::vector<Value> &&);
+    virtual void show(Output &) override;
+    virtual void trace(GcVisit) override;
+    virtual void clearRefs() override;
 };
-Value TerminateV();
-
-// ============================================================================
-// Composite Value Types
-// ============================================================================
+Value VectorV(std::vector<Value> &&);
 
 /**
- * @brief Pair value (cons cell)
+ * @brief Hash table value
+ *
+ * Keys match like eq?: bignums and rationals by value, everything else by
+ * identity. The hash of any other key is its tagged word, so symbols and
+ * fixnums, the usual keys, are hashed without looking at their contents.
+ * Open addressing with linear probing, in a power-of-two array of slots that
+ * is kept at most half full; entries are never removed.
  */
-struct Pair : ValueBase {
-    Value car;  ///< First element
-    Value cdr;  ///< Second element
-    Pair(const Value &, const Value &);
-    virtual void show(std::ostream &) override;
-    virtual void showCdr(std::ostream &) override;
+struct HashTable : ValueBase {
+    struct Slot {
+        Value key;     ///< Unbound in an empty slot
+        Value value;
+    };
+    std::vector<Slot> slots;
+    size_t count;
+    HashTable();
+    Value *find(const Value &key);   ///< The value stored under key, nullptr if there is none
+    void set(const Value &key, const Value &value);
+    virtual void show(Output &) override;
+    virtual void trace(GcVisit) override;
+    virtual void clearRefs() override;
+
+private:
+    size_t probe(const Value &key) const;   ///< The slot of key, or the empty slot where it would go
 };
-Value PairV(const Value &, const Value &);
+Value HashTableV();
 
 /**
  * @brief Procedure (function) value
  */
 struct Procedure : ValueBase {
-    std::vector<std::string> parameters;   ///< Parameter names
+    FrameNames frame;                      ///< Parameter names followed by internal defines
+    size_t arity;                          ///< Number of parameters
     Expr e;                                ///< Function body expression
-    Assoc env;                             ///< Closure environment
-    Procedure(const std::vector<std::string> &, const Expr &, const Assoc &);
-    virtual void show(std::ostream &) override;
+    Assoc env;                             ///< Frame of the captured variables (see Lambda)
+    Procedure(const FrameNames &, size_t, const Expr &, const Assoc &);
+    virtual void show(Output &) override;
+    virtual void trace(GcVisit) override;
+    virtual void clearRefs() override;
+};
+Value ProcedureV(const std::vector<Name> &, const Expr &, const Assoc &);
+Value ProcedureV(const FrameNames &, size_t, const Expr &, const Assoc &);
+
+/**
+ * @brief A variable shared by its frame and the closures that captured it
+ *
+ * Closures copy the variables they use (see Lambda), so a variable that may
+ * still be assigned is moved into a Box when it is first captured, and from
+ * then on its slot and every copy hold the same Box. A Box is never the value
+ * of an expression: the local variable accesses go through unbox().
+ */
+struct Box : ValueBase {
+    Value v;
+    explicit Box(const Value &);
+    virtual void show(Output &) override;
+    virtual void trace(GcVisit) override;
+    virtual void clearRefs() override;
+};
+Value BoxV(const Value &);
+
+/// The variable held in a frame slot: the slot itself, or the Box in it
+inline Value &unbox(Value &slot) {
+    return slot.type() == V_BOX ? static_cast<Box*>(slot.get())->v : slot;
+}
+
+/**
+ * @brief Built-in procedure value
+ *
+ * One object per primitive, created on first use and shared by every
+ * reference to the primitive's name, so passing `car` around allocates
+ * nothing.
+ */
+struct Primitive : ValueBase {
+    typedef Value (*Fn)(const std::vector<Value> &);
+    Fn fn;                                 ///< Implementation, called with the evaluated arguments
+    int arity;                             ///< Number of arguments, -1 if variadic
+    Primitive(Fn, int);
+    virtual void show(Output &) override;
+};
+Value PrimitiveV(Primitive::Fn, int);
+Value applyPrimitive(Primitive *, const std::vector<Value> &);
+/// Calls fun, a procedure or primitive, with args on the tree walker
+Value applyProcedure(const Value &fun, std::vector<Value> args);
+
+struct Task;
+
+/**
+ * @brief Result of (future thunk), computed on a worker thread
+ *
+ * The task belongs to no heap (see parallel.hpp); the result is decoded into
+ * the heap of the thread that touches the future first and kept here.
+ */
+struct Future : ValueBase {
+    std::shared_ptr<Task> task;
+    Value result;                          ///< Unbound until touched
+    Future(const std::shared_ptr<Task> &);
+    virtual void show(Output &) override;
+    virtual void trace(GcVisit) override;
+    virtual void clearRefs() override;
 };
-Value ProcedureV(const std::vector<std::string> &, const Expr &, const Assoc &);
+Value FutureV(const std::shared_ptr<Task> &);
+const Value *builtin(Name);   ///< The shared procedure object of a primitive, nullptr if the name is none
+
+// Procedures and primitives are both applicable
+inline bool isProcedure(const Value &v) {
+    return v.type() == V_PROC || v.type() == V_PRIM;
+}
+
+/**
+ * @brief Version of the procedures held by global cells
+ *
+ * Call sites cache the procedure a global operator held (see Apply), valid
+ * while the epoch is unchanged. It advances when a cell that held a
+ * procedure, or was unbound, is written; assigning numbers to a global
+ * counter leaves the caches alone. Each thread has its own epoch, like its
+ * own heap.
+ */
+extern thread_local uint64_t globalEpoch;
+
+/// Writes a global cell, advancing globalEpoch when cached callees may change
+inline void assignGlobal(Value *cell, const Value &v) {
+    if (cell->unbound() || isProcedure(*cell)) ++globalEpoch;
+    *cell = v;
+}
 
 // ============================================================================
 // Utility Functions
 // ============================================================================
 
-std::ostream &operator<<(std::ostream &, Value &);
+std::ostream &operator<<(std::ostream &, const Value &);
 
 #endif // VALUE
\ No newline at end of file
@@ -0,0 +1,370 @@
+/**
+ * @file vm.cpp
+ * @brief Stack machine executing compiled bytecode
+ *
+ * The machine keeps the current code, pc and environment in registers. A call
+ * saves them on the call stack; a tail call just replaces them, so loops
+ * written as tail recursion run in constant space. The environment frames are
+ * the same AssocList frames the tree walker uses, so OP_EVAL can hand any node
+ * to ExprBase::eval with the current environment.
+ *
+ * The procedure being run stays on the value stack, in the slot it was called
+ * from, and keeps its code alive there; its return value takes the slot over.
+ * A call to a global goes through the inline cache of its Apply node, like in
+ * the tree walker. A top-level form that only makes a value, such as a define
+ * of a procedure, is evaluated by its node: it runs once, so compiling it
+ * would cost more than it saves.
+ */
+
+#include "vm.hpp"
+#include "RE.hpp"
+#include "profile.hpp"
+#include "stats.hpp"
+#include <new>
+#include <utility>
+
+using std::vector;
+
+namespace {
+
+struct CallFrame {
+    const Bytecode *bc;
+    const Instr *pc;
+    AssocList *env;  ///< The caller's environment, whose reference the frame holds
+    size_t scopes;   ///< Height of the let-scope stack when the call was made
+    size_t callee;   ///< Stack slot of the caller's own procedure
+};
+
+/**
+ * The calls in progress. A call takes the reference of the env register
+ * over and a return hands it back, so neither touches the reference count;
+ * the frames popped are kept for the next calls.
+ */
+class CallStack {
+public:
+    size_t depth = 0;
+
+    ~CallStack() {
+        while (depth > 0) {
+            Assoc env(nullptr);
+            env.ptr = frames[--depth].env; // 出错退出时释放
+        }
+    }
+
+    void push(const Bytecode *bc, const Instr *pc, Assoc &env, size_t scopes, size_t callee) {
+        if (depth == frames.size()) frames.resize(2 * depth + 16);
+        CallFrame &f = frames[depth++];
+        f.bc = bc;
+        f.pc = pc;
+        f.env = env.ptr;
+        env.ptr = nullptr;
+        f.scopes = scopes;
+        f.callee = callee;
+    }
+    /// The caller's frame, its environment given back to env in place of the callee's
+    const CallFrame &pop(Assoc &env) {
+        const CallFrame &f = frames[--depth];
+        Assoc done(nullptr);
+        done.ptr = env.ptr; // 被调用者的环境在此释放
+        env.ptr = f.env;
+        return f;
+    }
+
+private:
+    vector<CallFrame> frames;
+};
+
+/**
+ * The value stack. The slots below top hold values and the rest is raw
+ * memory, so a push constructs one Value and a pop destroys one, with no
+ * bounds or size bookkeeping beyond the check for room.
+ */
+class Stack {
+public:
+    Value *top;
+
+    Stack() : top(allocate(INITIAL_SLOTS)), base(top), limit(top + INITIAL_SLOTS) {}
+    ~Stack() {
+        while (top != base) (--top)->~Value();
+        ::operator delete(base);
+    }
+    Stack(const Stack &) = delete;
+    Stack &operator=(const Stack &) = delete;
+
+    void push(const Value &v) {
+        if (top == limit) grow();
+        new (top++) Value(v);
+    }
+    void push(Value &&v) {
+        if (top == limit) grow();
+        new (top++) Value(std::move(v));
+    }
+    void pop() { (--top)->~Value(); }
+    /// Drops the top n slots, whose values were moved out
+    void drop(size_t n) { top -= n; }
+    /// Pops n values and pushes v, which may be one of them, in their place
+    void replace(size_t n, Value &&v) {
+        Value *slot = top - n;
+        uint64_t b = slot->bits; // v接过原来的值, 由调用者或下面的pop释放
+        slot->bits = v.bits;
+        v.bits = b;
+        while (top != slot + 1) pop();
+    }
+    Value &back() { return top[-1]; }
+    size_t size() const { return size_t(top - base); }
+
+private:
+    static const size_t INITIAL_SLOTS = 256;
+    Value *base, *limit;
+
+    static Value *allocate(size_t n) { return static_cast<Value*>(::operator new(n * sizeof(Value))); }
+    void grow() {
+        size_t n = size_t(limit - base);
+        Value *bigger = allocate(2 * n);
+        for (size_t i = 0; i < n; ++i) {
+            new (bigger + i) Value(std::move(base[i]));
+            base[i].~Value();
+        }
+        ::operator delete(base);
+        base = bigger;
+        top = bigger + n;
+        limit = bigger + 2 * n;
+    }
+};
+
+// The top n values, popped into a vector of `size` slots; the slots after
+// them are left unbound
+vector<Value> popValues(Stack &stack, size_t n, size_t size) {
+    vector<Value> vals(size);
+    Value *out = vals.data(), *in = stack.top - n;
+    for (size_t i = 0; i < n; ++i) std::swap(out[i].bits, in[i].bits); // 原槽位变为未绑定, 不必析构
+    stack.drop(n);
+    return vals;
+}
+
+// Fills the unbound slots popValues left with void
+void padVoid(vector<Value> &vals, size_t from) {
+    for (size_t i = from; i < vals.size(); ++i) vals[i] = VoidV();
+}
+
+const Bytecode &bodyCode(Procedure *proc) {
+    ExprBase *body = proc->e.get();
+    if (!body->bytecode) body->bytecode = std::make_shared<Bytecode>(compile(body));
+    return *body->bytecode;
+}
+
+} // namespace
+
+Value run(const Bytecode &top, const Assoc &topEnv) {
+    Stack stack;
+    CallStack calls;
+    vector<Assoc> scopes;   // 进入let/letrec之前的环境
+
+    const Bytecode *bc = &top;
+    const Instr *pc = bc->code.data();
+    Assoc env = topEnv;
+    size_t scopeBase = 0;
+    // 正在运行的过程留在栈上被调用者的位置, 并由此保持其代码存活, 返回值代替它;
+    // 最外层的代码占一个空位置
+    size_t calleeSlot = 0;
+    stack.push(Value());
+    PROFILE_SCOPE();
+    stats::DepthScope depthScope;
+    stats::enterCall(); // 同树遍历: 最外层的代码也算一层
+
+    while (true) {
+        const Instr &in = *pc++;
+        switch (in.op) {
+            case OP_CONST:
+                stack.push(bc->consts[in.a]);
+                break;
+            case OP_LOCAL:
+                stack.push(unbox(locate(in.a, in.b, env)));
+                break;
+            case OP_GLOBAL: { // 未绑定时由Var::eval查找内置函数或报错
+                Var *var = static_cast<Var*>(bc->exprs[in.a]);
+                if (var->cell != nullptr && !var->cell->unbound()) {
+                    ++stats::counters.globalLookups;
+                    stack.push(*var->cell);
+                } else stack.push(var->eval(env));
+                break;
+            }
+            case OP_STORE:
+                unbox(locate(in.a, in.b, env)) = std::move(stack.back());
+                stack.pop();
+                break;
+            case OP_BIND:
+                static_cast<Define*>(bc->exprs[in.a])->bind();
+                break;
+            case OP_CHECK_GLOBAL: {
+                Set *set = static_cast<Set*>(bc->exprs[in.a]);
+                if (set->cell == nullptr || set->cell->unbound()) throw RuntimeError("Undefined variable : " + set->var->s);
+                break;
+            }
+            case OP_STORE_GLOBAL:
+                ++stats::counters.globalLookups;
+                assignGlobal(bc->cells[in.a], stack.back());
+                stack.pop();
+                break;
+            case OP_CAPTURE:
+                stack.push(locate(in.a, in.b, env));
+                break;
+            case OP_CAPTURE_BOX: {
+                Value &v = locate(in.a, in.b, env);
+                if (v.type() != V_BOX) v = BoxV(v); // 同Lambda::eval: 此后槽位和副本共用
+                stack.push(v);
+                break;
+            }
+            case OP_CLOSURE: {
+                Lambda *l = static_cast<Lambda*>(bc->exprs[in.a]);
+                const Assoc &top = outermost(env);
+                if (in.b == 0) {
+                    stack.push(ProcedureV(l->frame, l->x.size(), l->e, top));
+                    break;
+                }
+                vector<Value> vals = popValues(stack, in.b, in.b);
+                stack.push(ProcedureV(l->frame, l->x.size(), l->e, extend(l->captureFrame, std::move(vals), top)));
+                break;
+            }
+            case OP_EVAL:
+                stack.push(bc->exprs[in.a]->eval(env));
+                break;
+            case OP_POP:
+                stack.pop();
+                break;
+            case OP_JUMP:
+                pc = bc->code.data() + in.a;
+                break;
+            case OP_JUMP_FALSE: {
+                bool f = isFalse(stack.back());
+                stack.pop();
+                if (f) pc = bc->code.data() + in.a;
+                break;
+            }
+            case OP_JUMP_TRUE:
+                if (!isFalse(stack.back())) pc = bc->code.data() + in.a;
+                else stack.pop();
+                break;
+            case OP_NEXT:
+                if (stack.back().type() == V_TERMINATE) pc = bc->code.data() + in.a;
+                else stack.pop();
+                break;
+            case OP_JUMP_EXIT:
+                if (stack.back().type() == V_TERMINATE) pc = bc->code.data() + in.a;
+                break;
+
+            case OP_UNARY:
+                stack.replace(1, static_cast<Unary*>(bc->exprs[in.a])->evalRator(stack.back()));
+                break;
+            case OP_BINARY:
+                stack.replace(2, static_cast<Binary*>(bc->exprs[in.a])->evalRator(stack.top[-2], stack.top[-1]));
+                break;
+            case OP_VARIADIC: {
+                vector<Value> args = popValues(stack, in.b, in.b);
+                stack.push(static_cast<Variadic*>(bc->exprs[in.a])->evalRator(args));
+                break;
+            }
+
+            case OP_ENTER: {
+                const FrameNames &names = bc->frames[in.a];
+                vector<Value> vals = popValues(stack, in.b, names->size());
+                padVoid(vals, in.b);
+                scopes.push_back(env);
+                env = extend(names, std::move(vals), env);
+                break;
+            }
+            case OP_ENTER_REC: {
+                const FrameNames &names = bc->frames[in.a];
+                scopes.push_back(env);
+                env = extend(names, vector<Value>(names->size(), VoidV()), env);
+                break;
+            }
+            case OP_LEAVE:
+                env = std::move(scopes.back());
+                scopes.pop_back();
+                break;
+
+            case OP_CALLEE: { // 同Apply::eval: 缓存命中时不读取变量也不再检查
+                bool checked;
+                stack.push(static_cast<Apply*>(bc->exprs[in.a])->callee(env, checked));
+                break;
+            }
+            case OP_CHECK_PROC:
+                if (!isProcedure(stack.back())) throw RuntimeError("Attempt to apply a non-procedure");
+                break;
+            case OP_CALL:
+            case OP_TAIL_CALL: {
+                gcSafePoint();
+                ++stats::counters.calls;
+                size_t argc = in.a;
+                Value &callee = stack.top[-1 - int(argc)];
+
+                if (callee.type() == V_PRIM) {
+                    Primitive *prim = static_cast<Primitive*>(callee.get());
+                    vector<Value> argv = popValues(stack, argc, argc);
+                    stack.replace(1, applyPrimitive(prim, argv)); // 代替被调用者; 尾调用时由其后的OP_RETURN返回
+                    break;
+                }
+                Procedure *proc = static_cast<Procedure*>(callee.get());
+                if (argc != proc->arity) throw RuntimeError("Wrong number of arguments");
+                vector<Value> argv = popValues(stack, argc, proc->frame->size());
+                if (argv.size() > argc) padVoid(argv, argc); // 内部define占位符
+                Assoc penv = extend(proc->frame, std::move(argv), proc->env);
+                const Bytecode &code = bodyCode(proc);
+
+                if (in.op == OP_CALL) {
+                    calls.push(bc, pc, env, scopeBase, calleeSlot);
+                    scopeBase = scopes.size();
+                    calleeSlot = stack.size() - 1;
+                    stats::enterCall();
+                    PROFILE_ENTER(proc);
+                } else {
+                    if (scopes.size() > scopeBase) scopes.erase(scopes.begin() + scopeBase, scopes.end());
+                    stack.replace(stack.size() - calleeSlot, std::move(callee)); // 新的过程代替当前的
+                    PROFILE_CALL(proc);
+                }
+                bc = &code;
+                pc = code.code.data();
+                std::swap(env.ptr, penv.ptr); // 尾调用时当前的环境随penv释放
+                break;
+            }
+            case OP_RETURN: {
+                if (calls.depth == 0) return std::move(stack.back());
+                PROFILE_RETURN();
+                stats::leaveCall();
+                if (scopes.size() > scopeBase) scopes.erase(scopes.begin() + scopeBase, scopes.end());
+                stack.replace(stack.size() - calleeSlot, std::move(stack.back()));
+                const CallFrame &caller = calls.pop(env);
+                bc = caller.bc;
+                pc = caller.pc;
+                scopeBase = caller.scopes;
+                calleeSlot = caller.callee;
+                break;
+            }
+        }
+    }
+}
+
+namespace {
+
+// Whether e is run once and does nothing but make one value: compiling it
+// costs more than evaluating the node
+bool trivial(ExprBase *e) {
+    switch (e->e_type) {
+        case E_FIXNUM: case E_BIGNUM: case E_RATIONAL: case E_STRING:
+        case E_TRUE: case E_FALSE: case E_QUOTE: case E_VAR: case E_LAMBDA:
+            return true;
+        case E_DEFINE:
+            return trivial(static_cast<Define*>(e)->e.get());
+        default:
+            return false;
+    }
+}
+
+} // namespace
+
+Value vmEval(const Expr &expr, Assoc &env) {
+    if (trivial(expr.get())) return expr->eval(env); // 例如顶层的(define (f x) ...)
+    Bytecode bc = compile(expr.get());
+    return run(bc, env);
+}
@@ -0,0 +1,83 @@
+#ifndef VM_HPP
+#define VM_HPP
+
+/**
+ * @file vm.hpp
+ * @brief Bytecode compiler and stack machine
+ *
+ * An alternative execution engine to the ExprBase::eval tree walker, selected
+ * with `--vm`. compile() lowers a parsed Expr into a flat instruction stream
+ * that run() executes on a value stack, with calls and tail calls handled by
+ * the machine instead of the C++ stack. Procedure bodies are compiled on their
+ * first call and kept on the body node.
+ *
+ * Every node type has instructions of its own; literals and quoted data
+ * become constants, the same values the tree walker materialises on the
+ * node. OP_EVAL, which hands a node to the tree walker, is left for node types
+ * the compiler does not know, and vmEval leaves a top-level form that only
+ * makes a value to its node. The tree walker stays the reference
+ * implementation and the two engines are observably identical.
+ */
+
+#include "Def.hpp"
+#include "expr.hpp"
+#include "value.hpp"
+#include <vector>
+
+enum OpCode {
+    OP_CONST,          ///< push consts[a]
+    OP_LOCAL,          ///< push slot b of the frame a levels up
+    OP_GLOBAL,         ///< push the global the Var exprs[a] refers to
+    OP_STORE,          ///< pop into slot b of the frame a levels up
+    OP_BIND,           ///< create the global of the Define exprs[a] unless it exists
+    OP_CHECK_GLOBAL,   ///< fail unless the global the Set exprs[a] assigns is bound
+    OP_STORE_GLOBAL,   ///< pop into the global cell cells[a]
+    OP_CAPTURE,        ///< push slot b of the frame a levels up, as a closure captures it
+    OP_CAPTURE_BOX,    ///< same, boxing the slot first unless it already holds a box
+    OP_CLOSURE,        ///< push a closure of the Lambda exprs[a] over the top b values
+    OP_EVAL,           ///< push exprs[a]->eval(env)
+    OP_POP,            ///< drop the top of the stack
+    OP_JUMP,           ///< continue at a
+    OP_JUMP_FALSE,     ///< pop, continue at a if it was #f
+    OP_JUMP_TRUE,      ///< continue at a keeping the top if it is not #f, otherwise pop
+    OP_NEXT,           ///< pop, unless it is the terminate marker: then continue at a keeping it
+    OP_JUMP_EXIT,      ///< continue at a if the top is the terminate marker, keeping the top either way
+    OP_UNARY,          ///< apply the Unary exprs[a] to the top value
+    OP_BINARY,         ///< apply the Binary exprs[a] to the top two values
+    OP_VARIADIC,       ///< apply the Variadic exprs[a] to the top b values
+    OP_ENTER,          ///< open frame frames[a] holding the top b values
+    OP_ENTER_REC,      ///< open frame frames[a] with every slot void
+    OP_LEAVE,          ///< return to the environment before the last OP_ENTER*
+    OP_CALLEE,         ///< push the operator of the Apply exprs[a], a global: its cached callee while valid
+    OP_CHECK_PROC,     ///< fail unless the top is a procedure
+    OP_CALL,           ///< call the procedure below the top a values
+    OP_TAIL_CALL,      ///< same, replacing the current call
+    OP_RETURN          ///< return the top value to the caller
+};
+
+struct Instr {
+    OpCode op;
+    int a, b;
+};
+
+/**
+ * @brief Compiled form of one procedure body or top-level expression
+ *
+ * exprs does not own its nodes: they belong to the Expr tree the code was
+ * compiled from, which outlives it.
+ */
+struct Bytecode {
+    std::vector<Instr> code;
+    std::vector<Value> consts;
+    std::vector<ExprBase*> exprs;
+    std::vector<FrameNames> frames;
+    std::vector<Value*> cells;   ///< Global cells, which live as long as the global environment
+};
+
+Bytecode compile(ExprBase *);
+Value run(const Bytecode &, const Assoc &);
+
+// Evaluates a top-level expression with the VM
+Value vmEval(const Expr &, Assoc &);
+
+#endif // VM_HPP